@@ -4,6 +4,8 @@
 #include <ngx_core.h>
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_codec_module.h>
+#include <ngx_rtmp_expire.h>
+#include <ngx_rtmp_file.h>
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_mp4.h"
 
@@ -21,6 +23,7 @@ static char * ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static ngx_int_t ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s);
 static ngx_int_t ngx_rtmp_dash_ensure_directory(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_dash_write_hls_playlists(ngx_rtmp_session_t *s);
 
 
 #define NGX_RTMP_DASH_BUFSIZE           (1024*1024*5)
@@ -46,6 +49,9 @@ typedef struct {
     char                                type;
     uint32_t                            earliest_pres_time;
     uint32_t                            latest_pres_time;
+    ngx_uint_t                          bandwidth; /* peak, bits/s */
+    ngx_fd_t                            cache_fd;  /* previous fragment */
+    off_t                               cache_size;
     ngx_rtmp_mp4_sample_t               samples[NGX_RTMP_DASH_MAX_SAMPLES];
 } ngx_rtmp_dash_track_t;
 
@@ -69,6 +75,7 @@ typedef struct {
     ngx_file_t                          audio_file;
 
     ngx_uint_t                          id;
+    ngx_uint_t                          hls_bandwidth; /* in master playlist */
 
     ngx_rtmp_dash_track_t               audio;
     ngx_rtmp_dash_track_t               video;
@@ -78,6 +85,7 @@ typedef struct {
 typedef struct {
     ngx_str_t                           path;
     ngx_msec_t                          playlen;
+    ngx_rtmp_expire_t                  *expire;
 } ngx_rtmp_dash_cleanup_t;
 
 
@@ -99,6 +107,7 @@ typedef struct {
     ngx_msec_t                          fraglen;
     ngx_msec_t                          playlen;
     ngx_flag_t                          nested;
+    ngx_flag_t                          hls;
     ngx_uint_t                          clock_compensation;     // Try to compensate clock drift
                                                                 //  between client and server (on client side)
     ngx_str_t                           clock_helper_uri;       // Use uri to static file on HTTP server
@@ -107,6 +116,10 @@ typedef struct {
     ngx_str_t                           path;
     ngx_uint_t                          winfrags;
     ngx_flag_t                          cleanup;
+    size_t                              cleanup_queue;
+    ngx_rtmp_expire_t                  *expire;
+    ngx_flag_t                          preallocate;
+    ngx_flag_t                          drop_cache;
     ngx_path_t                         *slot;
 } ngx_rtmp_dash_app_conf_t;
 
@@ -148,6 +161,27 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, cleanup),
       NULL },
 
+    { ngx_string("dash_cleanup_queue"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, cleanup_queue),
+      NULL },
+
+    { ngx_string("dash_preallocate"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, preallocate),
+      NULL },
+
+    { ngx_string("dash_drop_cache"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, drop_cache),
+      NULL },
+
     { ngx_string("dash_nested"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -155,6 +189,13 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, nested),
       NULL },
 
+    { ngx_string("dash_hls"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, hls),
+      NULL },
+
     { ngx_string("dash_clock_compensation"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_enum_slot,
@@ -267,7 +308,8 @@ static ngx_int_t
 ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 {
     char                      *sep;
-    u_char                    *p, *last;
+    u_char                    *buffer, *p, *last;
+    size_t                     len;
     ssize_t                    n;
     ngx_fd_t                   fd;
     struct tm                  tm;
@@ -285,11 +327,11 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 
     //ngx_rtmp_playlist_t        v;
 
-    static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
     static u_char              avaliable_time[NGX_RTMP_DASH_GMT_LENGTH];
     static u_char              publish_time[NGX_RTMP_DASH_GMT_LENGTH];
     static u_char              buffer_depth[sizeof("P00Y00M00DT00H00M00.000S")];
     static u_char              frame_rate[(NGX_INT_T_LEN * 2) + 2];
+    static u_char              codecs[64];
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
@@ -303,16 +345,6 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         ngx_rtmp_dash_write_init_segments(s);
     }
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: open failed: '%V'", &ctx->playlist_bak);
-        return NGX_ERROR;
-    }
-
-
 #define NGX_RTMP_DASH_MANIFEST_HEADER                                          \
     "<?xml version=\"1.0\"?>\n"                                                \
     "<MPD\n"                                                                   \
@@ -343,9 +375,9 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "        maxFrameRate=\"%s\"\n"                                            \
     "        par=\"%ui:%ui\">\n"                                               \
     "      <Representation\n"                                                  \
-    "          id=\"%V_H264\"\n"                                               \
+    "          id=\"%V_%s\"\n"                                                 \
     "          mimeType=\"video/mp4\"\n"                                       \
-    "          codecs=\"avc1.%02uxi%02uxi%02uxi\"\n"                           \
+    "          codecs=\"%s\"\n"                                                \
     "          width=\"%ui\"\n"                                                \
     "          height=\"%ui\"\n"                                               \
     "          frameRate=\"%s\"\n"                                             \
@@ -444,8 +476,6 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                  tm.tm_min, tm.tm_sec,
                  depth_msec) = 0;
 
-    last = buffer + sizeof(buffer);
-
     /**
      * Calculate playlist minimal update period
      * This should be more than biggest segment duration
@@ -478,6 +508,31 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     buffer_time -= buffer_time_msec;
     buffer_time /= 1000;
 
+    /* whole manifest is built in memory and written at once */
+
+    len = sizeof(NGX_RTMP_DASH_MANIFEST_HEADER) + sizeof(avaliable_time) * 2
+          + sizeof(buffer_depth) + NGX_INT_T_LEN * 6
+          + sizeof(NGX_RTMP_DASH_MANIFEST_PERIOD)
+          + sizeof(NGX_RTMP_DASH_MANIFEST_VIDEO) + sizeof(frame_rate) * 2
+          + sizeof(codecs)
+          + NGX_INT_T_LEN * 10 + ctx->name.len * 3
+          + sizeof(NGX_RTMP_DASH_MANIFEST_VIDEO_FOOTER)
+          + sizeof(NGX_RTMP_DASH_MANIFEST_AUDIO) + NGX_INT_T_LEN * 2
+          + ctx->name.len * 3
+          + sizeof(NGX_RTMP_DASH_MANIFEST_AUDIO_FOOTER)
+          + (sizeof(NGX_RTMP_DASH_MANIFEST_TIME) + NGX_INT32_LEN * 2)
+            * ctx->nfrags * 2
+          + sizeof(NGX_RTMP_DASH_PERIOD_FOOTER)
+          + sizeof(NGX_RTMP_DASH_MANIFEST_CLOCK) + dacf->clock_helper_uri.len
+          + sizeof(NGX_RTMP_DASH_MANIFEST_FOOTER);
+
+    buffer = ngx_rtmp_file_get_buffer(len, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = buffer + len;
+
     // Fill DASH header
     p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_HEADER,
                      // availabilityStartTime
@@ -496,8 +551,6 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 
     p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_PERIOD);
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
-
     ngx_str_null(&noname);
 
     name = (dacf->nested ? &noname : &ctx->name);
@@ -532,15 +585,18 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         par_x = codec_ctx->width / gcd;
         par_y = codec_ctx->height / gcd;
 
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
+        *ngx_rtmp_codec_video_codecs(codecs, codecs + sizeof(codecs) - 1,
+                                     codec_ctx) = 0;
+
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
                          codec_ctx->width,
                          codec_ctx->height,
                          frame_rate,
                          par_x, par_y,
                          &ctx->name,
-                         codec_ctx->avc_profile,
-                         codec_ctx->avc_compat,
-                         codec_ctx->avc_level,
+                         codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265 ?
+                         "H265" : "H264",
+                         codecs,
                          codec_ctx->width,
                          codec_ctx->height,
                          frame_rate,
@@ -555,12 +611,10 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
     }
 
     if (ctx->has_audio) {
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
                          &ctx->name,
                          codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
                          (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
@@ -576,42 +630,46 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
     }
 
-    p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_PERIOD_FOOTER);
-    n = ngx_write_fd(fd, buffer, p - buffer);
+    p = ngx_slprintf(p, last, NGX_RTMP_DASH_PERIOD_FOOTER);
 
     /* UTCTiming value */
     switch (dacf->clock_compensation) {
         case NGX_RTMP_DASH_CLOCK_COMPENSATION_NTP:
-                p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
+                p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
                                  "ntp",
                                  &dacf->clock_helper_uri
                 );
-                n = ngx_write_fd(fd, buffer, p - buffer);
         break;
         case NGX_RTMP_DASH_CLOCK_COMPENSATION_HTTP_HEAD:
-                p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
+                p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
                                  "http-head",
                                  &dacf->clock_helper_uri
                 );
-                n = ngx_write_fd(fd, buffer, p - buffer);
         break;
         case NGX_RTMP_DASH_CLOCK_COMPENSATION_HTTP_ISO:
-                p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
+                p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_CLOCK,
                                  "http-iso",
                                  &dacf->clock_helper_uri
                 );
-                n = ngx_write_fd(fd, buffer, p - buffer);
         break;
     }
 
-    p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
+    p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
+
+    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
+                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: open failed: '%V'", &ctx->playlist_bak);
+        return NGX_ERROR;
+    }
+
     n = ngx_write_fd(fd, buffer, p - buffer);
 
-    if (n < 0) {
+    if (n < 0 || n != p - buffer) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                       "dash: write failed: '%V'", &ctx->playlist_bak);
         ngx_close_file(fd);
@@ -638,6 +696,249 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_replace_file(ngx_rtmp_session_t *s, u_char *path, u_char *pos,
+    u_char *last)
+{
+    ssize_t                    n;
+    ngx_fd_t                   fd;
+
+    static u_char              bak[NGX_MAX_PATH + 1];
+
+    *ngx_snprintf(bak, sizeof(bak) - 1, "%s.bak", path) = 0;
+
+    fd = ngx_open_file(bak, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: open failed: '%s'", bak);
+        return NGX_ERROR;
+    }
+
+    n = ngx_write_fd(fd, pos, last - pos);
+
+    ngx_close_file(fd);
+
+    if (n < 0) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: write failed: '%s'", bak);
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_dash_rename_file(bak, path) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: rename failed: '%s'->'%s'", bak, path);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * HLS playlists over the same CMAF fragments: media playlist per track
+ * next to the fragments and master playlist next to the manifest.
+ */
+
+static ngx_int_t
+ngx_rtmp_dash_write_hls_media(ngx_rtmp_session_t *s, char type)
+{
+    char                      *sep, *track;
+    u_char                    *buffer, *p, *last;
+    size_t                     len;
+    ngx_str_t                  noname, *name;
+    ngx_uint_t                 i, duration;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    static u_char              path[NGX_MAX_PATH + 1];
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    ngx_str_null(&noname);
+
+    name = (dacf->nested ? &noname : &ctx->name);
+    sep = (dacf->nested ? "" : "-");
+    track = (type == 'v' ? "video" : "audio");
+
+    duration = 0;
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_dash_get_frag(s, i);
+        if (f->duration > duration) {
+            duration = f->duration;
+        }
+    }
+
+    len = sizeof("#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-MEDIA-SEQUENCE:\n"
+                  "#EXT-X-TARGETDURATION:\n#EXT-X-INDEPENDENT-SEGMENTS\n"
+                  "#EXT-X-MAP:URI=\"init.m4v\"\n")
+          + NGX_INT_T_LEN * 2 + name->len + 1
+          + (sizeof("#EXTINF:.000,\n.m4v\n") + NGX_INT_T_LEN + NGX_INT32_LEN
+             + name->len + 1) * ctx->nfrags;
+
+    buffer = ngx_rtmp_file_get_buffer(len, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = buffer + len;
+
+    p = ngx_slprintf(buffer, last,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-MEDIA-SEQUENCE:%ui\n"
+                     "#EXT-X-TARGETDURATION:%ui\n"
+                     "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                     "#EXT-X-MAP:URI=\"%V%sinit.m4%c\"\n",
+                     ctx->frag, (duration + 999) / 1000,
+                     name, sep, type);
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_dash_get_frag(s, i);
+        p = ngx_slprintf(p, last, "#EXTINF:%.3f,\n%V%s%uD.m4%c\n",
+                         f->duration / 1000., name, sep, f->timestamp, type);
+    }
+
+    *ngx_snprintf(path, sizeof(path) - 1, "%V%s.m3u8", &ctx->stream,
+                  track) = 0;
+
+    return ngx_rtmp_dash_replace_file(s, path, buffer, p);
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_write_hls_master(ngx_rtmp_session_t *s)
+{
+    char                      *sep, *acodec;
+    u_char                    *p, *last;
+    ngx_str_t                  noname, *name;
+    ngx_uint_t                 bandwidth;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_codec_ctx_t      *codec_ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    static u_char              buffer[1024];
+    static u_char              path[NGX_MAX_PATH + 1];
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    /*
+     * players pick variants by peak bitrate, it never goes down;
+     * file is rewritten with each fragment to stay ahead of cleanup
+     * and to follow codec changes
+     */
+
+    bandwidth = (ctx->has_video ? ctx->video.bandwidth : 0) +
+                (ctx->has_audio ? ctx->audio.bandwidth : 0);
+
+    bandwidth = ngx_max(bandwidth, ctx->hls_bandwidth);
+
+    if (bandwidth == 0) {
+        return NGX_OK;
+    }
+
+    ngx_str_null(&noname);
+
+    name = (dacf->nested ? &noname : &ctx->name);
+    sep = (dacf->nested ? "" : "-");
+
+    acodec = (codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
+              (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b");
+
+    last = buffer + sizeof(buffer);
+
+    p = ngx_slprintf(buffer, last,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+    if (ctx->has_video && ctx->has_audio) {
+        p = ngx_slprintf(p, last,
+                         "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\","
+                         "NAME=\"%V\",DEFAULT=YES,AUTOSELECT=YES,"
+                         "URI=\"%V%saudio.m3u8\"\n",
+                         &ctx->name, name, sep);
+    }
+
+    if (ctx->has_video) {
+        p = ngx_slprintf(p, last,
+                         "#EXT-X-STREAM-INF:BANDWIDTH=%ui,CODECS=\"",
+                         bandwidth);
+
+        p = ngx_rtmp_codec_video_codecs(p, last, codec_ctx);
+
+        if (ctx->has_audio) {
+            p = ngx_slprintf(p, last, ",mp4a.%s", acodec);
+        }
+
+        p = ngx_slprintf(p, last, "\",RESOLUTION=%uix%ui",
+                         codec_ctx->width, codec_ctx->height);
+
+        if (ctx->has_audio) {
+            p = ngx_slprintf(p, last, ",AUDIO=\"audio\"");
+        }
+
+        p = ngx_slprintf(p, last, "\n%V%svideo.m3u8\n", name, sep);
+
+    } else {
+        p = ngx_slprintf(p, last,
+                         "#EXT-X-STREAM-INF:BANDWIDTH=%ui,"
+                         "CODECS=\"mp4a.%s\"\n"
+                         "%V%saudio.m3u8\n",
+                         bandwidth, acodec, name, sep);
+    }
+
+    /* manifest path with .mpd replaced */
+
+    *ngx_snprintf(path, sizeof(path) - 1, "%*s.m3u8",
+                  ctx->playlist.len - (sizeof(".mpd") - 1),
+                  ctx->playlist.data) = 0;
+
+    if (ngx_rtmp_dash_replace_file(s, path, buffer, p) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ctx->hls_bandwidth = bandwidth;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_write_hls_playlists(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_codec_ctx_t      *codec_ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (codec_ctx == NULL || (!ctx->has_video && !ctx->has_audio)) {
+        return NGX_OK;
+    }
+
+    if (ctx->has_video &&
+        ngx_rtmp_dash_write_hls_media(s, 'v') != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->has_audio &&
+        ngx_rtmp_dash_write_hls_media(s, 'a') != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_rtmp_dash_write_hls_master(s);
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 {
@@ -714,16 +1015,35 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 }
 
 
+static void
+ngx_rtmp_dash_drop_cache(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
+{
+    if (t->cache_size == 0) {
+        return;
+    }
+
+    ngx_rtmp_file_drop_cache(t->cache_fd, 0, t->cache_size,
+                             s->connection->log);
+
+    ngx_close_file(t->cache_fd);
+
+    t->cache_size = 0;
+}
+
+
 static void
 ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
     u_char                    *pos, *pos1;
+    off_t                      size;
     size_t                     left;
     ssize_t                    n;
     ngx_fd_t                   fd;
     ngx_buf_t                  b;
+    ngx_uint_t                 bandwidth, reserved;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
 
@@ -736,6 +1056,7 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
                    t->id, t->type, t->earliest_pres_time);
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
 
     b.start = buffer;
     b.end = buffer + sizeof(buffer);
@@ -760,9 +1081,21 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 
     f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
 
+    if (f->duration) {
+        bandwidth = (ngx_uint_t) ((uint64_t) (b.last - b.pos + t->mdat_size)
+                                  * 8000 / f->duration);
+        if (bandwidth > t->bandwidth) {
+            t->bandwidth = bandwidth;
+        }
+    }
+
     *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c",
                  f->timestamp, t->type) = 0;
 
+    size = (off_t) (b.last - b.pos + t->mdat_size);
+    left = (size_t) size;
+    reserved = 0;
+
     fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
                        NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
@@ -772,6 +1105,14 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
         goto done;
     }
 
+    /* fragment size is known exactly, no estimate needed */
+
+    if (dacf->preallocate
+        && ngx_rtmp_file_reserve(fd, 0, size, s->connection->log) == NGX_OK)
+    {
+        reserved = 1;
+    }
+
     if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR) {
         goto done;
     }
@@ -816,7 +1157,34 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 done:
 
     if (fd != NGX_INVALID_FILE) {
-        ngx_close_file(fd);
+
+        if (reserved && left) {
+            ngx_rtmp_file_trim(fd, size - (off_t) left, s->connection->log);
+        }
+
+        if (dacf->drop_cache) {
+
+            /* dropped when next fragment is finished and this one is clean */
+
+            ngx_rtmp_dash_drop_cache(s, t);
+
+            ngx_rtmp_file_writeback(fd, 0, size, s->connection->log);
+
+            t->cache_fd = fd;
+            t->cache_size = size;
+
+        } else {
+            ngx_close_file(fd);
+        }
+
+        if (dacf->expire) {
+            ngx_rtmp_expire_push(dacf->expire, ctx->stream.data,
+                                 dacf->playlen / 500, s->connection->log);
+        }
+    }
+
+    if (dacf->preallocate) {
+        ngx_rtmp_file_trim(t->fd, (off_t) t->mdat_size, s->connection->log);
     }
 
     ngx_close_file(t->fd);
@@ -829,7 +1197,8 @@ done:
 static ngx_int_t
 ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
 {
-    ngx_rtmp_dash_ctx_t  *ctx;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
     if (ctx == NULL || !ctx->opened) {
@@ -846,6 +1215,12 @@ ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
 
     ngx_rtmp_dash_write_playlist(s);
 
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (dacf->hls) {
+        ngx_rtmp_dash_write_hls_playlists(s);
+    }
+
     ctx->id++;
     ctx->opened = 0;
 
@@ -857,7 +1232,8 @@ static ngx_int_t
 ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_uint_t id, char type)
 {
-    ngx_rtmp_dash_ctx_t   *ctx;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     if (t->opened) {
         return NGX_OK;
@@ -879,6 +1255,16 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
         return NGX_ERROR;
     }
 
+    /* raw data of the previous fragment is the estimate */
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (dacf->preallocate) {
+        ngx_rtmp_file_reserve(t->fd, 0,
+                              ngx_rtmp_file_estimate((off_t) t->mdat_size),
+                              s->connection->log);
+    }
+
     t->id = id;
     t->type = type;
     t->sample_count = 0;
@@ -1176,6 +1562,9 @@ ngx_rtmp_dash_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 
     ngx_rtmp_dash_close_fragments(s);
 
+    ngx_rtmp_dash_drop_cache(s, &ctx->video);
+    ngx_rtmp_dash_drop_cache(s, &ctx->audio);
+
 next:
     return next_close_stream(s, v);
 }
@@ -1374,12 +1763,10 @@ static ngx_int_t
 ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
-    u_char                    *p;
-    uint8_t                    ftype, htype;
-    uint32_t                   delay;
-    ngx_rtmp_dash_ctx_t       *ctx;
-    ngx_rtmp_codec_ctx_t      *codec_ctx;
-    ngx_rtmp_dash_app_conf_t  *dacf;
+    ngx_rtmp_dash_ctx_t        *ctx;
+    ngx_rtmp_codec_ctx_t       *codec_ctx;
+    ngx_rtmp_dash_app_conf_t   *dacf;
+    ngx_rtmp_codec_video_tag_t  tag;
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
@@ -1391,40 +1778,33 @@ ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    /* Only H264 is supported */
+    /* Only H264 and H265 are supported */
 
-    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) {
+    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264 &&
+        codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H265)
+    {
         return NGX_OK;
     }
 
-    if (in->buf->last - in->buf->pos < 5) {
+    if (ngx_rtmp_codec_parse_video_tag(in, &tag) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    ftype = (in->buf->pos[0] & 0xf0) >> 4;
-
-    /* skip AVC config */
+    /* skip AVC/HEVC config */
 
-    htype = in->buf->pos[1];
-    if (htype != 1) {
+    if (tag.packet_type != NGX_RTMP_VIDEO_PACKET_FRAME) {
         return NGX_OK;
     }
 
-    p = (u_char *) &delay;
-
-    p[0] = in->buf->pos[4];
-    p[1] = in->buf->pos[3];
-    p[2] = in->buf->pos[2];
-    p[3] = 0;
-
     ctx->has_video = 1;
 
-    /* skip RTMP & H264 headers */
+    /* skip RTMP & H264/H265 headers */
 
-    in->buf->pos += 5;
+    in->buf->pos += tag.size;
 
-    return ngx_rtmp_dash_append(s, in, &ctx->video, ftype == 1, h->timestamp,
-                                delay);
+    return ngx_rtmp_dash_append(s, in, &ctx->video,
+                                tag.frame_type == NGX_RTMP_VIDEO_KEY_FRAME,
+                                h->timestamp, (uint32_t) tag.cts);
 }
 
 
@@ -1595,6 +1975,14 @@ ngx_rtmp_dash_cleanup_dir(ngx_str_t *ppath, ngx_msec_t playlen)
         {
             max_age = playlen / 500;
 
+        } else if (name.len >= 5 && name.data[name.len - 5] == '.' &&
+                                    name.data[name.len - 4] == 'm' &&
+                                    name.data[name.len - 3] == '3' &&
+                                    name.data[name.len - 2] == 'u' &&
+                                    name.data[name.len - 1] == '8')
+        {
+            max_age = playlen / 500;
+
         } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
                                     name.data[name.len - 3] == 'r' &&
                                     name.data[name.len - 2] == 'a' &&
@@ -1634,11 +2022,23 @@ ngx_rtmp_dash_cleanup(void *data)
 {
     ngx_rtmp_dash_cleanup_t *cleanup = data;
 
-    ngx_rtmp_dash_cleanup_dir(&cleanup->path, cleanup->playlen);
+    time_t                   next;
 
     // Next callback in doubled playlist length time to make sure what all 
     // players read all segments
-    return cleanup->playlen / 500;
+    next = cleanup->playlen / 500;
+
+    /* with deletion queue directory is only scanned as a safety net */
+
+    if (cleanup->expire &&
+        ngx_rtmp_expire_run(cleanup->expire, next, &next) != NGX_OK)
+    {
+        return next;
+    }
+
+    ngx_rtmp_dash_cleanup_dir(&cleanup->path, cleanup->playlen);
+
+    return next;
 }
 
 /*static ngx_int_t
@@ -1661,7 +2061,11 @@ ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf)
     conf->fraglen = NGX_CONF_UNSET_MSEC;
     conf->playlen = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
+    conf->cleanup_queue = NGX_CONF_UNSET_SIZE;
+    conf->preallocate = NGX_CONF_UNSET;
+    conf->drop_cache = NGX_CONF_UNSET;
     conf->nested = NGX_CONF_UNSET;
+    conf->hls = NGX_CONF_UNSET;
     conf->clock_compensation = NGX_CONF_UNSET;
 
     return conf;
@@ -1679,7 +2083,12 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->fraglen, prev->fraglen, 5000);
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
+    ngx_conf_merge_size_value(conf->cleanup_queue, prev->cleanup_queue,
+                              1024 * 1024);
+    ngx_conf_merge_value(conf->preallocate, prev->preallocate, 0);
+    ngx_conf_merge_value(conf->drop_cache, prev->drop_cache, 0);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
+    ngx_conf_merge_value(conf->hls, prev->hls, 0);
     ngx_conf_merge_uint_value(conf->clock_compensation, prev->clock_compensation,
                               NGX_RTMP_DASH_CLOCK_COMPENSATION_OFF);
     ngx_conf_merge_str_value(conf->clock_helper_uri, prev->clock_helper_uri, "");
@@ -1717,6 +2126,28 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         if (ngx_add_path(cf, &conf->slot) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
+
+        /* applications sharing a path share its cleanup and queue */
+
+        cleanup = conf->slot->data;
+
+        if (conf->cleanup_queue && cleanup->expire == NULL) {
+            cleanup->expire = ngx_rtmp_expire_add_zone(cf, "dash",
+                                                       &conf->path,
+                                                       conf->cleanup_queue,
+                                                       &ngx_rtmp_dash_module);
+            if (cleanup->expire == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        conf->expire = cleanup->expire;
+    }
+
+    /* inherited path is cleaned up by the parent */
+
+    if (conf->path.len == 0) {
+        conf->expire = prev->expire;
     }
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
@@ -4,6 +4,8 @@
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_codec_module.h>
 #include <ngx_rtmp_live_module.h>
+#include <ngx_rtmp_expire.h>
+#include <ngx_rtmp_file.h>
 #include "dash/ngx_rtmp_mp4.h"
 
 
@@ -42,8 +44,10 @@ typedef struct {
     unsigned                            opened:1;
     unsigned                            video:1;
     unsigned                            audio:1;
+    unsigned                            reserved:1;
 
     ngx_file_t                          file;
+    off_t                               last_size; /* space estimate */
 
     uint32_t                            restore_offset;
 
@@ -64,6 +68,7 @@ typedef struct {
 typedef struct {
     ngx_str_t                           path;
     ngx_msec_t                          playlen;
+    ngx_rtmp_expire_t                  *expire;
 } ngx_rtmp_hds_cleanup_t;
 
 
@@ -74,8 +79,12 @@ typedef struct {
     ngx_str_t                           path;
     ngx_uint_t                          winfrags;
     ngx_flag_t                          cleanup;
+    size_t                              cleanup_queue;
+    ngx_rtmp_expire_t                  *expire;
     ngx_path_t                         *slot;
     ngx_flag_t                          continuous;
+    ngx_flag_t                          preallocate;
+    ngx_flag_t                          drop_cache;
 } ngx_rtmp_hds_app_conf_t;
 
 
@@ -116,6 +125,13 @@ static ngx_command_t ngx_rtmp_hds_commands[] = {
       offsetof(ngx_rtmp_hds_app_conf_t, cleanup),
       NULL },
 
+    { ngx_string("hds_cleanup_queue"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hds_app_conf_t, cleanup_queue),
+      NULL },
+
     { ngx_string("hds_continuous"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -123,6 +139,20 @@ static ngx_command_t ngx_rtmp_hds_commands[] = {
       offsetof(ngx_rtmp_hds_app_conf_t, continuous),
       NULL },
 
+    { ngx_string("hds_preallocate"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hds_app_conf_t, preallocate),
+      NULL },
+
+    { ngx_string("hds_drop_cache"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hds_app_conf_t, drop_cache),
+      NULL },
+
     ngx_null_command
 };
 
@@ -672,7 +702,9 @@ ngx_rtmp_hds_calc_ts_offset(ngx_rtmp_session_t *s)
 static ngx_int_t 
 ngx_rtmp_hds_close_fragments(ngx_rtmp_session_t *s)
 {
+    off_t                           size;
     ngx_rtmp_hds_ctx_t             *ctx;
+    ngx_rtmp_hds_app_conf_t        *hacf;
     ngx_buf_t                       b;
     static u_char                   buffer[16];
 
@@ -682,12 +714,15 @@ ngx_rtmp_hds_close_fragments(ngx_rtmp_session_t *s)
         return NGX_OK;
     }
 
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hds_module);
+
     ngx_rtmp_hds_calc_ts_offset(s);
 
     b.start = buffer;
     b.end = buffer + sizeof(buffer);
     b.pos = b.last = b.start;
 
+    size = ctx->file.offset;
     ctx->file.offset = 0;
 
     ngx_rtmp_mp4_write_mdat(&b, 1);
@@ -696,10 +731,26 @@ ngx_rtmp_hds_close_fragments(ngx_rtmp_session_t *s)
 
     ngx_rtmp_hds_write_data(s, &ctx->file, &b);
 
+    ctx->last_size = size;
+
+    if (ctx->reserved) {
+        ngx_rtmp_file_trim(ctx->file.fd, size, s->connection->log);
+        ctx->reserved = 0;
+    }
+
+    if (hacf->drop_cache) {
+        ngx_rtmp_file_drop_cache(ctx->file.fd, 0, size, s->connection->log);
+    }
+
     ngx_close_file(ctx->file.fd);
 
     ctx->opened = 0;
 
+    if (hacf->expire) {
+        ngx_rtmp_expire_push(hacf->expire, ctx->stream.data,
+                             hacf->playlen / 500, s->connection->log);
+    }
+
     ngx_rtmp_hds_write_bootstrap(s);
 
     ngx_rtmp_hds_write_manifest(s);
@@ -712,6 +763,7 @@ static ngx_int_t
 ngx_rtmp_hds_open_fragments(ngx_rtmp_session_t *s, uint32_t ts)
 {
     ngx_rtmp_hds_ctx_t         *ctx;
+    ngx_rtmp_hds_app_conf_t    *hacf;
     ngx_buf_t                   b;
     ngx_rtmp_hds_frag_t        *f, *lastf;
     static u_char               buffer[16];
@@ -744,6 +796,17 @@ ngx_rtmp_hds_open_fragments(ngx_rtmp_session_t *s, uint32_t ts)
         return NGX_ERROR;
     }
 
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hds_module);
+
+    if (hacf->preallocate
+        && ngx_rtmp_file_reserve(ctx->file.fd, 0,
+                                 ngx_rtmp_file_estimate(ctx->last_size),
+                                 s->connection->log)
+           == NGX_OK)
+    {
+        ctx->reserved = 1;
+    }
+
     f->earliest_pres_time = 0;
     ctx->opened = 1;
     ctx->mdat_size = 0;
@@ -1311,6 +1374,12 @@ ngx_rtmp_hds_discontinue(ngx_rtmp_session_t *s)
         ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "hds: discontinue");
 
+        if (ctx->reserved) {
+            ngx_rtmp_file_trim(ctx->file.fd, ctx->file.offset,
+                               s->connection->log);
+            ctx->reserved = 0;
+        }
+
         ngx_close_file(ctx->file.fd);
         ctx->opened = 0;
     }
@@ -1473,9 +1542,21 @@ ngx_rtmp_hds_cleanup(void *data)
 {
     ngx_rtmp_hds_cleanup_t *cleanup = data;
 
+    time_t                  next;
+
+    next = 20; /* wait 20 s before running again */
+
+    /* with deletion queue directory is only scanned as a safety net */
+
+    if (cleanup->expire &&
+        ngx_rtmp_expire_run(cleanup->expire, next, &next) != NGX_OK)
+    {
+        return next;
+    }
+
     ngx_rtmp_hds_cleanup_dir(&cleanup->path, cleanup->playlen);
 
-    return (time_t)20; /* wait 20 ms before running again */
+    return next;
 }
 
 
@@ -1493,7 +1574,10 @@ ngx_rtmp_hds_create_app_conf(ngx_conf_t *cf)
     conf->fraglen = NGX_CONF_UNSET_MSEC;
     conf->playlen = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
+    conf->cleanup_queue = NGX_CONF_UNSET_SIZE;
     conf->continuous = NGX_CONF_UNSET;
+    conf->preallocate = NGX_CONF_UNSET;
+    conf->drop_cache = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -1509,7 +1593,11 @@ ngx_rtmp_hds_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->fraglen, prev->fraglen, 5000);
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
+    ngx_conf_merge_size_value(conf->cleanup_queue, prev->cleanup_queue,
+                              1024 * 1024);
     ngx_conf_merge_value(conf->continuous, prev->continuous, 1);
+    ngx_conf_merge_value(conf->preallocate, prev->preallocate, 0);
+    ngx_conf_merge_value(conf->drop_cache, prev->drop_cache, 0);
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
@@ -1548,6 +1636,28 @@ ngx_rtmp_hds_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         if (ngx_add_path(cf, &conf->slot) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
+
+        /* applications sharing a path share its cleanup and queue */
+
+        cleanup = conf->slot->data;
+
+        if (conf->cleanup_queue && cleanup->expire == NULL) {
+            cleanup->expire = ngx_rtmp_expire_add_zone(cf, "hds",
+                                                       &conf->path,
+                                                       conf->cleanup_queue,
+                                                       &ngx_rtmp_hds_module);
+            if (cleanup->expire == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        conf->expire = cleanup->expire;
+    }
+
+    /* inherited path is cleaned up by the parent */
+
+    if (conf->path.len == 0) {
+        conf->expire = prev->expire;
     }
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
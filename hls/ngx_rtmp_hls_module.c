@@ -9,7 +9,10 @@
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_cmd_module.h>
 #include <ngx_rtmp_codec_module.h>
+#include <ngx_rtmp_expire.h>
+#include <ngx_rtmp_file.h>
 #include "ngx_rtmp_mpegts.h"
+#include "ngx_rtmp_hls_module.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -31,14 +34,28 @@ static ngx_int_t ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s,
 
 
 #define NGX_RTMP_HLS_BUFSIZE            (1024*1024*5)
+
+/* keyframes closer than that (90kHz) to group boundary are cut there */
+#define NGX_RTMP_HLS_GROUP_TOLERANCE    9000
+
+/* shared by all applications with hls_variant_group */
+#define NGX_RTMP_HLS_GROUP_ZONE_SIZE    (1024*1024)
+
 #define NGX_RTMP_HLS_DIR_ACCESS         0744
 
 
 typedef struct {
     uint64_t                            id;
     uint64_t                            key_id;
+    uint64_t                            file_id;  /* hls_single_file */
+    off_t                               offset;
+    off_t                               size;
     ngx_str_t                          *datetime;
     double                              duration;
+    u_char                             *line;     /* playlist entry */
+    size_t                              line_len;
+    size_t                              line_size;
+    size_t                              key_len;  /* EXT-X-KEY at start */
     unsigned                            active:1;
     unsigned                            discont:1; /* before */
 } ngx_rtmp_hls_frag_t;
@@ -50,10 +67,31 @@ typedef struct {
 } ngx_rtmp_hls_variant_t;
 
 
+/* Fragment boundary shared by renditions of one variant stream */
+typedef struct {
+    ngx_queue_t                         queue;
+    uint64_t                            cut_ts;  /* last group boundary */
+    uint64_t                            seq;     /* fragment from cut_ts */
+    ngx_uint_t                          refs;
+    unsigned                            started:1;
+    size_t                              len;
+    u_char                              key[1];  /* path/name */
+} ngx_rtmp_hls_group_node_t;
+
+
+typedef struct {
+    ngx_slab_pool_t                    *shpool;
+    ngx_queue_t                        *queue;
+} ngx_rtmp_hls_group_t;
+
+
 typedef struct {
     unsigned                            opened:1;
+    unsigned                            file_opened:1;
 
     ngx_rtmp_mpegts_file_t              file;
+    uint64_t                            file_id;
+    uint64_t                            file_ts;
 
     ngx_str_t                           playlist;
     ngx_str_t                           playlist_bak;
@@ -80,7 +118,13 @@ typedef struct {
     ngx_buf_t                          *aframe;
     uint64_t                            aframe_pts;
 
+    ngx_chain_t                        *free;  /* video frame references */
+
     ngx_rtmp_hls_variant_t             *var;
+    time_t                              var_time; /* next variant rewrite */
+
+    ngx_rtmp_hls_group_node_t          *group;
+    ngx_rtmp_hls_align_t                align;
 } ngx_rtmp_hls_ctx_t;
 
 
@@ -89,6 +133,7 @@ typedef struct {
     ngx_msec_t                          playlen;
     ngx_uint_t                          c_playlists;
     ngx_uint_t                          frags_per_key;
+    ngx_rtmp_expire_t                  *expire;
 } ngx_rtmp_hls_cleanup_t;
 
 
@@ -102,6 +147,9 @@ typedef struct {
     ngx_uint_t                          winfrags;
     ngx_flag_t                          continuous;
     ngx_flag_t                          nested;
+    ngx_flag_t                          single_file;
+    ngx_flag_t                          preallocate;
+    ngx_flag_t                          drop_cache;
     ngx_str_t                           path;
     ngx_uint_t                          naming;
     ngx_uint_t                          datetime;
@@ -110,13 +158,21 @@ typedef struct {
     ngx_path_t                         *slot;
     ngx_msec_t                          max_audio_delay;
     size_t                              audio_buffer_size;
+    ngx_uint_t                          audio_pes_packets;
+    ngx_msec_t                          pcr_interval;
+    ngx_msec_t                          psi_interval;
     ngx_flag_t                          cleanup;
     ngx_uint_t                          cleanup_playlists;
+    size_t                              cleanup_queue;
+    ngx_rtmp_expire_t                  *expire;
     ngx_uint_t                          allow_client_cache;
     ngx_array_t                        *variant;
+    ngx_flag_t                          variant_group;
+    ngx_rtmp_hls_group_t               *group;
     ngx_str_t                           base_url;
     ngx_int_t                           granularity;
     ngx_flag_t                          keys;
+    ngx_uint_t                          key_method;
     ngx_str_t                           key_path;
     ngx_str_t                           key_url;
     ngx_uint_t                          frags_per_key;
@@ -176,6 +232,12 @@ static ngx_conf_enum_t                  ngx_rtmp_hls_type_slots[] = {
     { ngx_null_string,                  0 }
 };
 
+static ngx_conf_enum_t                  ngx_rtmp_hls_key_method_slots[] = {
+    { ngx_string("aes-128"),            NGX_RTMP_MPEGTS_AES_128    },
+    { ngx_string("sample-aes"),         NGX_RTMP_MPEGTS_SAMPLE_AES },
+    { ngx_null_string,                  0 }
+};
+
 static ngx_conf_enum_t                  ngx_rtmp_hls_cache[] = {
     { ngx_string("enabled"),            NGX_RTMP_HLS_CACHE_ENABLED  },
     { ngx_string("disabled"),           NGX_RTMP_HLS_CACHE_DISABLED },
@@ -252,6 +314,27 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, nested),
       NULL },
 
+    { ngx_string("hls_single_file"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, single_file),
+      NULL },
+
+    { ngx_string("hls_preallocate"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, preallocate),
+      NULL },
+
+    { ngx_string("hls_drop_cache"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, drop_cache),
+      NULL },
+
     { ngx_string("hls_fragment_naming"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_enum_slot,
@@ -294,6 +377,27 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, audio_buffer_size),
       NULL },
 
+    { ngx_string("hls_audio_pes_packets"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, audio_pes_packets),
+      NULL },
+
+    { ngx_string("hls_pcr_interval"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, pcr_interval),
+      NULL },
+
+    { ngx_string("hls_psi_interval"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, psi_interval),
+      NULL },
+
     { ngx_string("hls_cleanup"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -301,6 +405,13 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, cleanup),
       NULL },
 
+    { ngx_string("hls_cleanup_queue"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, cleanup_queue),
+      NULL },
+
    {  ngx_string("hls_allow_client_cache"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_enum_slot,
@@ -315,6 +426,13 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       0,
       NULL },
 
+    { ngx_string("hls_variant_group"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, variant_group),
+      NULL },
+
 	{ ngx_string("hls_cleanup_playlists"),
 	  NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
 	  ngx_conf_set_enum_slot,
@@ -343,6 +461,13 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, keys),
       NULL },
 
+    { ngx_string("hls_key_method"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, key_method),
+      &ngx_rtmp_hls_key_method_slots },
+
     { ngx_string("hls_key_path"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -442,55 +567,192 @@ ngx_rtmp_hls_rename_file(u_char *src, u_char *dst)
 }
 
 
-static ngx_int_t
-ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
+static void
+ngx_rtmp_hls_reset_frag(ngx_rtmp_hls_frag_t *f)
 {
-    static u_char             buffer[1024];
+    u_char  *line;
+    size_t   size;
 
-    u_char                   *p, *last;
-    ssize_t                   rc;
-    ngx_fd_t                  fd;
-    ngx_str_t                *arg;
-    ngx_uint_t                n, k;
-    ngx_rtmp_hls_ctx_t       *ctx;
-    ngx_rtmp_hls_variant_t   *var;
-    ngx_rtmp_hls_app_conf_t  *hacf;
+    /* slot keeps its line storage for the next fragment */
+
+    line = f->line;
+    size = f->line_size;
+
+    ngx_memzero(f, sizeof(*f));
+
+    f->line = line;
+    f->line_size = size;
+}
+
+
+/*
+ * Renders playlist entry of a closed fragment once. Key line goes first
+ * and is skipped when the previous fragment has the same key.
+ */
 
-    //ngx_rtmp_playlist_t      v;
+static ngx_int_t
+ngx_rtmp_hls_render_frag(ngx_rtmp_session_t *s, ngx_rtmp_hls_frag_t *f)
+{
+    static u_char               buffer[4096];
+
+    u_char                     *p, *end, *line;
+    size_t                      len, key_len;
+    ngx_str_t                   name_part, key_name_part;
+    const char                 *sep, *key_sep;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_app_conf_t    *hacf;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
+    key_sep = hacf->nested ? (hacf->key_url.len ? "/" : "") : "-";
+
+    name_part.len = 0;
+    if (!hacf->nested || hacf->base_url.len) {
+        name_part = ctx->name;
+    }
+
+    key_name_part.len = 0;
+    if (!hacf->nested || hacf->key_url.len) {
+        key_name_part = ctx->name;
+    }
+
+    p = buffer;
+    end = p + sizeof(buffer);
+
+    if (hacf->keys) {
+        p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=%s,"
+                         "URI=\"%V%V%s%uL.key\",IV=0x%032XL\n",
+                         hacf->key_method == NGX_RTMP_MPEGTS_SAMPLE_AES ?
+                         "SAMPLE-AES" : "AES-128",
+                         &hacf->key_url, &key_name_part,
+                         key_sep, f->key_id, f->key_id);
+    }
+
+    key_len = p - buffer;
+
+    if (hacf->single_file) {
+        p = ngx_slprintf(p, end,
+                         "#EXTINF:%.3f,\n"
+                         "#EXT-X-BYTERANGE:%O@%O\n"
+                         "%V%V%s%uL.ts\n",
+                         f->duration, f->size, f->offset,
+                         &hacf->base_url, &name_part, sep, f->file_id);
+
+    } else {
+        p = ngx_slprintf(p, end,
+                         "#EXTINF:%.3f,\n"
+                         "%V%V%s%uL.ts\n",
+                         f->duration, &hacf->base_url, &name_part, sep,
+                         f->id);
+    }
+
+    len = p - buffer;
+
+    if (len > f->line_size) {
+        line = ngx_pnalloc(s->connection->pool, ngx_align(len, 128));
+        if (line == NULL) {
+            return NGX_ERROR;
+        }
+
+        f->line = line;
+        f->line_size = ngx_align(len, 128);
+    }
+
+    ngx_memcpy(f->line, buffer, len);
+
+    f->line_len = len;
+    f->key_len = key_len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_file(ngx_rtmp_session_t *s, ngx_str_t *bak,
+    ngx_str_t *path, u_char *buf, size_t len)
+{
+    ssize_t   n;
+    ngx_fd_t  fd;
+
+    fd = ngx_open_file(bak->data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
 
     if (fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
-
+                      "hls: " ngx_open_file_n " failed: '%V'", bak);
         return NGX_ERROR;
     }
 
-#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
+    n = ngx_write_fd(fd, buf, len);
 
-    rc = ngx_write_fd(fd, NGX_RTMP_HLS_VAR_HEADER,
-                      sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
-    if (rc < 0) {
+    if (n < 0 || (size_t) n != len) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
+                      "hls: " ngx_write_fd_n " failed '%V'", bak);
         ngx_close_file(fd);
         return NGX_ERROR;
     }
 
+    ngx_close_file(fd);
+
+    if (ngx_rtmp_hls_rename_file(bak->data, path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: rename failed: '%V'->'%V'", bak, path);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
+{
+    u_char                   *buffer, *p, *last;
+    size_t                    len;
+    ngx_str_t                *arg;
+    ngx_uint_t                n, k;
+    ngx_rtmp_hls_ctx_t       *ctx;
+    ngx_rtmp_hls_variant_t   *var;
+    ngx_rtmp_hls_app_conf_t  *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
+#define NGX_RTMP_HLS_VAR_STREAM                                               \
+    "#EXT-X-STREAM-INF:PROGRAM-ID=1,CLOSED-CAPTIONS=NONE"
+
+    len = sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1;
+
+    var = hacf->variant->elts;
+    for (n = 0; n < hacf->variant->nelts; n++, var++) {
+        len += sizeof(NGX_RTMP_HLS_VAR_STREAM) + hacf->base_url.len
+               + ctx->name.len + var->suffix.len
+               + sizeof("/index.m3u8\n");
+
+        arg = var->args.elts;
+        for (k = 0; k < var->args.nelts; k++, arg++) {
+            len += 1 + arg->len;
+        }
+    }
+
+    buffer = ngx_rtmp_file_get_buffer(len, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = buffer;
+    last = buffer + len;
+
+    p = ngx_cpymem(p, NGX_RTMP_HLS_VAR_HEADER,
+                   sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
+
     var = hacf->variant->elts;
     for (n = 0; n < hacf->variant->nelts; n++, var++)
     {
-        p = buffer;
-        last = buffer + sizeof(buffer);
-
-        p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1,CLOSED-CAPTIONS=NONE");
+        p = ngx_slprintf(p, last, NGX_RTMP_HLS_VAR_STREAM);
 
         arg = var->args.elts;
         for (k = 0; k < var->args.nelts; k++, arg++) {
@@ -510,89 +772,81 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, "%s", ".m3u8\n");
-
-        rc = ngx_write_fd(fd, buffer, p - buffer);
-        if (rc < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->var_playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
-        }
     }
 
-    ngx_close_file(fd);
-
-    if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
-                                 ctx->var_playlist.data)
-        == NGX_FILE_ERROR)
+    if (ngx_rtmp_hls_write_file(s, &ctx->var_playlist_bak, &ctx->var_playlist,
+                                buffer, p - buffer)
+        != NGX_OK)
     {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->var_playlist_bak, &ctx->var_playlist);
         return NGX_ERROR;
     }
 
-	return NGX_OK;
-    /*ngx_memzero(&v, sizeof(v));
-    ngx_str_set(&(v.module), "hls");
-    v.playlist.data = ctx->playlist.data;
-    v.playlist.len = ctx->playlist.len;
-    return next_playlist(s, &v);*/
+    /* content is fixed for the stream, refresh it before cleanup age */
+
+    ctx->var_time = ngx_time() + (time_t) (hacf->playlen / 1000);
+
+    return NGX_OK;
 }
 
 
 static ngx_int_t
 ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
 {
-    static u_char                   buffer[1024];
-    ngx_fd_t                        fd;
-    u_char                         *p, *end;
+    u_char                         *buffer, *p, *end;
+    size_t                          len;
     ngx_rtmp_hls_ctx_t             *ctx;
-    ssize_t                         n;
     ngx_rtmp_hls_app_conf_t        *hacf;
     ngx_rtmp_hls_frag_t            *f;
     ngx_uint_t                      i, max_frag;
-    ngx_str_t                       name_part, key_name_part;
     uint64_t                        prev_key_id;
-    const char                     *sep, *key_sep;
 
-    //ngx_rtmp_playlist_t             v;
-
-    /*ngx_log_error(NGX_LOG_DEBUG, s->connection->log, 0,
-                  "hls: write playlist");
-     */
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        return NGX_ERROR;
-    }
+#define NGX_RTMP_HLS_HEADER                                                    \
+    "#EXTM3U\n"                                                                \
+    "#EXT-X-VERSION:%d\n"                                                      \
+    "#EXT-X-MEDIA-SEQUENCE:%uL\n"                                              \
+    "#EXT-X-TARGETDURATION:%ui\n"
 
     max_frag = hacf->fraglen / 1000;
 
+    len = sizeof(NGX_RTMP_HLS_HEADER) + NGX_INT64_LEN + NGX_INT_T_LEN
+          + sizeof("#EXT-X-PLAYLIST-TYPE:EVENT\n")
+          + sizeof("#EXT-X-ALLOW-CACHE:0\n");
+
     for (i = 0; i < ctx->nfrags; i++) {
         f = ngx_rtmp_hls_get_frag(s, i);
+
         if (f->duration > max_frag) {
             max_frag = (ngx_uint_t) (f->duration + .5);
         }
+
+        /* closed fragments do not change, each is rendered once */
+
+        if (f->line_len == 0 && ngx_rtmp_hls_render_frag(s, f) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        len += f->line_len + sizeof("#EXT-X-DISCONTINUITY\n") - 1;
+
+        if (i == 0 && f->datetime) {
+            len += sizeof("#EXT-X-PROGRAM-DATE-TIME:\n") + f->datetime->len;
+        }
+    }
+
+    buffer = ngx_rtmp_file_get_buffer(len, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
     }
 
     p = buffer;
-    end = p + sizeof(buffer);
+    end = p + len;
+
+    /* EXT-X-BYTERANGE requires version 4 */
 
-    p = ngx_slprintf(p, end,
-                     "#EXTM3U\n"
-                     "#EXT-X-VERSION:3\n"
-                     "#EXT-X-MEDIA-SEQUENCE:%uL\n"
-                     "#EXT-X-TARGETDURATION:%ui\n",
-                     ctx->frag, max_frag);
+    p = ngx_slprintf(p, end, NGX_RTMP_HLS_HEADER,
+                     hacf->single_file ? 4 : 3, ctx->frag, max_frag);
 
     if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
         p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE:EVENT\n");
@@ -602,104 +856,48 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
     } else if (hacf->allow_client_cache == NGX_RTMP_HLS_CACHE_DISABLED) {
         p = ngx_slprintf(p, end, "#EXT-X-ALLOW-CACHE:0\n");
     }
-    n = ngx_write_fd(fd, buffer, p - buffer);
-    if (n < 0) {
-        goto write_err;
-    }
-
-    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
-    key_sep = hacf->nested ? (hacf->key_url.len ? "/" : "") : "-";
-
-    name_part.len = 0;
-    if (!hacf->nested || hacf->base_url.len) {
-        name_part = ctx->name;
-    }
-
-    key_name_part.len = 0;
-    if (!hacf->nested || hacf->key_url.len) {
-        key_name_part = ctx->name;
-    }
 
     prev_key_id = 0;
 
     for (i = 0; i < ctx->nfrags; i++) {
         f = ngx_rtmp_hls_get_frag(s, i);
         if (i == 0 && f->datetime && f->datetime->len > 0) {
-            p = ngx_snprintf(buffer, sizeof(buffer), "#EXT-X-PROGRAM-DATE-TIME:");
-            n = ngx_write_fd(fd, buffer, p - buffer);
-            if (n < 0) {
-                goto write_err;
-            }
-            n = ngx_write_fd(fd, f->datetime->data, f->datetime->len);
-            if (n < 0) {
-                goto write_err;
-            }
-            n = ngx_write_fd(fd, "\n", 1);
-            if (n < 0) {
-                goto write_err;
-            }
+            p = ngx_slprintf(p, end, "#EXT-X-PROGRAM-DATE-TIME:%V\n",
+                             f->datetime);
         }
 
-        p = buffer;
-        end = p + sizeof(buffer);
-
         if (f->discont) {
             p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
         }
 
         if (hacf->keys && (i == 0 || f->key_id != prev_key_id)) {
-            p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=AES-128,"
-                             "URI=\"%V%V%s%uL.key\",IV=0x%032XL\n",
-                             &hacf->key_url, &key_name_part,
-                             key_sep, f->key_id, f->key_id);
+            p = ngx_cpymem(p, f->line, f->line_len);
+
+        } else {
+            p = ngx_cpymem(p, f->line + f->key_len,
+                           f->line_len - f->key_len);
         }
 
         prev_key_id = f->key_id;
 
-        p = ngx_slprintf(p, end,
-                         "#EXTINF:%.3f,\n"
-                         "%V%V%s%uL.ts\n",
-                         f->duration, &hacf->base_url, &name_part, sep, f->id);
-
         ngx_log_debug5(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                        "hls: fragment frag=%uL, n=%ui/%ui, duration=%.3f, "
                        "discont=%i",
                        ctx->frag, i + 1, ctx->nfrags, f->duration, f->discont);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
-        if (n < 0) {
-            goto write_err;
-        }
     }
 
-    ngx_close_file(fd);
-
-    if (ngx_rtmp_hls_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
+    if (ngx_rtmp_hls_write_file(s, &ctx->playlist_bak, &ctx->playlist,
+                                buffer, p - buffer)
+        != NGX_OK)
     {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
         return NGX_ERROR;
     }
 
-    if (ctx->var) {
+    if (ctx->var && ngx_time() >= ctx->var_time) {
         return ngx_rtmp_hls_write_variant_playlist(s);
     }
 
-    /*ngx_memzero(&v, sizeof(v));
-    ngx_str_set(&(v.module), "hls");
-    v.playlist.data = ctx->playlist.data;
-    v.playlist.len = ctx->playlist.len;
-    return next_playlist(s, &v);*/
-	return NGX_OK;
-
-write_err:
-    ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                    "hls: " ngx_write_fd_n " failed '%V'",
-                    &ctx->playlist_bak);
-    ngx_close_file(fd);
-    return NGX_ERROR;
+    return NGX_OK;
 }
 
 
@@ -756,22 +954,126 @@ ngx_rtmp_hls_copy(ngx_rtmp_session_t *s, void *dst, u_char **src, size_t n,
 
 
 static ngx_int_t
-ngx_rtmp_hls_append_aud(ngx_rtmp_session_t *s, ngx_buf_t *out)
+ngx_rtmp_hls_append_ref(ngx_rtmp_session_t *s, ngx_chain_t ***ll, u_char *pos,
+    size_t n)
 {
-    static u_char   aud_nal[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_rtmp_hls_ctx_t             *ctx;
 
-    if (out->last + sizeof(aud_nal) > out->end) {
-        return NGX_ERROR;
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    cl = ctx->free;
+
+    if (cl) {
+        ctx->free = cl->next;
+
+    } else {
+        cl = ngx_alloc_chain_link(s->connection->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = ngx_calloc_buf(s->connection->pool);
+        if (cl->buf == NULL) {
+            return NGX_ERROR;
+        }
     }
 
-    out->last = ngx_cpymem(out->last, aud_nal, sizeof(aud_nal));
+    b = cl->buf;
+
+    b->start = pos;
+    b->pos = pos;
+    b->last = pos + n;
+    b->end = b->last;
+    b->memory = 1;
+
+    cl->next = NULL;
+
+    **ll = cl;
+    *ll = &cl->next;
+
+    return NGX_OK;
+}
+
+
+/* Same as ngx_rtmp_hls_copy() but references data instead of copying */
+
+static ngx_int_t
+ngx_rtmp_hls_ref(ngx_rtmp_session_t *s, ngx_chain_t ***ll, u_char **src,
+    size_t n, ngx_chain_t **in)
+{
+    size_t  pn;
+
+    while (n) {
+        if (*in == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: failed to read %uz byte(s)", n);
+            return NGX_ERROR;
+        }
+
+        pn = ngx_min((size_t) ((*in)->buf->last - *src), n);
+
+        if (ngx_rtmp_hls_append_ref(s, ll, *src, pn) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        *src += pn;
+        n -= pn;
+
+        while (*in && *src == (*in)->buf->last) {
+            *in = (*in)->next;
+            if (*in) {
+                *src = (*in)->buf->pos;
+            }
+        }
+    }
 
     return NGX_OK;
 }
 
 
+static void
+ngx_rtmp_hls_free_refs(ngx_rtmp_session_t *s, ngx_chain_t *out)
+{
+    ngx_chain_t                    *cl;
+    ngx_rtmp_hls_ctx_t             *ctx;
+
+    if (out == NULL) {
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    for (cl = out; cl->next; cl = cl->next) { /* void */ }
+
+    cl->next = ctx->free;
+    ctx->free = out;
+}
+
+
+static u_char ngx_rtmp_hls_start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+
 static ngx_int_t
-ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_buf_t *out)
+ngx_rtmp_hls_append_aud(ngx_rtmp_session_t *s, ngx_chain_t ***ll,
+    ngx_uint_t hevc)
+{
+    static u_char   aud_nal[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    static u_char   hevc_aud_nal[] = { 0x00, 0x00, 0x00, 0x01,
+                                       0x46, 0x01, 0x50 };
+
+    if (hevc) {
+        return ngx_rtmp_hls_append_ref(s, ll, hevc_aud_nal,
+                                       sizeof(hevc_aud_nal));
+    }
+
+    return ngx_rtmp_hls_append_ref(s, ll, aud_nal, sizeof(aud_nal));
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_chain_t ***ll)
 {
     ngx_rtmp_codec_ctx_t           *codec_ctx;
     u_char                         *p;
@@ -839,29 +1141,17 @@ ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_buf_t *out)
                            "hls: header NAL length: %uz", (size_t) len);
 
             /* AnnexB prefix */
-            if (out->end - out->last < 4) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                              "hls: too small buffer for header NAL size");
+            if (ngx_rtmp_hls_append_ref(s, ll, ngx_rtmp_hls_start_code,
+                                        sizeof(ngx_rtmp_hls_start_code))
+                != NGX_OK)
+            {
                 return NGX_ERROR;
             }
 
-            *out->last++ = 0;
-            *out->last++ = 0;
-            *out->last++ = 0;
-            *out->last++ = 1;
-
             /* NAL body */
-            if (out->end - out->last < len) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                              "hls: too small buffer for header NAL");
-                return NGX_ERROR;
-            }
-
-            if (ngx_rtmp_hls_copy(s, out->last, &p, len, &in) != NGX_OK) {
+            if (ngx_rtmp_hls_ref(s, ll, &p, len, &in) != NGX_OK) {
                 return NGX_ERROR;
             }
-
-            out->last += len;
         }
 
         if (n == 1) {
@@ -881,6 +1171,99 @@ ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_buf_t *out)
 }
 
 
+static ngx_int_t
+ngx_rtmp_hls_append_vps_sps_pps(ngx_rtmp_session_t *s, ngx_chain_t ***ll)
+{
+    u_char                         *p;
+    uint8_t                         narrays, type;
+    uint16_t                        nnals, len, rlen;
+    ngx_chain_t                    *in;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (codec_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    in = codec_ctx->avc_header;
+    if (in == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = in->buf->pos;
+
+    /*
+     * Skip bytes:
+     * - flv fmt
+     * - FourCC or HEVC CONF/PICT (0x00) and 0, 0, 0
+     * - HEVCDecoderConfigurationRecord up to numOfArrays
+     */
+
+    if (ngx_rtmp_hls_copy(s, NULL, &p, 5 + 22, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_copy(s, &narrays, &p, 1, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    for (; narrays; narrays--) {
+
+        if (ngx_rtmp_hls_copy(s, &type, &p, 1, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        type &= 0x3f;
+
+        if (ngx_rtmp_hls_copy(s, &rlen, &p, 2, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_rmemcpy(&nnals, &rlen, 2);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: header NAL type=%ui, number: %ui",
+                       (ngx_uint_t) type, (ngx_uint_t) nnals);
+
+        for (; nnals; nnals--) {
+
+            /* NAL length */
+            if (ngx_rtmp_hls_copy(s, &rlen, &p, 2, &in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            ngx_rtmp_rmemcpy(&len, &rlen, 2);
+
+            /* VPS, SPS, PPS; SEI arrays are left */
+
+            if (type < 32 || type > 34) {
+                if (ngx_rtmp_hls_copy(s, NULL, &p, len, &in) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                continue;
+            }
+
+            /* AnnexB prefix */
+            if (ngx_rtmp_hls_append_ref(s, ll, ngx_rtmp_hls_start_code,
+                                        sizeof(ngx_rtmp_hls_start_code))
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            /* NAL body */
+            if (ngx_rtmp_hls_ref(s, ll, &p, len, &in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static uint64_t
 ngx_rtmp_hls_get_fragment_id(ngx_rtmp_session_t *s, uint64_t ts)
 {
@@ -945,8 +1328,35 @@ ngx_rtmp_hls_get_fragment_datetime(ngx_rtmp_session_t *s, uint64_t ts)
         datetime->len = ngx_cached_http_log_iso8601.len;
         return datetime;
 
-    default: /* NGX_RTMP_HLS_DATETIME_NONE */
-        return datetime;
+    default: /* NGX_RTMP_HLS_DATETIME_NONE */
+        return datetime;
+    }
+}
+
+
+static void
+ngx_rtmp_hls_close_file(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    if (ctx == NULL || !ctx->file_opened) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: close file id=%uL", ctx->file_id);
+
+    ngx_rtmp_mpegts_release_file(&ctx->file);
+
+    ctx->file_opened = 0;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    if (hacf->expire) {
+        ngx_rtmp_expire_push(hacf->expire, ctx->stream.data,
+                             hacf->playlen / 500, s->connection->log);
     }
 }
 
@@ -955,6 +1365,8 @@ static ngx_int_t
 ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
+    ngx_rtmp_hls_app_conf_t    *hacf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
     if (ctx == NULL || !ctx->opened) {
@@ -964,7 +1376,22 @@ ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: close fragment n=%uL", ctx->frag);
 
-    ngx_rtmp_mpegts_close_file(&ctx->file);
+    if (ctx->file_opened) {
+        ngx_rtmp_mpegts_end_fragment(&ctx->file);
+
+        f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+        f->size = ctx->file.offset - f->offset;
+
+    } else {
+        ngx_rtmp_mpegts_close_file(&ctx->file);
+
+        hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+        if (hacf->expire) {
+            ngx_rtmp_expire_push(hacf->expire, ctx->stream.data,
+                                 hacf->playlen / 500, s->connection->log);
+        }
+    }
 
     ctx->opened = 0;
 
@@ -981,6 +1408,7 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t discont)
 {
     uint64_t                  id;
+    off_t                     offset;
     ngx_fd_t                  fd;
     ngx_str_t                *datetime;
     ngx_uint_t                g, mpegts_cc;
@@ -1015,7 +1443,21 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         id = (uint64_t) (id / g) * g;
     }
 
-    ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uL.ts%Z", id);
+    /*
+     * In single file mode fragments are appended to one file per
+     * rendition which is rotated once it covers the playlist window;
+     * rotated files expire and get cleaned up as a whole.
+     */
+
+    if (ctx->file_opened
+        && (discont || ts - ctx->file_ts >= (uint64_t) hacf->playlen * 90))
+    {
+        ngx_rtmp_hls_close_file(s);
+    }
+
+    if (!ctx->file_opened) {
+        ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uL.ts%Z", id);
+    }
 
     if (hacf->keys) {
         if (ctx->key_frags == 0) {
@@ -1077,7 +1519,8 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
                    ctx->frag, ctx->nfrags, ts, discont, mpegts_cc);
 
     if (hacf->keys &&
-        ngx_rtmp_mpegts_init_encryption(&ctx->file, ctx->key, 16, ctx->key_id)
+        ngx_rtmp_mpegts_init_encryption(&ctx->file, ctx->key, 16, ctx->key_id,
+                                        hacf->key_method)
         != NGX_OK)
     {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
@@ -1087,22 +1530,49 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    if (ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
-                                  s->connection->log, codec_ctx, mpegts_cc)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (ctx->file_opened) {
+
+        /* append to current file */
+
+        offset = ctx->file.offset;
+
+        if (ngx_rtmp_mpegts_start_fragment(&ctx->file, codec_ctx, mpegts_cc)
+            != NGX_OK)
+        {
+            ngx_rtmp_hls_close_file(s);
+            return NGX_ERROR;
+        }
+
+    } else {
+
+        offset = 0;
+
+        if (ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
+                                      s->connection->log, codec_ctx,
+                                      mpegts_cc)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (hacf->single_file) {
+            ctx->file_opened = 1;
+            ctx->file_id = id;
+            ctx->file_ts = ts;
+        }
     }
 
     ctx->opened = 1;
 
     f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
 
-    ngx_memzero(f, sizeof(*f));
+    ngx_rtmp_hls_reset_frag(f);
 
     f->active = 1;
     f->discont = discont;
     f->id = id;
+    f->file_id = ctx->file_opened ? ctx->file_id : id;
+    f->offset = offset;
     f->key_id = ctx->key_id;
     f->datetime = datetime;
 
@@ -1126,8 +1596,9 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
     u_char                         *p, *last, *end, *next, *pa, *pp, c;
     ngx_rtmp_hls_frag_t            *f;
     double                          duration;
-    ngx_int_t                       discont;
-    uint64_t                        mag, key_id, base;
+    ngx_int_t                       discont, range;
+    uint64_t                        mag, key_id, base, id;
+    off_t                           range_size, range_offset;
     static u_char                   buffer[4096];
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
@@ -1150,6 +1621,9 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
     duration = 0;
     discont = 0;
     key_id = 0;
+    range = 0;
+    range_size = 0;
+    range_offset = 0;
 
     for ( ;; ) {
 
@@ -1254,6 +1728,28 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
             }
 
 
+#define NGX_RTMP_BYTERANGE      "#EXT-X-BYTERANGE:"
+#define NGX_RTMP_BYTERANGE_LEN  (sizeof(NGX_RTMP_BYTERANGE) - 1)
+
+
+            if (ngx_memcmp(p, NGX_RTMP_BYTERANGE, NGX_RTMP_BYTERANGE_LEN) == 0)
+            {
+                pp = ngx_strlchr(p, last, '@');
+
+                if (pp) {
+                    range_size = ngx_atoof(p + NGX_RTMP_BYTERANGE_LEN,
+                                           pp - p - NGX_RTMP_BYTERANGE_LEN);
+                    range_offset = ngx_atoof(pp + 1, last - pp - 1);
+                    range = (range_size != NGX_ERROR
+                             && range_offset != NGX_ERROR);
+                }
+
+                ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                               "hls: restore byterange=%O@%O",
+                               range_size, range_offset);
+            }
+
+
 #define NGX_RTMP_DISCONT        "#EXT-X-DISCONTINUITY"
 #define NGX_RTMP_DISCONT_LEN    (sizeof(NGX_RTMP_DISCONT) - 1)
 
@@ -1273,25 +1769,40 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
             {
                 f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
 
-                ngx_memzero(f, sizeof(*f));
+                ngx_rtmp_hls_reset_frag(f);
 
                 f->duration = duration;
                 f->discont = discont;
                 f->active = 1;
-                f->id = 0;
 
                 discont = 0;
 
+                id = 0;
                 mag = 1;
                 for (pa = last - 4; pa >= p; pa--) {
                     if (*pa < '0' || *pa > '9') {
                         break;
                     }
-                    f->id += (*pa - '0') * mag;
+                    id += (*pa - '0') * mag;
                     mag *= 10;
                 }
 
                 f->key_id = key_id;
+                f->id = id;
+                f->file_id = id;
+
+                if (range) {
+
+                    /*
+                     * single-file fragment: uri names the file it was cut
+                     * from, fragment id follows media sequence
+                     */
+
+                    f->id = ctx->frag + ctx->nfrags;
+                    f->size = range_size;
+                    f->offset = range_offset;
+                    range = 0;
+                }
 
                 ngx_rtmp_hls_next_frag(s);
 
@@ -1415,6 +1926,13 @@ ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s, ngx_str_t *path)
 }
 
 
+static void
+ngx_rtmp_hls_cleanup_cipher(void *data)
+{
+    EVP_CIPHER_CTX_free(data);
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
@@ -1426,6 +1944,9 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     size_t                          len;
     ngx_rtmp_hls_variant_t         *var;
     ngx_uint_t                      n;
+    ngx_pool_cleanup_t             *cln;
+    ngx_chain_t                    *cl;
+    EVP_CIPHER_CTX                 *cipher;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     if (hacf == NULL || !hacf->hls || hacf->path.len == 0) {
@@ -1449,13 +1970,21 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 
     } else {
 
+        if (ctx->group) {
+            ngx_rtmp_hls_group_leave(s);
+        }
+
         f = ctx->frags;
         b = ctx->aframe;
+        cipher = ctx->file.cipher;
+        cl = ctx->free;
 
         ngx_memzero(ctx, sizeof(ngx_rtmp_hls_ctx_t));
 
         ctx->frags = f;
         ctx->aframe = b;
+        ctx->file.cipher = cipher;
+        ctx->free = cl;
 
         if (b) {
             b->pos = b->last = b->start;
@@ -1471,6 +2000,28 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
     }
 
+    ctx->file.pcr_interval = (uint64_t) hacf->pcr_interval * 90;
+    ctx->file.psi_interval = (uint64_t) hacf->psi_interval * 90;
+    ctx->file.preallocate = hacf->preallocate;
+    ctx->file.drop_cache = hacf->drop_cache;
+
+    if (hacf->keys && ctx->file.cipher == NULL) {
+        cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->file.cipher = EVP_CIPHER_CTX_new();
+        if (ctx->file.cipher == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: failed to allocate cipher context");
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_rtmp_hls_cleanup_cipher;
+        cln->data = ctx->file.cipher;
+    }
+
     if (ngx_strstr(v->name, "..")) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: bad stream name: '%s'", v->name);
@@ -1598,116 +2149,424 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
             *p++ = '/';
         }
 
-        p = ngx_cpymem(p, ctx->name.data, ctx->name.len);
-        *p++ = (hacf->nested ? '/' : '-');
+        p = ngx_cpymem(p, ctx->name.data, ctx->name.len);
+        *p++ = (hacf->nested ? '/' : '-');
+
+        ctx->keyfile.len = p - ctx->keyfile.data;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: playlist='%V' playlist_bak='%V' "
+                   "stream_pattern='%V' keyfile_pattern='%V'",
+                   &ctx->playlist, &ctx->playlist_bak,
+                   &ctx->stream, &ctx->keyfile);
+
+    if (hacf->continuous) {
+        ngx_rtmp_hls_restore_stream(s);
+    }
+
+    /* not fatal, stream is segmented on its own then */
+
+    if (hacf->group && ctx->var) {
+        (void) ngx_rtmp_hls_group_join(s);
+    }
+
+next:
+    return next_publish(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
+{
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    u_char                         path[NGX_MAX_PATH + 1];
+    
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    if (hacf == NULL || !hacf->hls || ctx == NULL) {
+        goto next;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: close stream");
+
+    ngx_rtmp_hls_close_fragment(s);
+    ngx_rtmp_hls_close_file(s);
+    ngx_rtmp_mpegts_drop_cache(&ctx->file);
+
+    if (ctx->file.written) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "hls: stream '%V' TS overhead %.1f%% of %O bytes",
+                      &ctx->name,
+                      100. * (ctx->file.written - ctx->file.payload)
+                      / ctx->file.written, ctx->file.written);
+    }
+
+    if (ctx->group) {
+        ngx_rtmp_hls_group_leave(s);
+    }
+
+    ngx_snprintf(path, sizeof(path) - 1, "%V", &ctx->playlist);
+    if (ngx_delete_file(path) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+        "hls: cleanup " ngx_delete_file_n " failed on '%V'",
+        &ctx->playlist);
+    }
+
+next:
+    return next_close_stream(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_parse_aac_header(ngx_rtmp_session_t *s, ngx_uint_t *objtype,
+    ngx_uint_t *srindex, ngx_uint_t *chconf)
+{
+    ngx_rtmp_codec_ctx_t   *codec_ctx;
+    ngx_chain_t            *cl;
+    u_char                 *p, b0, b1;
+
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    cl = codec_ctx->aac_header;
+
+    p = cl->buf->pos;
+
+    if (ngx_rtmp_hls_copy(s, NULL, &p, 2, &cl) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_copy(s, &b0, &p, 1, &cl) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_copy(s, &b1, &p, 1, &cl) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    *objtype = b0 >> 3;
+    if (*objtype == 0 || *objtype == 0x1f) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: unsupported adts object type:%ui", *objtype);
+        return NGX_ERROR;
+    }
+
+    if (*objtype > 4) {
+
+        /*
+         * Mark all extended profiles as LC
+         * to make Android as happy as possible.
+         */
+
+        *objtype = 2;
+    }
+
+    *srindex = ((b0 << 1) & 0x0f) | ((b1 & 0x80) >> 7);
+    if (*srindex == 0x0f) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: unsupported adts sample rate:%ui", *srindex);
+        return NGX_ERROR;
+    }
+
+    *chconf = (b1 >> 3) & 0x0f;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: aac object_type:%ui, sample_rate_index:%ui, "
+                   "channel_config:%ui", *objtype, *srindex, *chconf);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_group_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_rtmp_hls_group_t       *ogroup = data;
+
+    ngx_rtmp_hls_group_t       *group;
+
+    group = shm_zone->data;
+
+    if (ogroup) {
+        group->shpool = ogroup->shpool;
+        group->queue = ogroup->queue;
+        return NGX_OK;
+    }
+
+    group->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        group->queue = group->shpool->data;
+        return NGX_OK;
+    }
+
+    group->queue = ngx_slab_alloc(group->shpool, sizeof(ngx_queue_t));
+    if (group->queue == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(group->queue);
+
+    group->shpool->data = group->queue;
+
+    return NGX_OK;
+}
+
+
+static ngx_rtmp_hls_group_t *
+ngx_rtmp_hls_group_add_zone(ngx_conf_t *cf)
+{
+    ngx_shm_zone_t             *shm_zone;
+    ngx_rtmp_hls_group_t       *group;
+
+    static ngx_str_t            name = ngx_string("rtmp_hls_variant_group");
+
+    shm_zone = ngx_shared_memory_add(cf, &name, NGX_RTMP_HLS_GROUP_ZONE_SIZE,
+                                     &ngx_rtmp_hls_module);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        return shm_zone->data;
+    }
+
+    group = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_hls_group_t));
+    if (group == NULL) {
+        return NULL;
+    }
+
+    shm_zone->init = ngx_rtmp_hls_group_init_zone;
+    shm_zone->data = group;
+
+    return group;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_group_join(ngx_rtmp_session_t *s)
+{
+    u_char                     *p;
+    size_t                      len;
+    ngx_queue_t                *q;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_group_t       *group;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_group_node_t  *node;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    group = hacf->group;
+
+    /* renditions are matched by path and stream name without suffix */
+
+    len = hacf->path.len + 1 + ctx->name.len - ctx->var->suffix.len;
+
+    p = ngx_pnalloc(s->connection->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, hacf->path.data, hacf->path.len);
+    p[hacf->path.len] = '/';
+    ngx_memcpy(p + hacf->path.len + 1, ctx->name.data,
+               ctx->name.len - ctx->var->suffix.len);
+
+    ngx_shmtx_lock(&group->shpool->mutex);
+
+    for (q = ngx_queue_head(group->queue);
+         q != ngx_queue_sentinel(group->queue);
+         q = ngx_queue_next(q))
+    {
+        node = ngx_queue_data(q, ngx_rtmp_hls_group_node_t, queue);
+
+        if (node->len == len && ngx_memcmp(node->key, p, len) == 0) {
+            node->refs++;
+            goto done;
+        }
+    }
+
+    node = ngx_slab_alloc_locked(group->shpool,
+                                 offsetof(ngx_rtmp_hls_group_node_t, key)
+                                 + len);
+    if (node == NULL) {
+        ngx_shmtx_unlock(&group->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: no memory for variant group '%*s', "
+                      "fragments are not aligned", len, p);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(node, sizeof(ngx_rtmp_hls_group_node_t));
+
+    node->refs = 1;
+    node->len = len;
+    ngx_memcpy(node->key, p, len);
+
+    ngx_queue_insert_tail(group->queue, &node->queue);
+
+done:
 
-        ctx->keyfile.len = p - ctx->keyfile.data;
-    }
+    ngx_shmtx_unlock(&group->shpool->mutex);
 
-    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "hls: playlist='%V' playlist_bak='%V' "
-                   "stream_pattern='%V' keyfile_pattern='%V'",
-                   &ctx->playlist, &ctx->playlist_bak,
-                   &ctx->stream, &ctx->keyfile);
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: join variant group '%*s'", len, p);
 
-    if (hacf->continuous) {
-        ngx_rtmp_hls_restore_stream(s);
-    }
+    ctx->group = node;
 
-next:
-    return next_publish(s, v);
+    return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
+static void
+ngx_rtmp_hls_group_leave(ngx_rtmp_session_t *s)
 {
-    ngx_rtmp_hls_app_conf_t        *hacf;
-    ngx_rtmp_hls_ctx_t             *ctx;
-    u_char                         path[NGX_MAX_PATH + 1];
-    
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_group_t       *group;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_group_node_t  *node;
+
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
-    if (hacf == NULL || !hacf->hls || ctx == NULL) {
-        goto next;
-    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "hls: close stream");
+    group = hacf->group;
+    node = ctx->group;
 
-    ngx_rtmp_hls_close_fragment(s);
-    ngx_snprintf(path, sizeof(path) - 1, "%V", &ctx->playlist);
-    if (ngx_delete_file(path) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
-        "hls: cleanup " ngx_delete_file_n " failed on '%V'",
-        &ctx->playlist);
+    ngx_shmtx_lock(&group->shpool->mutex);
+
+    if (--node->refs == 0) {
+        ngx_queue_remove(&node->queue);
+        ngx_slab_free_locked(group->shpool, node);
     }
 
-next:
-    return next_close_stream(s, v);
+    ngx_shmtx_unlock(&group->shpool->mutex);
+
+    ctx->group = NULL;
 }
 
 
+/*
+ * Fragment boundary decision shared by renditions. The first rendition
+ * reaching a keyframe fraglen past the last group boundary sets the next
+ * one; the others cut on their first keyframe at that timestamp and take
+ * its fragment number. Sets skip to the number of fragments missed.
+ */
+
 static ngx_int_t
-ngx_rtmp_hls_parse_aac_header(ngx_rtmp_session_t *s, ngx_uint_t *objtype,
-    ngx_uint_t *srindex, ngx_uint_t *chconf)
+ngx_rtmp_hls_group_boundary(ngx_rtmp_session_t *s, uint64_t ts,
+    uint64_t *skip)
 {
-    ngx_rtmp_codec_ctx_t   *codec_ctx;
-    ngx_chain_t            *cl;
-    u_char                 *p, b0, b1;
+    uint64_t                    seq;
+    ngx_int_t                   cut, drift;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_group_t       *group;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_group_node_t  *node;
 
-    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    cl = codec_ctx->aac_header;
+    group = hacf->group;
+    node = ctx->group;
 
-    p = cl->buf->pos;
+    /* fragment opened by this keyframe */
 
-    if (ngx_rtmp_hls_copy(s, NULL, &p, 2, &cl) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    seq = ctx->frag + ctx->nfrags + (ctx->opened ? 1 : 0);
 
-    if (ngx_rtmp_hls_copy(s, &b0, &p, 1, &cl) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    cut = 0;
+    drift = 0;
+    *skip = 0;
 
-    if (ngx_rtmp_hls_copy(s, &b1, &p, 1, &cl) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    ngx_shmtx_lock(&group->shpool->mutex);
 
-    *objtype = b0 >> 3;
-    if (*objtype == 0 || *objtype == 0x1f) {
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: unsupported adts object type:%ui", *objtype);
-        return NGX_ERROR;
-    }
+    if (!node->started) {
+        node->started = 1;
+        node->seq = seq;
+        node->cut_ts = ts;
+        cut = 1;
 
-    if (*objtype > 4) {
+    } else if (!ctx->opened) {
 
-        /*
-         * Mark all extended profiles as LC
-         * to make Android as happy as possible.
-         */
+        /* join in the middle of group fragment */
 
-        *objtype = 2;
+        if (ctx->nfrags == 0) {
+            ctx->frag = node->seq;
+        }
+
+        cut = 1;
+
+    } else if (node->seq >= seq) {
+
+        /* boundary already set by another rendition */
+
+        if (ts + NGX_RTMP_HLS_GROUP_TOLERANCE >= node->cut_ts) {
+            drift = (ngx_int_t) ((int64_t) (ts - node->cut_ts) / 90);
+            *skip = node->seq - seq;
+            ctx->align.missed += *skip;
+            cut = 1;
+        }
+
+    } else if (ts >= node->cut_ts + (uint64_t) hacf->fraglen * 90) {
+        node->seq = seq;
+        node->cut_ts = ts;
+        cut = 1;
     }
 
-    *srindex = ((b0 << 1) & 0x0f) | ((b1 & 0x80) >> 7);
-    if (*srindex == 0x0f) {
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: unsupported adts sample rate:%ui", *srindex);
-        return NGX_ERROR;
+    ngx_shmtx_unlock(&group->shpool->mutex);
+
+    if (cut && ctx->opened) {
+        ctx->align.fragments++;
+        ctx->align.drift = drift;
+        ctx->align.max_drift = ngx_max(ctx->align.max_drift,
+                                       ngx_abs(drift));
     }
 
-    *chconf = (b1 >> 3) & 0x0f;
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: variant group boundary cut=%i, seq=%uL, "
+                   "skip=%uL, drift=%i", cut, seq, *skip, drift);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "hls: aac object_type:%ui, sample_rate_index:%ui, "
-                   "channel_config:%ui", *objtype, *srindex, *chconf);
+    return cut;
+}
+
+
+ngx_int_t
+ngx_rtmp_hls_get_overhead(ngx_rtmp_session_t *s, off_t *written,
+    off_t *payload)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (ctx == NULL || ctx->file.written == 0) {
+        return NGX_DECLINED;
+    }
+
+    *written = ctx->file.written;
+    *payload = ctx->file.payload;
 
     return NGX_OK;
 }
 
 
+ngx_rtmp_hls_align_t *
+ngx_rtmp_hls_get_align(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (ctx == NULL || ctx->group == NULL) {
+        return NULL;
+    }
+
+    return &ctx->align;
+}
+
+
 static void
 ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t boundary, ngx_uint_t flush_rate)
@@ -1719,6 +2578,7 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t                   same_frag, force,discont;
     ngx_buf_t                  *b;
     int64_t                     d;
+    uint64_t                    skip;
 
     /*ngx_log_error(NGX_LOG_DEBUG, s->connection->log, 0,
                   "hls: update fragment");
@@ -1728,6 +2588,7 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     f = NULL;
     force = 0;
     discont = 1;
+    skip = 0;
 
     if (ctx->opened) {
         f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
@@ -1744,32 +2605,53 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         }
     }
 
-    switch (hacf->slicing) {
-        case NGX_RTMP_HLS_SLICING_PLAIN:
-            if (f && f->duration < hacf->fraglen / 1000.) {
-                boundary = 0;
-            }
-            break;
+    if (ctx->group) {
+        if (boundary && !force) {
+            boundary = ngx_rtmp_hls_group_boundary(s, ts, &skip);
+        }
 
-        case NGX_RTMP_HLS_SLICING_ALIGNED:
+    } else {
 
-            ts_frag_len = hacf->fraglen * 90;
-            same_frag = ctx->frag_ts / ts_frag_len == ts / ts_frag_len;
+        switch (hacf->slicing) {
+            case NGX_RTMP_HLS_SLICING_PLAIN:
+                if (f && f->duration < hacf->fraglen / 1000.) {
+                    boundary = 0;
+                }
+                break;
 
-            if (f && same_frag) {
-                boundary = 0;
-            }
+            case NGX_RTMP_HLS_SLICING_ALIGNED:
 
-            if (f == NULL && (ctx->frag_ts == 0 || same_frag)) {
-                ctx->frag_ts = ts;
-                boundary = 0;
-            }
+                ts_frag_len = hacf->fraglen * 90;
+                same_frag = ctx->frag_ts / ts_frag_len == ts / ts_frag_len;
 
-            break;
+                if (f && same_frag) {
+                    boundary = 0;
+                }
+
+                if (f == NULL && (ctx->frag_ts == 0 || same_frag)) {
+                    ctx->frag_ts = ts;
+                    boundary = 0;
+                }
+
+                break;
+        }
     }
 
     if (boundary || force) {
         ngx_rtmp_hls_close_fragment(s);
+
+        if (skip) {
+
+            /*
+             * keyframes were missing, catch up with group fragment number;
+             * published fragments keep their numbers, window starts over
+             */
+
+            ctx->frag += ctx->nfrags + skip;
+            ctx->nfrags = 0;
+            discont = 1;
+        }
+
         ngx_rtmp_hls_open_fragment(s, ts, discont);
     }
 
@@ -1814,7 +2696,11 @@ ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: flush audio pts=%uL", frame.pts);
 
-    rc = ngx_rtmp_mpegts_write_frame(&ctx->file, &frame, b);
+    rc = ngx_rtmp_mpegts_encrypt_audio(&ctx->file, b);
+
+    if (rc == NGX_OK) {
+        rc = ngx_rtmp_mpegts_write_frame(&ctx->file, &frame, b);
+    }
 
     if (rc != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
@@ -1841,6 +2727,7 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_buf_t                      *b;
     u_char                         *p;
     ngx_uint_t                      objtype, srindex, chconf, size, samples_per_frame;
+    ngx_uint_t                      header;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
 
@@ -1903,7 +2790,23 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     ngx_rtmp_hls_update_fragment(s, pts, codec_ctx->avc_header == NULL, 2);
 
-    if (b->last + size > b->end) {
+    /*
+     * first packet carries 14 bytes of PES header with PTS and 8 bytes of
+     * adaptation field if audio PES may have PCR: by default, or when
+     * audio is the PCR PID
+     */
+
+    header = 14;
+
+    if (ctx->file.pcr_interval == 0 || ctx->file.pcr_pid == 0x101) {
+        header += 8;
+    }
+
+    if (b->last + size > b->end ||
+        (hacf->audio_pes_packets &&
+         (ngx_uint_t) (b->last - b->pos) + size + header >
+         hacf->audio_pes_packets * (NGX_RTMP_MPEGTS_PACKET_SIZE - 4)))
+    {
         ngx_rtmp_hls_flush_audio(s);
     }
 
@@ -2011,6 +2914,50 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+/*
+ * SAMPLE-AES rewrites NAL units in place while input chain is shared
+ * with other modules, so encrypted frames are staged in a buffer
+ */
+
+static ngx_int_t
+ngx_rtmp_hls_write_sample_aes(ngx_rtmp_session_t *s,
+    ngx_rtmp_mpegts_frame_t *frame, ngx_chain_t *out)
+{
+    size_t                          n;
+    ngx_buf_t                       b;
+    ngx_chain_t                    *cl;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    ngx_memzero(&b, sizeof(b));
+
+    b.start = buffer;
+    b.end = buffer + sizeof(buffer);
+    b.pos = b.start;
+    b.last = b.pos;
+
+    for (cl = out; cl; cl = cl->next) {
+        n = cl->buf->last - cl->buf->pos;
+
+        if ((size_t) (b.end - b.last) < n) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: not enough buffer for encrypted frame");
+            return NGX_ERROR;
+        }
+
+        b.last = ngx_cpymem(b.last, cl->buf->pos, n);
+    }
+
+    if (ngx_rtmp_mpegts_encrypt_video(&ctx->file, &b) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_rtmp_mpegts_write_frame(&ctx->file, frame, &b);
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
@@ -2019,14 +2966,14 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_hls_ctx_t             *ctx;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
     u_char                         *p;
-    uint8_t                         fmt, ftype, htype, nal_type, src_nal_type;
+    uint8_t                         nal_type, src_nal_type;
     uint32_t                        len, rlen;
-    ngx_buf_t                       out, *b;
-    uint32_t                        cts;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *out, **ll;
     ngx_rtmp_mpegts_frame_t         frame;
-    ngx_uint_t                      nal_bytes;
-    ngx_int_t                       aud_sent, sps_pps_sent, boundary;
-    static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
+    ngx_rtmp_codec_video_tag_t      tag;
+    ngx_uint_t                      nal_bytes, hevc, param, pic, slice, idr;
+    ngx_int_t                       aud_sent, sps_pps_sent, boundary, rc;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
 
@@ -2040,49 +2987,44 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    /* Only H264 is supported */
-    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) {
+    /* Only H264 and H265 are supported */
+    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264 &&
+        codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H265)
+    {
         return NGX_OK;
     }
 
-    p = in->buf->pos;
-    if (ngx_rtmp_hls_copy(s, &fmt, &p, 1, &in) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    /* 1: keyframe (IDR)
-     * 2: inter frame
-     * 3: disposable inter frame */
+    hevc = (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265);
 
-    ftype = (fmt & 0xf0) >> 4;
+    /* SAMPLE-AES in MPEG-TS is only defined for H264 */
 
-    /* H264 HDR/PICT */
+    if (hevc && ctx->file.sample_aes) {
+        return NGX_OK;
+    }
 
-    if (ngx_rtmp_hls_copy(s, &htype, &p, 1, &in) != NGX_OK) {
+    if (ngx_rtmp_codec_parse_video_tag(in, &tag) != NGX_OK) {
         return NGX_ERROR;
     }
 
     /* proceed only with PICT */
 
-    if (htype != 1) {
+    if (tag.packet_type != NGX_RTMP_VIDEO_PACKET_FRAME) {
         return NGX_OK;
     }
 
-    /* 3 bytes: decoder delay */
-
-    if (ngx_rtmp_hls_copy(s, &cts, &p, 3, &in) != NGX_OK) {
+    p = in->buf->pos;
+    if (ngx_rtmp_hls_copy(s, NULL, &p, tag.size, &in) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    cts = ((cts & 0x00FF0000) >> 16) | ((cts & 0x000000FF) << 16) |
-          (cts & 0x0000FF00);
-
-    ngx_memzero(&out, sizeof(out));
+    /*
+     * Output chain references NAL bodies in the input chain and
+     * injected prefixes; TS packets are built from it directly.
+     */
 
-    out.start = buffer;
-    out.end = buffer + sizeof(buffer);
-    out.pos = out.start;
-    out.last = out.pos;
+    out = NULL;
+    ll = &out;
+    rc = NGX_OK;
 
     nal_bytes = codec_ctx->avc_nal_bytes;
     aud_sent = 0;
@@ -2090,7 +3032,7 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     while (in) {
         if (ngx_rtmp_hls_copy(s, &rlen, &p, nal_bytes, &in) != NGX_OK) {
-            return NGX_OK;
+            goto done;
         }
 
         len = 0;
@@ -2100,96 +3042,101 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             continue;
         }
 
-        if (ngx_rtmp_hls_copy(s, &src_nal_type, &p, 1, &in) != NGX_OK) {
-            return NGX_OK;
+        if (in == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: failed to read NAL type");
+            goto done;
         }
 
-        nal_type = src_nal_type & 0x1f;
+        src_nal_type = *p;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: h264 NAL type=%ui, len=%uD",
-                       (ngx_uint_t) nal_type, len);
+        if (hevc) {
 
-        if (nal_type >= 7 && nal_type <= 9) {
-            if (ngx_rtmp_hls_copy(s, NULL, &p, len - 1, &in) != NGX_OK) {
-                return NGX_ERROR;
+            /* VPS/SPS/PPS/AUD, slices and SEI, IRAP slices */
+
+            nal_type = (src_nal_type >> 1) & 0x3f;
+            param = (nal_type >= 32 && nal_type <= 35);
+            slice = (nal_type <= 9);
+            idr = (nal_type >= 16 && nal_type <= 21);
+            pic = (slice || idr || nal_type == 39);
+
+        } else {
+
+            /* SPS/PPS/AUD, slices and SEI, IDR slices */
+
+            nal_type = src_nal_type & 0x1f;
+            param = (nal_type >= 7 && nal_type <= 9);
+            slice = (nal_type == 1);
+            idr = (nal_type == 5);
+            pic = (slice || idr || nal_type == 6);
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: %s NAL type=%ui, len=%uD",
+                       hevc ? "h265" : "h264", (ngx_uint_t) nal_type, len);
+
+        if (param) {
+            if (ngx_rtmp_hls_copy(s, NULL, &p, len, &in) != NGX_OK) {
+                rc = NGX_ERROR;
+                goto done;
             }
             continue;
         }
 
-        if (!aud_sent) {
-            switch (nal_type) {
-                case 1:
-                case 5:
-                case 6:
-                    if (ngx_rtmp_hls_append_aud(s, &out) != NGX_OK) {
-                        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                                      "hls: error appending AUD NAL");
-                    }
-                case 9:
-                    aud_sent = 1;
-                    break;
+        if (!aud_sent && pic) {
+            if (ngx_rtmp_hls_append_aud(s, &ll, hevc) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "hls: error appending AUD NAL");
             }
-        }
 
-        switch (nal_type) {
-            case 1:
-                sps_pps_sent = 0;
-                break;
-            case 5:
-                if (sps_pps_sent) {
-                    break;
-                }
-                if (ngx_rtmp_hls_append_sps_pps(s, &out) != NGX_OK) {
-                    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                                  "hls: error appenging SPS/PPS NALs");
-                }
-                sps_pps_sent = 1;
-                break;
+            aud_sent = 1;
         }
 
-        /* AnnexB prefix */
+        if (slice) {
+            sps_pps_sent = 0;
 
-        if (out.end - out.last < 5) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                          "hls: not enough buffer for AnnexB prefix");
-            return NGX_OK;
-        }
+        } else if (idr && !sps_pps_sent) {
+            rc = hevc ? ngx_rtmp_hls_append_vps_sps_pps(s, &ll)
+                      : ngx_rtmp_hls_append_sps_pps(s, &ll);
 
-        /* first AnnexB prefix is long (4 bytes) */
+            if (rc != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "hls: error appenging SPS/PPS NALs");
+            }
 
-        if (out.last == out.pos) {
-            *out.last++ = 0;
+            sps_pps_sent = 1;
         }
 
-        *out.last++ = 0;
-        *out.last++ = 0;
-        *out.last++ = 1;
-        *out.last++ = src_nal_type;
+        /* AnnexB prefix, first one is long (4 bytes) */
 
-        /* NAL body */
-
-        if (out.end - out.last < (ngx_int_t) len) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                          "hls: not enough buffer for NAL");
-            return NGX_OK;
+        if (out == NULL) {
+            rc = ngx_rtmp_hls_append_ref(s, &ll, ngx_rtmp_hls_start_code,
+                                         sizeof(ngx_rtmp_hls_start_code));
+        } else {
+            rc = ngx_rtmp_hls_append_ref(s, &ll, ngx_rtmp_hls_start_code + 1,
+                                         sizeof(ngx_rtmp_hls_start_code) - 1);
         }
 
-        if (ngx_rtmp_hls_copy(s, out.last, &p, len - 1, &in) != NGX_OK) {
-            return NGX_ERROR;
+        if (rc != NGX_OK) {
+            goto done;
         }
 
-        out.last += (len - 1);
+        /* NAL type and body */
+
+        rc = ngx_rtmp_hls_ref(s, &ll, &p, len, &in);
+        if (rc != NGX_OK) {
+            goto done;
+        }
     }
 
     ngx_memzero(&frame, sizeof(frame));
 
     frame.cc = ctx->video_cc;
     frame.dts = (uint64_t) h->timestamp * 90;
-    frame.pts = frame.dts + cts * 90;
+    frame.pts = frame.dts + (int64_t) tag.cts * 90;
     frame.pid = 0x100;
     frame.sid = 0xe0;
-    frame.key = (ftype == 1);
+    frame.key = (tag.frame_type == NGX_RTMP_VIDEO_KEY_FRAME);
 
     /*
      * start new fragment if
@@ -2204,20 +3151,31 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_hls_update_fragment(s, frame.dts, boundary, 1);
 
     if (!ctx->opened) {
-        return NGX_OK;
+        goto done;
     }
 
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: video pts=%uL, dts=%uL", frame.pts, frame.dts);
 
-    if (ngx_rtmp_mpegts_write_frame(&ctx->file, &frame, &out) != NGX_OK) {
+    if (ctx->file.sample_aes) {
+        rc = ngx_rtmp_hls_write_sample_aes(s, &frame, out);
+    } else {
+        rc = ngx_rtmp_mpegts_write_chain(&ctx->file, &frame, out);
+    }
+
+    if (rc != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: video frame failed");
+        rc = NGX_OK;
     }
 
     ctx->video_cc = frame.cc;
 
-    return NGX_OK;
+done:
+
+    ngx_rtmp_hls_free_refs(s, out);
+
+    return rc;
 }
 
 
@@ -2393,10 +3351,22 @@ ngx_rtmp_hls_cleanup(void *data)
 {
     ngx_rtmp_hls_cleanup_t *cleanup = data;
 
-    ngx_rtmp_hls_cleanup_dir(&cleanup->path, cleanup->playlen, cleanup->c_playlists);
+    time_t                  next;
 
     // Next callback in half of playlist length time
-    return cleanup->playlen / 2000;
+    next = cleanup->playlen / 2000;
+
+    /* with deletion queue directory is only scanned as a safety net */
+
+    if (cleanup->expire &&
+        ngx_rtmp_expire_run(cleanup->expire, next, &next) != NGX_OK)
+    {
+        return next;
+    }
+
+    ngx_rtmp_hls_cleanup_dir(&cleanup->path, cleanup->playlen, cleanup->c_playlists);
+
+    return next;
 }
 
 
@@ -2477,17 +3447,26 @@ ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
     conf->playlen = NGX_CONF_UNSET_MSEC;
     conf->continuous = NGX_CONF_UNSET;
     conf->nested = NGX_CONF_UNSET;
+    conf->single_file = NGX_CONF_UNSET;
+    conf->preallocate = NGX_CONF_UNSET;
+    conf->drop_cache = NGX_CONF_UNSET;
     conf->naming = NGX_CONF_UNSET_UINT;
     conf->datetime = NGX_CONF_UNSET_UINT;
     conf->slicing = NGX_CONF_UNSET_UINT;
     conf->type = NGX_CONF_UNSET_UINT;
     conf->max_audio_delay = NGX_CONF_UNSET_MSEC;
     conf->audio_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->audio_pes_packets = NGX_CONF_UNSET_UINT;
+    conf->pcr_interval = NGX_CONF_UNSET_MSEC;
+    conf->psi_interval = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
     conf->allow_client_cache = NGX_CONF_UNSET_UINT;
     conf->cleanup_playlists = NGX_CONF_UNSET_UINT;
+    conf->cleanup_queue = NGX_CONF_UNSET_SIZE;
+    conf->variant_group = NGX_CONF_UNSET;
     conf->granularity = NGX_CONF_UNSET;
     conf->keys = NGX_CONF_UNSET;
+    conf->key_method = NGX_CONF_UNSET_UINT;
     conf->frags_per_key = NGX_CONF_UNSET_UINT;
 
     return conf;
@@ -2510,6 +3489,9 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
     ngx_conf_merge_value(conf->continuous, prev->continuous, 1);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
+    ngx_conf_merge_value(conf->single_file, prev->single_file, 0);
+    ngx_conf_merge_value(conf->preallocate, prev->preallocate, 0);
+    ngx_conf_merge_value(conf->drop_cache, prev->drop_cache, 0);
     ngx_conf_merge_uint_value(conf->naming, prev->naming,
                               NGX_RTMP_HLS_NAMING_SEQUENTIAL);
     ngx_conf_merge_uint_value(conf->datetime, prev->datetime,
@@ -2522,10 +3504,19 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               300);
     ngx_conf_merge_size_value(conf->audio_buffer_size, prev->audio_buffer_size,
                               NGX_RTMP_HLS_BUFSIZE);
+    ngx_conf_merge_uint_value(conf->audio_pes_packets,
+                              prev->audio_pes_packets, 0);
+    ngx_conf_merge_msec_value(conf->pcr_interval, prev->pcr_interval, 0);
+    ngx_conf_merge_msec_value(conf->psi_interval, prev->psi_interval, 0);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
+    ngx_conf_merge_size_value(conf->cleanup_queue, prev->cleanup_queue,
+                              1024 * 1024);
     ngx_conf_merge_str_value(conf->base_url, prev->base_url, "");
+    ngx_conf_merge_value(conf->variant_group, prev->variant_group, 0);
     ngx_conf_merge_value(conf->granularity, prev->granularity, 0);
     ngx_conf_merge_value(conf->keys, prev->keys, 0);
+    ngx_conf_merge_uint_value(conf->key_method, prev->key_method,
+                              NGX_RTMP_MPEGTS_AES_128);
     ngx_conf_merge_str_value(conf->key_path, prev->key_path, "");
     ngx_conf_merge_str_value(conf->key_url, prev->key_url, "");
     ngx_conf_merge_uint_value(conf->frags_per_key, prev->frags_per_key, 0);
@@ -2534,6 +3525,13 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->winfrags = conf->playlen / conf->fraglen;
     }
 
+    if (conf->hls && conf->variant && conf->variant_group) {
+        conf->group = ngx_rtmp_hls_group_add_zone(cf);
+        if (conf->group == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     /* schedule cleanup */
 
     if (conf->hls && conf->path.len && conf->cleanup &&
@@ -2566,6 +3564,28 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         if (ngx_add_path(cf, &conf->slot) != NGX_OK) {
             return NGX_CONF_ERROR;
         }
+
+        /* applications sharing a path share its cleanup and queue */
+
+        cleanup = conf->slot->data;
+
+        if (conf->cleanup_queue && cleanup->expire == NULL) {
+            cleanup->expire = ngx_rtmp_expire_add_zone(cf, "hls",
+                                                       &conf->path,
+                                                       conf->cleanup_queue,
+                                                       &ngx_rtmp_hls_module);
+            if (cleanup->expire == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        conf->expire = cleanup->expire;
+    }
+
+    /* inherited path is cleaned up by the parent */
+
+    if (conf->path.len == 0) {
+        conf->expire = prev->expire;
     }
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
@@ -0,0 +1,33 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#ifndef _NGX_RTMP_HLS_H_INCLUDED_
+#define _NGX_RTMP_HLS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+
+
+/* Fragment alignment of a rendition against its variant group */
+typedef struct {
+    ngx_uint_t                          fragments;  /* started on group cut */
+    ngx_uint_t                          missed;     /* group cuts skipped */
+    ngx_int_t                           drift;      /* last cut offset, ms */
+    ngx_int_t                           max_drift;  /* absolute, ms */
+} ngx_rtmp_hls_align_t;
+
+
+ngx_rtmp_hls_align_t *ngx_rtmp_hls_get_align(ngx_rtmp_session_t *s);
+ngx_int_t ngx_rtmp_hls_get_overhead(ngx_rtmp_session_t *s, off_t *written,
+    off_t *payload);
+
+
+extern ngx_module_t                     ngx_rtmp_hls_module;
+
+
+#endif /* _NGX_RTMP_HLS_H_INCLUDED_ */
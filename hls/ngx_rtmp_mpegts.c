@@ -9,6 +9,7 @@
 #include "ngx_rtmp_mpegts.h"
 
 #include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_file.h"
 
 static u_char ngx_rtmp_mpegts_header[] = {
 
@@ -93,15 +94,20 @@ static u_char ngx_rtmp_mpegts_header_aac[] = {
 #define NGX_RTMP_HLS_DELAY  63000
 
 
+/* TS packets are written and encrypted in batches of that many */
+#define NGX_RTMP_MPEGTS_PACKETS         64
+
+
 static ngx_int_t
 ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
     size_t in_size)
 {
-    u_char   *out;
-    size_t    out_size, n;
+    int       out_size;
+    size_t    n;
     ssize_t   rc;
 
-    static u_char  buf[1024];
+    static u_char  buf[NGX_RTMP_MPEGTS_PACKET_SIZE * NGX_RTMP_MPEGTS_PACKETS
+                       + 16];
 
     if (!file->encrypt) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
@@ -112,65 +118,195 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
             return NGX_ERROR;
         }
 
+        file->offset += rc;
+        file->written += rc;
+
         return NGX_OK;
     }
 
-    /* encrypt */
+    /* encrypt, cipher keeps partial block till the next call */
 
     ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
                    "mpegts: write %uz encrypted bytes", in_size);
 
-    out = buf;
-    out_size = sizeof(buf);
+    while (in_size) {
+        n = ngx_min(in_size, sizeof(buf) - 16);
 
-    if (file->size > 0 && file->size + in_size >= 16) {
-        ngx_memcpy(file->buf + file->size, in, 16 - file->size);
+        if (EVP_EncryptUpdate(file->cipher, buf, &out_size, in, (int) n)
+            != 1)
+        {
+            return NGX_ERROR;
+        }
 
-        in += 16 - file->size;
-        in_size -= 16 - file->size;
+        in += n;
+        in_size -= n;
 
-        AES_cbc_encrypt(file->buf, out, 16, &file->key, file->iv, AES_ENCRYPT);
+        if (out_size == 0) {
+            continue;
+        }
 
-        out += 16;
-        out_size -= 16;
+        rc = ngx_write_fd(file->fd, buf, (size_t) out_size);
+        if (rc < 0) {
+            return NGX_ERROR;
+        }
 
-        file->size = 0;
+        file->offset += rc;
+        file->written += rc;
     }
 
-    for ( ;; ) {
-        n = in_size & ~0x0f;
+    return NGX_OK;
+}
 
-        if (n > 0) {
-            if (n > out_size) {
-                n = out_size;
-            }
 
-            AES_cbc_encrypt(in, out, n, &file->key, file->iv, AES_ENCRYPT);
+static uint32_t
+ngx_rtmp_mpegts_crc32(u_char *p, size_t len)
+{
+    uint32_t    crc;
+    ngx_uint_t  i;
 
-            in += n;
-            in_size -= n;
+    /* MPEG-2 CRC32: polynomial 0x04c11db7, no reflection */
 
-        } else if (out == buf) {
-            break;
-        }
+    crc = 0xffffffff;
 
-        rc = ngx_write_fd(file->fd, buf, out - buf + n);
-        if (rc < 0) {
-            return NGX_ERROR;
+    while (len--) {
+        crc ^= (uint32_t) *p++ << 24;
+
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
         }
+    }
+
+    return crc;
+}
+
 
-        out = buf;
-        out_size = sizeof(buf);
+/*
+ * PMT of SAMPLE-AES stream: encrypted H264 and AAC elementary streams
+ * have their own stream types and carry private data indicators; AAC
+ * also needs audio setup information (AudioSpecificConfig).
+ */
+
+static u_char *
+ngx_rtmp_mpegts_write_sample_aes_pmt(u_char *p,
+    ngx_rtmp_codec_ctx_t *codec_ctx)
+{
+    u_char     *section, *es;
+    size_t      n;
+    uint32_t    crc;
+    ngx_buf_t  *asc;
+
+    section = p;
+
+    *p++ = 0x02;                    /* table id */
+    p += 2;                         /* section length */
+    *p++ = 0x00;                    /* program number */
+    *p++ = 0x01;
+    *p++ = 0xc1;                    /* version, current */
+    *p++ = 0x00;                    /* section number */
+    *p++ = 0x00;                    /* last section number */
+    *p++ = 0xe1;                    /* PCR PID */
+    *p++ = codec_ctx->video_codec_id ? 0x00 : 0x01;
+    *p++ = 0xf0;                    /* program info length */
+    *p++ = 0x00;
+
+    if (codec_ctx->video_codec_id) {
+        *p++ = 0xdb;
+        *p++ = 0xe1;
+        *p++ = 0x00;
+        *p++ = 0xf0;
+        *p++ = 6;
+
+        *p++ = 0x0f;                /* private data indicator */
+        *p++ = 4;
+        p = ngx_cpymem(p, "zavc", 4);
     }
 
-    if (in_size) {
-        ngx_memcpy(file->buf + file->size, in, in_size);
-        file->size += in_size;
+    if (codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC) {
+        n = 0;
+        asc = codec_ctx->aac_header ? codec_ctx->aac_header->buf : NULL;
+
+        if (asc && asc->last - asc->pos > 2) {
+            n = ngx_min((size_t) (asc->last - asc->pos - 2), 16);
+        }
+
+        *p++ = 0xcf;
+        *p++ = 0xe1;
+        *p++ = 0x01;
+
+        es = p;
+        p += 2;
+
+        *p++ = 0x0f;                /* private data indicator */
+        *p++ = 4;
+        p = ngx_cpymem(p, "aacd", 4);
+
+        *p++ = 0x05;                /* registration */
+        *p++ = (u_char) (12 + n);
+        p = ngx_cpymem(p, "apad", 4);
+        p = ngx_cpymem(p, "zaac", 4);
+        *p++ = 0x00;                /* priming */
+        *p++ = 0x00;
+        *p++ = 0x01;                /* version */
+        *p++ = (u_char) n;
+
+        if (n) {
+            p = ngx_cpymem(p, asc->pos + 2, n);
+        }
+
+        es[0] = (u_char) (0xf0 | ((p - es - 2) >> 8));
+        es[1] = (u_char) (p - es - 2);
+
+    } else if (codec_ctx->audio_codec_id) {
+
+        /* mp3 is left in clear */
+
+        *p++ = 0x03;
+        *p++ = 0xe1;
+        *p++ = 0x01;
+        *p++ = 0xf0;
+        *p++ = 0x00;
     }
 
-    return NGX_OK;
+    n = p - section + 4 - 3;
+
+    section[1] = (u_char) (0xb0 | (n >> 8));
+    section[2] = (u_char) n;
+
+    crc = ngx_rtmp_mpegts_crc32(section, p - section);
+
+    *p++ = (u_char) (crc >> 24);
+    *p++ = (u_char) (crc >> 16);
+    *p++ = (u_char) (crc >> 8);
+    *p++ = (u_char) crc;
+
+    return p;
+}
+
+/* HEVC replaces H264 stream type of the first PMT entry */
+
+static void
+ngx_rtmp_mpegts_set_hevc_type(u_char *psi)
+{
+    u_char    *section, *p;
+    size_t     n;
+    uint32_t   crc;
+
+    section = psi + NGX_RTMP_MPEGTS_PACKET_SIZE + 5;
+    n = ((section[1] & 0x0f) << 8) | section[2];
+
+    section[12] = 0x24;
+
+    p = section + 3 + n - 4;
+
+    crc = ngx_rtmp_mpegts_crc32(section, p - section);
+
+    *p++ = (u_char) (crc >> 24);
+    *p++ = (u_char) (crc >> 16);
+    *p++ = (u_char) (crc >> 8);
+    *p++ = (u_char) crc;
 }
 
+
 ngx_int_t
 ngx_rtmp_mpegts_set_audio_header(ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpegts_cc)
 {
@@ -194,24 +330,48 @@ ngx_rtmp_mpegts_set_audio_header(ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpe
 }
 
 
+/*
+ * PAT/PMT are kept in file to be repeated within long fragments
+ */
+
 static ngx_int_t
 ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file, ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpegts_cc)
 {
-    ngx_int_t rc;
+    file->pcr_pid = codec_ctx->video_codec_id ? 0x100 : 0x101;
+    file->pcr_due = 1;
+    file->psi_sync = 1;
+
+    if (file->sample_aes) {
+        u_char  *buf, *p;
+
+        /* PAT and PMT packet header as is, PMT section made up */
+
+        ngx_rtmp_mpegts_set_audio_header(codec_ctx, mpegts_cc);
+
+        buf = file->psi;
+
+        ngx_memcpy(buf, ngx_rtmp_mpegts_header,
+                   NGX_RTMP_MPEGTS_PACKET_SIZE + 5);
 
-    //If there's both audio and video present
-    if (codec_ctx->audio_codec_id && codec_ctx->video_codec_id)
+        p = ngx_rtmp_mpegts_write_sample_aes_pmt(
+                                  buf + NGX_RTMP_MPEGTS_PACKET_SIZE + 5,
+                                  codec_ctx);
+
+        ngx_memset(p, 0xff, buf + sizeof(file->psi) - p);
+    }
+    else if (codec_ctx->audio_codec_id && codec_ctx->video_codec_id)
     {
+        //If there's both audio and video present
         /* Write the audio headers */
         ngx_rtmp_mpegts_set_audio_header(codec_ctx, mpegts_cc);
 
-        rc = ngx_rtmp_mpegts_write_file(file, ngx_rtmp_mpegts_header,
-                                          sizeof(ngx_rtmp_mpegts_header));
+        ngx_memcpy(file->psi, ngx_rtmp_mpegts_header,
+                   sizeof(ngx_rtmp_mpegts_header));
     }
     else
     {
         //Just video or just audio
-        u_char buf[sizeof(ngx_rtmp_mpegts_header)];
+        u_char *buf = file->psi;
 
         ngx_memcpy(buf, ngx_rtmp_mpegts_header, sizeof(ngx_rtmp_mpegts_header));
 
@@ -246,12 +406,36 @@ ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file, ngx_rtmp_codec_ctx_t
 
         /* Clear the last byte of the audio description and the old CRC */
         ngx_memset(buf + 214, 0xff, 5);
+    }
 
-        rc = ngx_rtmp_mpegts_write_file(file, buf, sizeof(buf));
+    if (!file->sample_aes
+        && codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265)
+    {
+        ngx_rtmp_mpegts_set_hevc_type(file->psi);
     }
 
-    return rc;
+    file->psi_cc = file->psi[3] & 0x0f;
 
+    return ngx_rtmp_mpegts_write_file(file, file->psi, sizeof(file->psi));
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_repeat_header(ngx_rtmp_mpegts_file_t *file)
+{
+    u_char  *pmt;
+
+    pmt = file->psi + NGX_RTMP_MPEGTS_PACKET_SIZE;
+
+    file->psi_cc = (file->psi_cc + 1) & 0x0f;
+
+    file->psi[3] = (file->psi[3] & 0xf0) | (u_char) file->psi_cc;
+    pmt[3] = (pmt[3] & 0xf0) | (u_char) file->psi_cc;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: repeat PAT/PMT cc=%ui", file->psi_cc);
+
+    return ngx_rtmp_mpegts_write_file(file, file->psi, sizeof(file->psi));
 }
 
 
@@ -289,23 +473,112 @@ ngx_rtmp_mpegts_write_pts(u_char *p, ngx_uint_t fb, uint64_t pts)
 }
 
 
+static void
+ngx_rtmp_mpegts_copy_chain(u_char *p, ngx_chain_t **in, size_t n)
+{
+    size_t      size;
+    ngx_buf_t  *b;
+
+    while (n) {
+        b = (*in)->buf;
+
+        size = ngx_min((size_t) (b->last - b->pos), n);
+
+        p = ngx_cpymem(p, b->pos, size);
+        b->pos += size;
+        n -= size;
+
+        if (b->pos == b->last) {
+            *in = (*in)->next;
+        }
+    }
+}
+
+
 ngx_int_t
 ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
     ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b)
 {
-    ngx_uint_t  pes_size, header_size, body_size, in_size, stuff_size, flags;
-    u_char      packet[188], *p, *base;
-    ngx_int_t   first, rc;
+    ngx_chain_t  cl;
+
+    cl.buf = b;
+    cl.next = NULL;
+
+    return ngx_rtmp_mpegts_write_chain(file, f, &cl);
+}
+
+
+/*
+ * Packetizes frame payload scattered over chain buffers. Buffers are
+ * consumed; payload is copied once, directly into TS packets.
+ */
+
+ngx_int_t
+ngx_rtmp_mpegts_write_chain(ngx_rtmp_mpegts_file_t *file,
+    ngx_rtmp_mpegts_frame_t *f, ngx_chain_t *in)
+{
+    size_t        size;
+    ngx_uint_t    pes_size, header_size, body_size, in_size, stuff_size, flags;
+    u_char       *packet, *p, *base, *out;
+    ngx_int_t     first, rc, pcr, rai;
+    ngx_chain_t  *cl;
+
+    static u_char  buf[NGX_RTMP_MPEGTS_PACKET_SIZE * NGX_RTMP_MPEGTS_PACKETS];
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
 
     ngx_log_debug6(NGX_LOG_DEBUG_CORE, file->log, 0,
                    "mpegts: pid=%ui, sid=%ui, pts=%uL, "
-                   "dts=%uL, key=%ui, size=%ui",
+                   "dts=%uL, key=%ui, size=%uz",
                    f->pid, f->sid, f->pts, f->dts,
-                   (ngx_uint_t) f->key, (size_t) (b->last - b->pos));
+                   (ngx_uint_t) f->key, size);
+
+    file->payload += size;
+
+    /* PAT/PMT repeated at PES boundary */
+
+    if (file->psi_interval) {
+        if (file->psi_sync) {
+            file->psi_sync = 0;
+            file->psi_dts = f->dts;
+
+        } else if (f->dts >= file->psi_dts + file->psi_interval) {
+            file->psi_dts = f->dts;
+
+            rc = ngx_rtmp_mpegts_repeat_header(file);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+    }
+
+    /* by default PCR comes with each PES of any PID */
+
+    if (file->pcr_interval == 0) {
+        pcr = 1;
+        rai = 1;
+
+    } else {
+        pcr = f->pid == file->pcr_pid
+              && (file->pcr_due
+                  || f->dts >= file->pcr_dts + file->pcr_interval);
+        rai = f->key;
+
+        if (pcr) {
+            file->pcr_due = 0;
+            file->pcr_dts = f->dts;
+        }
+    }
 
     first = 1;
+    out = buf;
 
-    while (b->pos < b->last) {
+    while (size) {
+        packet = out;
         p = packet;
 
         f->cc++;
@@ -322,12 +595,20 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
 
         if (first) {
 
-            packet[3] |= 0x20; /* adaptation */
+            if (pcr) {
+                packet[3] |= 0x20; /* adaptation */
 
-            *p++ = 7;    /* size */
-            *p++ = 0x50; /* random access + PCR */
+                *p++ = 7;    /* size */
+                *p++ = rai ? 0x50 : 0x10; /* random access + PCR */
 
-            p = ngx_rtmp_mpegts_write_pcr(p, f->dts - NGX_RTMP_HLS_DELAY);
+                p = ngx_rtmp_mpegts_write_pcr(p, f->dts - NGX_RTMP_HLS_DELAY);
+
+            } else if (rai) {
+                packet[3] |= 0x20;
+
+                *p++ = 1;
+                *p++ = 0x40; /* random access */
+            }
 
             /* PES header */
 
@@ -344,7 +625,7 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
                 flags |= 0x40; /* DTS */
             }
 
-            pes_size = (b->last - b->pos) + header_size + 3;
+            pes_size = size + header_size + 3;
             if (pes_size > 0xffff) {
                 pes_size = 0;
             }
@@ -366,12 +647,12 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
             first = 0;
         }
 
-        body_size = (ngx_uint_t) (packet + sizeof(packet) - p);
-        in_size = (ngx_uint_t) (b->last - b->pos);
+        body_size = (ngx_uint_t) (packet + NGX_RTMP_MPEGTS_PACKET_SIZE - p);
+        in_size = (ngx_uint_t) size;
 
         if (body_size <= in_size) {
-            ngx_memcpy(p, b->pos, body_size);
-            b->pos += body_size;
+            ngx_rtmp_mpegts_copy_chain(p, &in, body_size);
+            size -= body_size;
 
         } else {
             stuff_size = (body_size - in_size);
@@ -400,25 +681,35 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
                 }
             }
 
-            ngx_memcpy(p, b->pos, in_size);
-            b->pos = b->last;
+            ngx_rtmp_mpegts_copy_chain(p, &in, in_size);
+            size = 0;
         }
 
-        rc = ngx_rtmp_mpegts_write_file(file, packet, sizeof(packet));
-        if (rc != NGX_OK) {
-            return rc;
+        out += NGX_RTMP_MPEGTS_PACKET_SIZE;
+
+        if (out == buf + sizeof(buf)) {
+            rc = ngx_rtmp_mpegts_write_file(file, buf, sizeof(buf));
+            if (rc != NGX_OK) {
+                return rc;
+            }
+
+            out = buf;
         }
     }
 
+    if (out != buf) {
+        return ngx_rtmp_mpegts_write_file(file, buf, out - buf);
+    }
+
     return NGX_OK;
 }
 
 
 ngx_int_t
 ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
-    u_char *key, size_t key_len, uint64_t iv)
+    u_char *key, size_t key_len, uint64_t iv, ngx_uint_t method)
 {
-    if (AES_set_encrypt_key(key, key_len * 8, &file->key)) {
+    if (file->cipher == NULL || key_len != 16) {
         return NGX_ERROR;
     }
 
@@ -433,7 +724,236 @@ ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
     file->iv[14] = (u_char) (iv >> 8);
     file->iv[15] = (u_char) (iv);
 
-    file->encrypt = 1;
+    if (EVP_EncryptInit_ex(file->cipher, EVP_aes_128_cbc(), NULL, key,
+                           file->iv)
+        != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    /* SAMPLE-AES encrypts whole blocks only and restarts chain per sample */
+
+    file->sample_aes = (method == NGX_RTMP_MPEGTS_SAMPLE_AES);
+    file->encrypt = !file->sample_aes;
+
+    EVP_CIPHER_CTX_set_padding(file->cipher, file->encrypt);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_encrypt_blocks(ngx_rtmp_mpegts_file_t *file, u_char *p,
+    size_t len)
+{
+    int  n;
+
+    return EVP_EncryptUpdate(file->cipher, p, &n, p, (int) len) == 1
+           ? NGX_OK : NGX_ERROR;
+}
+
+
+/*
+ * SAMPLE-AES of H264: only slice NAL units longer than 48 bytes are
+ * encrypted. Starting after 32-byte clear leader every tenth 16-byte
+ * block is encrypted (1:9 pattern) over unescaped NAL payload;
+ * emulation prevention is applied again afterwards.
+ */
+
+static ngx_int_t
+ngx_rtmp_mpegts_encrypt_nal(ngx_rtmp_mpegts_file_t *file, ngx_buf_t *b,
+    u_char *nal, size_t *len)
+{
+    u_char     *p, *q, *last;
+    size_t      n, skip;
+    ngx_uint_t  zeros;
+
+    last = nal + *len;
+
+    /* remove emulation prevention bytes */
+
+    zeros = 0;
+
+    for (p = q = nal + 1; p < last; p++) {
+        if (zeros >= 2 && *p == 0x03) {
+            zeros = 0;
+            continue;
+        }
+
+        zeros = (*p == 0) ? zeros + 1 : 0;
+        *q++ = *p;
+    }
+
+    if (q != last) {
+        b->last = ngx_movemem(q, last, b->last - last);
+        last = q;
+    }
+
+    n = last - nal;
+
+    if (n > 48) {
+        if (EVP_EncryptInit_ex(file->cipher, NULL, NULL, NULL, file->iv) != 1)
+        {
+            return NGX_ERROR;
+        }
+
+        p = nal + 32;
+        n -= 32;
+
+        while (n > 16) {
+            if (ngx_rtmp_mpegts_encrypt_blocks(file, p, 16) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            p += 16;
+            n -= 16;
+
+            skip = ngx_min(n, 144);
+            p += skip;
+            n -= skip;
+        }
+    }
+
+    /* insert emulation prevention bytes */
+
+    zeros = 0;
+
+    for (p = nal + 1; p < last; p++) {
+        if (zeros >= 2 && *p <= 0x03) {
+            if (b->last == b->end) {
+                return NGX_ERROR;
+            }
+
+            ngx_movemem(p + 1, p, b->last - p);
+            *p++ = 0x03;
+
+            b->last++;
+            last++;
+            zeros = 0;
+        }
+
+        zeros = (*p == 0) ? zeros + 1 : 0;
+    }
+
+    *len = last - nal;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_mpegts_encrypt_video(ngx_rtmp_mpegts_file_t *file, ngx_buf_t *b)
+{
+    u_char     *nal, *next;
+    size_t      len, gap;
+    ngx_uint_t  type;
+
+    if (!file->sample_aes) {
+        return NGX_OK;
+    }
+
+    /* AnnexB start codes cannot appear inside escaped NAL units */
+
+    nal = NULL;
+    next = b->pos;
+
+    for ( ;; ) {
+
+        for (/* void */; next + 3 <= b->last; next++) {
+            if (next[0] == 0 && next[1] == 0 && next[2] == 1) {
+                break;
+            }
+        }
+
+        if (next + 3 > b->last) {
+            next = b->last;
+        }
+
+        if (nal) {
+            len = next - nal;
+
+            /* zero byte of the next 4-byte start code */
+
+            while (len && nal[len - 1] == 0) {
+                len--;
+            }
+
+            type = nal[0] & 0x1f;
+
+            if (len && (type == 1 || type == 5)) {
+                gap = next - (nal + len);
+
+                if (ngx_rtmp_mpegts_encrypt_nal(file, b, nal, &len)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                /* the rest of buffer has moved with NAL size change */
+
+                next = nal + len + gap;
+            }
+        }
+
+        if (next == b->last) {
+            break;
+        }
+
+        next += 3;
+        nal = next;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * SAMPLE-AES of AAC: ADTS frame payload after 16-byte clear leader is
+ * encrypted in whole blocks; the rest is left in clear.
+ */
+
+ngx_int_t
+ngx_rtmp_mpegts_encrypt_audio(ngx_rtmp_mpegts_file_t *file, ngx_buf_t *b)
+{
+    u_char  *p;
+    size_t   len, hlen, n;
+
+    if (!file->sample_aes) {
+        return NGX_OK;
+    }
+
+    for (p = b->pos; b->last - p >= 7; p += len) {
+
+        if (p[0] != 0xff || (p[1] & 0xf0) != 0xf0) {
+            /* not ADTS (mp3), left in clear */
+            break;
+        }
+
+        len = ((size_t) (p[3] & 0x03) << 11) | ((size_t) p[4] << 3)
+              | (p[5] >> 5);
+        hlen = (p[1] & 0x01) ? 7 : 9;
+
+        if (len < hlen || p + len > b->last) {
+            break;
+        }
+
+        if (len <= hlen + 16) {
+            continue;
+        }
+
+        n = (len - hlen - 16) & ~0x0f;
+
+        if (n == 0) {
+            continue;
+        }
+
+        if (EVP_EncryptInit_ex(file->cipher, NULL, NULL, NULL, file->iv) != 1
+            || ngx_rtmp_mpegts_encrypt_blocks(file, p + hlen + 16, n)
+               != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
 
     return NGX_OK;
 }
@@ -454,11 +974,11 @@ ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
         return NGX_ERROR;
     }
 
-    file->size = 0;
+    file->offset = 0;
 
-    if (ngx_rtmp_mpegts_write_header(file, codec_ctx, mpegts_cc) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      "hls: error writing fragment header");
+    if (ngx_rtmp_mpegts_start_fragment(file, codec_ctx, mpegts_cc)
+        != NGX_OK)
+    {
         ngx_close_file(file->fd);
         return NGX_ERROR;
     }
@@ -470,21 +990,123 @@ ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
 ngx_int_t
 ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file)
 {
+    ngx_int_t  rc;
+
+    rc = ngx_rtmp_mpegts_end_fragment(file);
+
+    ngx_rtmp_mpegts_release_file(file);
+
+    return rc;
+}
+
+
+/* Descriptor is kept while last fragment is to be dropped from cache */
+
+void
+ngx_rtmp_mpegts_release_file(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->cache_size == 0 || file->cache_fd != file->fd) {
+        ngx_close_file(file->fd);
+    }
+
+    file->fd = NGX_INVALID_FILE;
+}
+
+
+/*
+ * Fragments may follow each other in one file; each of them starts with
+ * its own PAT/PMT and, if encrypted, is padded separately.
+ */
+
+ngx_int_t
+ngx_rtmp_mpegts_start_fragment(ngx_rtmp_mpegts_file_t *file,
+    ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpegts_cc)
+{
+    file->start = file->offset;
+
+    if (file->preallocate
+        && ngx_rtmp_file_reserve(file->fd, file->offset,
+                                 ngx_rtmp_file_estimate(file->last_size),
+                                 file->log)
+           == NGX_OK)
+    {
+        file->reserved = 1;
+    }
+
+    if (ngx_rtmp_mpegts_write_header(file, codec_ctx, mpegts_cc) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, file->log, ngx_errno,
+                      "hls: error writing fragment header");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_mpegts_end_fragment(ngx_rtmp_mpegts_file_t *file)
+{
+    int      n;
     u_char   buf[16];
     ssize_t  rc;
 
     if (file->encrypt) {
-        ngx_memset(file->buf + file->size, 16 - file->size, 16 - file->size);
 
-        AES_cbc_encrypt(file->buf, buf, 16, &file->key, file->iv, AES_ENCRYPT);
+        /* PKCS7 padding of the last block */
+
+        if (EVP_EncryptFinal_ex(file->cipher, buf, &n) != 1) {
+            return NGX_ERROR;
+        }
 
-        rc = ngx_write_fd(file->fd, buf, 16);
+        rc = ngx_write_fd(file->fd, buf, (size_t) n);
         if (rc < 0) {
             return NGX_ERROR;
         }
+
+        file->offset += rc;
+        file->written += rc;
     }
 
-    ngx_close_file(file->fd);
+    file->last_size = file->offset - file->start;
+
+    if (file->reserved) {
+        ngx_rtmp_file_trim(file->fd, file->offset, file->log);
+        file->reserved = 0;
+    }
+
+    if (file->drop_cache) {
+        ngx_rtmp_mpegts_drop_cache(file);
+
+        ngx_rtmp_file_writeback(file->fd, file->start,
+                                file->offset - file->start, file->log);
+
+        file->cache_fd = file->fd;
+        file->cache_start = file->start;
+        file->cache_size = file->offset - file->start;
+    }
 
     return NGX_OK;
 }
+
+
+/*
+ * Drops previous fragment from page cache; its writeback was started
+ * when it was finished. Closes its file unless still written to.
+ */
+
+void
+ngx_rtmp_mpegts_drop_cache(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->cache_size == 0) {
+        return;
+    }
+
+    ngx_rtmp_file_drop_cache(file->cache_fd, file->cache_start,
+                             file->cache_size, file->log);
+
+    if (file->cache_fd != file->fd) {
+        ngx_close_file(file->cache_fd);
+    }
+
+    file->cache_size = 0;
+}
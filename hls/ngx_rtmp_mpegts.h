@@ -9,17 +9,52 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <ngx_rtmp_codec_module.h>
 
+
+#define NGX_RTMP_MPEGTS_AES_128         1
+#define NGX_RTMP_MPEGTS_SAMPLE_AES      2
+
+
+#define NGX_RTMP_MPEGTS_PACKET_SIZE     188
+
+
 typedef struct {
-    ngx_fd_t    fd;
-    ngx_log_t  *log;
-    unsigned    encrypt:1;
-    unsigned    size:4;
-    u_char      buf[16];
-    u_char      iv[16];
-    AES_KEY     key;
+    ngx_fd_t            fd;
+    ngx_log_t          *log;
+    off_t               offset;     /* bytes written to file */
+    unsigned            encrypt:1;
+    unsigned            sample_aes:1;
+    unsigned            pcr_due:1;
+    unsigned            psi_sync:1;
+    unsigned            preallocate:1;  /* set by caller */
+    unsigned            drop_cache:1;   /* set by caller */
+    unsigned            reserved:1;
+    u_char              iv[16];
+    EVP_CIPHER_CTX     *cipher;     /* owned by caller */
+
+    /* 90kHz, set by caller; 0 means PCR in every PES, PSI at start only */
+    uint64_t            pcr_interval;
+    uint64_t            psi_interval;
+
+    uint64_t            pcr_dts;
+    uint64_t            psi_dts;
+    ngx_uint_t          pcr_pid;
+    ngx_uint_t          psi_cc;
+    u_char              psi[NGX_RTMP_MPEGTS_PACKET_SIZE * 2];  /* PAT, PMT */
+
+    off_t               start;      /* current fragment offset */
+    off_t               last_size;  /* previous fragment, space estimate */
+
+    /* previous fragment written back, dropped from cache at next end */
+    ngx_fd_t            cache_fd;
+    off_t               cache_start;
+    off_t               cache_size;
+
+    /* never reset, for overhead stats */
+    off_t               written;
+    off_t               payload;
 } ngx_rtmp_mpegts_file_t;
 
 
@@ -34,12 +69,23 @@ typedef struct {
 
 
 ngx_int_t ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
-    u_char *key, size_t key_len, uint64_t iv);
+    u_char *key, size_t key_len, uint64_t iv, ngx_uint_t method);
+ngx_int_t ngx_rtmp_mpegts_encrypt_video(ngx_rtmp_mpegts_file_t *file,
+    ngx_buf_t *b);
+ngx_int_t ngx_rtmp_mpegts_encrypt_audio(ngx_rtmp_mpegts_file_t *file,
+    ngx_buf_t *b);
 ngx_int_t ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
     ngx_log_t *log, ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpegts_cc);
 ngx_int_t ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file);
+void ngx_rtmp_mpegts_release_file(ngx_rtmp_mpegts_file_t *file);
+ngx_int_t ngx_rtmp_mpegts_start_fragment(ngx_rtmp_mpegts_file_t *file,
+    ngx_rtmp_codec_ctx_t *codec_ctx, ngx_uint_t mpegts_cc);
+ngx_int_t ngx_rtmp_mpegts_end_fragment(ngx_rtmp_mpegts_file_t *file);
+void ngx_rtmp_mpegts_drop_cache(ngx_rtmp_mpegts_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
     ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b);
+ngx_int_t ngx_rtmp_mpegts_write_chain(ngx_rtmp_mpegts_file_t *file,
+    ngx_rtmp_mpegts_frame_t *f, ngx_chain_t *in);
 
 
 #endif /* _NGX_RTMP_MPEGTS_H_INCLUDED_ */
\ No newline at end of file
@@ -45,6 +45,7 @@ typedef struct {
 #endif
     unsigned                so_keepalive:2;
     unsigned                proxy_protocol:1;
+    unsigned                ssl:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                     tcp_keepidle;
     int                     tcp_keepintvl;
@@ -57,6 +58,7 @@ typedef struct {
     ngx_rtmp_conf_ctx_t    *ctx;
     ngx_str_t               addr_text;
     unsigned                proxy_protocol:1;
+    unsigned                ssl:1;
 } ngx_rtmp_addr_conf_t;
 
 typedef struct {
@@ -101,6 +103,7 @@ typedef struct {
 #endif
     unsigned                so_keepalive:2;
     unsigned                proxy_protocol:1;
+    unsigned                ssl:1;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                     tcp_keepidle;
     int                     tcp_keepintvl;
@@ -116,6 +119,12 @@ typedef struct {
 #define NGX_RTMP_DEFAULT_CHUNK_SIZE     128
 
 
+/* bounded output queue overflow policies */
+#define NGX_RTMP_OUT_DROP               0   /* drop message */
+#define NGX_RTMP_OUT_KEYFRAME           1   /* drop up to next key frame */
+#define NGX_RTMP_OUT_RECONNECT          2   /* close session */
+
+
 /* RTMP message types */
 #define NGX_RTMP_MSG_CHUNK_SIZE         1
 #define NGX_RTMP_MSG_ABORT              2
@@ -159,6 +168,9 @@ typedef struct {
  * + max 4  extended header (timestamp) */
 #define NGX_RTMP_MAX_CHUNK_HEADER       18
 
+/* outgoing chunk size classes, see chunk_size_auto */
+#define NGX_RTMP_CHUNK_CLASSES          5
+
 
 typedef struct {
     uint32_t                csid;       /* chunk stream id */
@@ -178,6 +190,19 @@ typedef struct {
 } ngx_rtmp_stream_t;
 
 
+/* receive block of in_buffer mode; data follows the header */
+typedef struct ngx_rtmp_in_block_s  ngx_rtmp_in_block_t;
+
+struct ngx_rtmp_in_block_s {
+    ngx_uint_t              ref;        /* payload slices in use */
+    ngx_rtmp_in_block_t    *next;
+    u_char                 *pos;        /* first unparsed byte */
+    u_char                 *last;
+    u_char                 *start;
+    u_char                 *end;
+};
+
+
 /* disable zero-sized array warning by msvc */
 
 #if (NGX_WIN32)
@@ -186,7 +211,7 @@ typedef struct {
 #endif
 
 
-typedef struct {
+typedef struct ngx_rtmp_session_s {
     uint32_t                signature;  /* "RTMP" */ /* <-- FIXME wtf */
 
     ngx_event_t             close;
@@ -225,6 +250,9 @@ typedef struct {
     unsigned                hs_old:1;
     ngx_uint_t              hs_stage;
 
+    /* accepted on "listen ... ssl" */
+    unsigned                ssl:1;
+
     /* connection timestamps */
     ngx_msec_t              epoch;
     ngx_msec_t              peer_epoch;
@@ -244,6 +272,11 @@ typedef struct {
     unsigned                auto_pushed:1;
     unsigned                relay:1;
     unsigned                static_relay:1;
+    unsigned                relay_failover:1;
+
+    /* multiplexed relay: sessions fed by message stream id */
+    struct ngx_rtmp_session_s **mux;
+    ngx_uint_t              nmux;
 
     /* input stream 0 (reserved by RTMP spec)
      * is used as free chain link */
@@ -258,6 +291,11 @@ typedef struct {
     ngx_pool_t             *in_old_pool;
     ngx_int_t               in_chunk_size_changing;
 
+    /* in_buffer mode: chunk payloads are slices of shared blocks */
+    ngx_rtmp_in_block_t    *in_block;
+    ngx_rtmp_in_block_t    *in_free_blocks;
+    ngx_chain_t            *in_free;
+
     ngx_connection_t       *connection;
 
     /* circular buffer of RTMP message pointers */
@@ -266,9 +304,27 @@ typedef struct {
     size_t                  out_pos, out_last;
     ngx_chain_t            *out_chain;
     u_char                 *out_bpos;
+    ngx_uint_t              out_chunk_class;
     unsigned                out_buffer:1;
     size_t                  out_queue;
     size_t                  out_cork;
+
+    /* bounded queue, enabled by out_time (enqueue time per slot) */
+    ngx_msec_t             *out_time;
+    size_t                  out_size;
+    size_t                  out_max_size;
+    ngx_msec_t              out_max_lag;
+    ngx_uint_t              out_policy;
+    ngx_uint_t              out_dropped;
+    ngx_uint_t              out_overflows;
+
+    /* output shaping */
+    ngx_rtmp_bucket_t      *out_bucket;
+    ngx_rtmp_bucket_t      *out_wait_bucket;
+    ngx_queue_t             out_wait;
+    uint64_t                out_throttled;
+    unsigned                out_throttling:1;
+
     ngx_chain_t            *out[0];
 } ngx_rtmp_session_t;
 
@@ -302,6 +358,10 @@ typedef struct {
     ngx_hash_t              amf_hash;
     ngx_array_t             amf_arrays;
     ngx_array_t             amf;
+
+    ngx_rtmp_bucket_t      *out_bucket;
+    ngx_array_t             buckets;    /* ngx_rtmp_bucket_t *, shared */
+    ngx_rtmp_bucket_shm_t  *buckets_shm;
 } ngx_rtmp_core_main_conf_t;
 
 
@@ -309,6 +369,18 @@ typedef struct {
 extern ngx_rtmp_core_main_conf_t   *ngx_rtmp_core_main_conf;
 
 
+/* constant status message, serialized once per worker */
+typedef struct ngx_rtmp_status_msg_s  ngx_rtmp_status_msg_t;
+
+struct ngx_rtmp_status_msg_s {
+    char                   *code;
+    char                   *level;
+    char                   *desc;
+    ngx_chain_t            *out;
+    ngx_rtmp_status_msg_t  *next;
+};
+
+
 typedef struct ngx_rtmp_core_srv_conf_s {
     ngx_array_t             applications; /* ngx_rtmp_core_app_conf_t */
 
@@ -321,10 +393,13 @@ typedef struct ngx_rtmp_core_srv_conf_s {
     ngx_uint_t              ack_window;
 
     ngx_int_t               chunk_size;
+    ngx_flag_t              chunk_size_auto;
+    size_t                  chunk_size_max;
     ngx_pool_t             *pool;
-    ngx_chain_t            *free;
-    ngx_chain_t            *free_hs;
+    ngx_chain_t            *free[NGX_RTMP_CHUNK_CLASSES];
+    ngx_buf_t              *free_hs;
     size_t                  max_message;
+    size_t                  in_buffer;
     ngx_flag_t              play_time_fix;
     ngx_flag_t              publish_time_fix;
     ngx_flag_t              busy;
@@ -332,6 +407,10 @@ typedef struct ngx_rtmp_core_srv_conf_s {
     size_t                  out_cork;
     ngx_msec_t              buflen;
 
+    /* prepared messages shared by all sessions */
+    ngx_rtmp_status_msg_t  *status;
+    ngx_chain_t            *sample_access;
+
     ngx_rtmp_conf_ctx_t    *ctx;
 } ngx_rtmp_core_srv_conf_t;
 
@@ -340,6 +419,10 @@ typedef struct {
     ngx_array_t             applications; /* ngx_rtmp_core_app_conf_t */
     ngx_str_t               name;
     void                  **app_conf;
+
+    size_t                  session_rate;
+    size_t                  session_burst;
+    ngx_rtmp_bucket_t      *out_bucket;
 } ngx_rtmp_core_app_conf_t;
 
 
@@ -405,10 +488,13 @@ char* ngx_rtmp_user_message_type(uint16_t evt);
 void ngx_rtmp_init_connection(ngx_connection_t *c);
 ngx_rtmp_session_t * ngx_rtmp_init_session(ngx_connection_t *c,
      ngx_rtmp_addr_conf_t *addr_conf);
+ngx_rtmp_session_t * ngx_rtmp_init_virtual_session(ngx_rtmp_conf_ctx_t *cctx,
+     ngx_str_t *addr_text, ngx_log_t *log);
 void ngx_rtmp_finalize_session(ngx_rtmp_session_t *s);
 void ngx_rtmp_handshake(ngx_rtmp_session_t *s);
 void ngx_rtmp_client_handshake(ngx_rtmp_session_t *s, unsigned async);
 void ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s);
+void ngx_rtmp_ssl_handshake(ngx_rtmp_session_t *s);
 void ngx_rtmp_cycle(ngx_rtmp_session_t *s);
 void ngx_rtmp_reset_ping(ngx_rtmp_session_t *s);
 ngx_int_t ngx_rtmp_fire_event(ngx_rtmp_session_t *s, ngx_uint_t evt,
@@ -487,6 +573,18 @@ void ngx_rtmp_free_shared_chain(ngx_rtmp_core_srv_conf_t *cscf,
 ngx_chain_t * ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
         ngx_chain_t *head, ngx_chain_t *in);
 
+/* Chunk size classes: buffers of class n carry chunk_size << n bytes */
+
+#define ngx_rtmp_class_chunk_size(cscf, cls)                                  \
+    ((size_t) (cscf)->chunk_size << (cls))
+
+ngx_chain_t * ngx_rtmp_alloc_class_buf(ngx_rtmp_core_srv_conf_t *cscf,
+        ngx_uint_t cls);
+ngx_chain_t * ngx_rtmp_append_class_bufs(ngx_rtmp_core_srv_conf_t *cscf,
+        ngx_uint_t cls, ngx_chain_t *head, ngx_chain_t *in);
+ngx_uint_t ngx_rtmp_shared_chain_class(ngx_rtmp_core_srv_conf_t *cscf,
+        ngx_chain_t *in);
+
 #define ngx_rtmp_acquire_shared_chain(in)   \
     ngx_rtmp_ref_get(in);                   \
 
@@ -594,11 +692,14 @@ ngx_int_t ngx_rtmp_send_close_method(ngx_rtmp_session_t *s, char *methodName);
 #define NGX_RTMP_VIDEO_INTER_FRAME          2
 #define NGX_RTMP_VIDEO_DISPOSABLE_FRAME     3
 
+/* Enhanced RTMP video tag: packet type in low bits, FourCC follows */
+#define NGX_RTMP_VIDEO_EX_HEADER            0x80
+
 
 static ngx_inline ngx_int_t
 ngx_rtmp_get_video_frame_type(ngx_chain_t *in)
 {
-    return (in->buf->pos[0] & 0xf0) >> 4;
+    return (in->buf->pos[0] & 0x70) >> 4;
 }
 
 
@@ -609,6 +710,20 @@ ngx_rtmp_is_codec_header(ngx_chain_t *in)
 }
 
 
+static ngx_inline ngx_int_t
+ngx_rtmp_is_video_codec_header(ngx_chain_t *in)
+{
+    if (in->buf->pos < in->buf->last
+        && (in->buf->pos[0] & NGX_RTMP_VIDEO_EX_HEADER))
+    {
+        /* PacketTypeSequenceStart */
+        return (in->buf->pos[0] & 0x0f) == 0;
+    }
+
+    return ngx_rtmp_is_codec_header(in);
+}
+
+
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_out;
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_in;
 
@@ -623,6 +738,7 @@ extern ngx_thread_volatile ngx_event_t     *ngx_rtmp_init_queue;
 #endif
 
 extern ngx_uint_t                           ngx_rtmp_max_module;
+extern ngx_module_t                         ngx_rtmp_module;
 extern ngx_module_t                         ngx_rtmp_core_module;
 
 
@@ -20,6 +20,8 @@ static ngx_rtmp_play_pt             next_play;
 
 static char * ngx_rtmp_access_rule(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
+static char * ngx_rtmp_access_file(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
 static ngx_int_t ngx_rtmp_access_postconfiguration(ngx_conf_t *cf);
 static void * ngx_rtmp_access_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_access_merge_app_conf(ngx_conf_t *cf,
@@ -46,10 +48,27 @@ typedef struct {
 #endif
 
 
+/*
+ * Rules are compiled into binary prefix tree. Each node keeps the first
+ * rule with its exact prefix for publish and play. Since every rule
+ * matching an address lies on the path to it, the first matching rule
+ * is the one with the lowest number along the path.
+ */
+
+typedef struct ngx_rtmp_access_node_s  ngx_rtmp_access_node_t;
+
+struct ngx_rtmp_access_node_s {
+    ngx_rtmp_access_node_t *child[2];
+    ngx_uint_t              rule[2];   /* rule number + 1, per flag */
+};
+
+
 typedef struct {
     ngx_array_t             rules;     /* array of ngx_rtmp_access_rule_t */
+    ngx_rtmp_access_node_t *tree;
 #if (NGX_HAVE_INET6)
     ngx_array_t             rules6;    /* array of ngx_rtmp_access_rule6_t */
+    ngx_rtmp_access_node_t *tree6;
 #endif
 } ngx_rtmp_access_app_conf_t;
 
@@ -70,6 +89,13 @@ static ngx_command_t  ngx_rtmp_access_commands[] = {
       0,
       NULL },
 
+    { ngx_string("access_file"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_access_file,
+      NGX_RTMP_APP_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -157,20 +183,128 @@ ngx_rtmp_access_merge_rules(ngx_array_t *prev, ngx_array_t *rules)
 }
 
 
+static ngx_int_t
+ngx_rtmp_access_insert(ngx_pool_t *pool, ngx_rtmp_access_node_t **tree,
+    u_char *addr, u_char *mask, size_t len, ngx_uint_t rule, ngx_uint_t flags)
+{
+    ngx_uint_t               n, bit;
+    ngx_rtmp_access_node_t  *node, **pnode;
+
+    pnode = tree;
+
+    for (n = 0; ; n++) {
+
+        if (*pnode == NULL) {
+            *pnode = ngx_pcalloc(pool, sizeof(ngx_rtmp_access_node_t));
+            if (*pnode == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        node = *pnode;
+
+        if (n == len * 8 || !(mask[n / 8] & (0x80 >> (n % 8)))) {
+            break;
+        }
+
+        bit = (addr[n / 8] & (0x80 >> (n % 8))) ? 1 : 0;
+        pnode = &node->child[bit];
+    }
+
+    /* later rules with the same prefix are never reached */
+
+    if ((flags & NGX_RTMP_ACCESS_PUBLISH) && node->rule[0] == 0) {
+        node->rule[0] = rule + 1;
+    }
+
+    if ((flags & NGX_RTMP_ACCESS_PLAY) && node->rule[1] == 0) {
+        node->rule[1] = rule + 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_rtmp_access_find(ngx_rtmp_access_node_t *node, u_char *addr, size_t len,
+    ngx_uint_t flag)
+{
+    ngx_uint_t  n, i, rule;
+
+    i = (flag & NGX_RTMP_ACCESS_PUBLISH) ? 0 : 1;
+    rule = 0;
+
+    for (n = 0; node; n++) {
+
+        if (node->rule[i] && (rule == 0 || node->rule[i] < rule)) {
+            rule = node->rule[i];
+        }
+
+        if (n == len * 8) {
+            break;
+        }
+
+        node = node->child[(addr[n / 8] & (0x80 >> (n % 8))) ? 1 : 0];
+    }
+
+    return rule;
+}
+
+
 static char *
 ngx_rtmp_access_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_rtmp_access_app_conf_t *prev = parent;
     ngx_rtmp_access_app_conf_t *conf = child;
 
+    ngx_uint_t                  i;
+    ngx_rtmp_access_rule_t     *rule;
+#if (NGX_HAVE_INET6)
+    ngx_rtmp_access_rule6_t    *rule6;
+#endif
+
     if (ngx_rtmp_access_merge_rules(&prev->rules, &conf->rules) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
+    if (conf->rules.elts == prev->rules.elts && prev->tree) {
+        conf->tree = prev->tree;
+
+    } else {
+        rule = conf->rules.elts;
+        for (i = 0; i < conf->rules.nelts; i++) {
+            if (ngx_rtmp_access_insert(cf->pool, &conf->tree,
+                                       (u_char *) &rule[i].addr,
+                                       (u_char *) &rule[i].mask,
+                                       sizeof(in_addr_t), i, rule[i].flags)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
 #if (NGX_HAVE_INET6)
     if (ngx_rtmp_access_merge_rules(&prev->rules6, &conf->rules6) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
+
+    if (conf->rules6.elts == prev->rules6.elts && prev->tree6) {
+        conf->tree6 = prev->tree6;
+
+    } else {
+        rule6 = conf->rules6.elts;
+        for (i = 0; i < conf->rules6.nelts; i++) {
+            if (ngx_rtmp_access_insert(cf->pool, &conf->tree6,
+                                       rule6[i].addr.s6_addr,
+                                       rule6[i].mask.s6_addr,
+                                       16, i, rule6[i].flags)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
 #endif
 
     return NGX_CONF_OK;
@@ -199,19 +333,20 @@ ngx_rtmp_access_inet(ngx_rtmp_session_t *s, in_addr_t addr, ngx_uint_t flag)
 
     ascf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_access_module);
 
-    rule = ascf->rules.elts;
-    for (i = 0; i < ascf->rules.nelts; i++) {
+    i = ngx_rtmp_access_find(ascf->tree, (u_char *) &addr, sizeof(in_addr_t),
+                             flag);
+    if (i == 0) {
+        return NGX_OK;
+    }
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
-                       "access: %08XD %08XD %08XD",
-                       addr, rule[i].mask, rule[i].addr);
+    rule = ascf->rules.elts;
+    rule += i - 1;
 
-        if ((addr & rule[i].mask) == rule[i].addr && (flag & rule[i].flags)) {
-            return ngx_rtmp_access_found(s, rule[i].deny);
-        }
-    }
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "access: %08XD %08XD %08XD rule=%ui",
+                   addr, rule->mask, rule->addr, i);
 
-    return NGX_OK;
+    return ngx_rtmp_access_found(s, rule->deny);
 }
 
 
@@ -220,47 +355,37 @@ ngx_rtmp_access_inet(ngx_rtmp_session_t *s, in_addr_t addr, ngx_uint_t flag)
 static ngx_int_t
 ngx_rtmp_access_inet6(ngx_rtmp_session_t *s, u_char *p, ngx_uint_t flag)
 {
-    ngx_uint_t                  n;
     ngx_uint_t                  i;
     ngx_rtmp_access_rule6_t    *rule6;
     ngx_rtmp_access_app_conf_t *ascf;
 
     ascf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_access_module);
 
+    i = ngx_rtmp_access_find(ascf->tree6, p, 16, flag);
+    if (i == 0) {
+        return NGX_OK;
+    }
+
     rule6 = ascf->rules6.elts;
-    for (i = 0; i < ascf->rules6.nelts; i++) {
+    rule6 += i - 1;
 
 #if (NGX_DEBUG)
-        {
-        size_t  cl, ml, al;
-        u_char  ct[NGX_INET6_ADDRSTRLEN];
-        u_char  mt[NGX_INET6_ADDRSTRLEN];
-        u_char  at[NGX_INET6_ADDRSTRLEN];
-
-        cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
-        ml = ngx_inet6_ntop(rule6[i].mask.s6_addr, mt, NGX_INET6_ADDRSTRLEN);
-        al = ngx_inet6_ntop(rule6[i].addr.s6_addr, at, NGX_INET6_ADDRSTRLEN);
-
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
-                       "access: %*s %*s %*s", cl, ct, ml, mt, al, at);
-        }
-#endif
+    {
+    size_t  cl, ml, al;
+    u_char  ct[NGX_INET6_ADDRSTRLEN];
+    u_char  mt[NGX_INET6_ADDRSTRLEN];
+    u_char  at[NGX_INET6_ADDRSTRLEN];
 
-        for (n = 0; n < 16; n++) {
-            if ((p[n] & rule6[i].mask.s6_addr[n]) != rule6[i].addr.s6_addr[n]) {
-                goto next;
-            }
-        }
+    cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
+    ml = ngx_inet6_ntop(rule6->mask.s6_addr, mt, NGX_INET6_ADDRSTRLEN);
+    al = ngx_inet6_ntop(rule6->addr.s6_addr, at, NGX_INET6_ADDRSTRLEN);
 
-        if (flag & rule6[i].flags) {
-            return ngx_rtmp_access_found(s, rule6[i].deny);
-        }
-
-    next:
-        continue;
+    ngx_log_debug6(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                   "access: %*s %*s %*s", cl, ct, ml, mt, al, at);
     }
+#endif
 
-    return NGX_OK;
+    return ngx_rtmp_access_found(s, rule6->deny);
 }
 
 #endif
@@ -318,24 +443,88 @@ ngx_rtmp_access(ngx_rtmp_session_t *s, ngx_uint_t flag)
 }
 
 
-static char *
-ngx_rtmp_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_int_t
+ngx_rtmp_access_add(ngx_conf_t *cf, ngx_rtmp_access_app_conf_t *ascf,
+    ngx_str_t *value, ngx_uint_t deny, ngx_uint_t flags)
 {
-    ngx_rtmp_access_app_conf_t         *ascf = conf;
-
     ngx_int_t                           rc;
     ngx_uint_t                          all;
-    ngx_str_t                          *value;
     ngx_cidr_t                          cidr;
     ngx_rtmp_access_rule_t             *rule;
 #if (NGX_HAVE_INET6)
     ngx_rtmp_access_rule6_t            *rule6;
 #endif
-    size_t                              n;
-    ngx_uint_t                          flags;
 
     ngx_memzero(&cidr, sizeof(ngx_cidr_t));
 
+    all = (value->len == 3 && ngx_strncmp(value->data, "all", 3) == 0);
+
+    if (!all) {
+
+        rc = ngx_ptocidr(value, &cidr);
+
+        if (rc == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", value);
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DONE) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "low address bits of %V are meaningless",
+                               value);
+        }
+    }
+
+    switch (cidr.family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+    case 0: /* all */
+
+        rule6 = ngx_array_push(&ascf->rules6);
+        if (rule6 == NULL) {
+            return NGX_ERROR;
+        }
+
+        rule6->mask = cidr.u.in6.mask;
+        rule6->addr = cidr.u.in6.addr;
+        rule6->deny = deny;
+        rule6->flags = flags;
+
+        if (!all) {
+            break;
+        }
+
+        /* "all" passes through */
+#endif
+
+    default: /* AF_INET */
+
+        rule = ngx_array_push(&ascf->rules);
+        if (rule == NULL) {
+            return NGX_ERROR;
+        }
+
+        rule->mask = cidr.u.in.mask;
+        rule->addr = cidr.u.in.addr;
+        rule->deny = deny;
+        rule->flags = flags;
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_rtmp_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_access_app_conf_t         *ascf = conf;
+
+    ngx_str_t                          *value;
+    size_t                              n;
+    ngx_uint_t                          flags;
+
     value = cf->args->elts;
 
     n = 1;
@@ -371,62 +560,165 @@ ngx_rtmp_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    all = (value[n].len == 3 && ngx_strcmp(value[n].data, "all") == 0);
+    if (ngx_rtmp_access_add(cf, ascf, &value[n], value[0].data[0] == 'd',
+                            flags)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
 
-    if (!all) {
+    return NGX_CONF_OK;
+}
 
-        rc = ngx_ptocidr(&value[n], &cidr);
 
-        if (rc == NGX_ERROR) {
+static char *
+ngx_rtmp_access_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_access_app_conf_t         *ascf = conf;
+
+    char                               *rv;
+    u_char                             *p, *last, *word[2];
+    size_t                              len[2];
+    ssize_t                             n;
+    ngx_str_t                          *value, name, addr;
+    ngx_uint_t                          flags, deny, line, k;
+    ngx_file_t                          file;
+    ngx_file_info_t                     fi;
+
+    value = cf->args->elts;
+
+    flags = NGX_RTMP_ACCESS_PUBLISH | NGX_RTMP_ACCESS_PLAY;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[1].data, "publish") == 0) {
+            flags = NGX_RTMP_ACCESS_PUBLISH;
+
+        } else if (ngx_strcmp(value[1].data, "play") == 0) {
+            flags = NGX_RTMP_ACCESS_PLAY;
+
+        } else {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "invalid parameter \"%V\"", &value[1]);
+                               "unexpected access specified: '%V'",
+                               &value[1]);
             return NGX_CONF_ERROR;
         }
+    }
 
-        if (rc == NGX_DONE) {
-            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                               "low address bits of %V are meaningless",
-                               &value[1]);
-        }
+    name = value[cf->args->nelts - 1];
+
+    if (ngx_conf_full_name(cf->cycle, &name, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
-    switch (cidr.family) {
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-#if (NGX_HAVE_INET6)
-    case AF_INET6:
-    case 0: /* all */
+    file.name = name;
+    file.log = cf->log;
 
-        rule6 = ngx_array_push(&ascf->rules6);
-        if (rule6 == NULL) {
-            return NGX_CONF_ERROR;
+    file.fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    rv = NGX_CONF_ERROR;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &name);
+        goto done;
+    }
+
+    p = ngx_pnalloc(cf->temp_pool, ngx_file_size(&fi));
+    if (p == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_file(&file, p, ngx_file_size(&fi), 0);
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    last = p + n;
+
+    /* "allow|deny address|subnet|all" per line, '#' starts comment */
+
+    for (line = 1; p < last; line++) {
+
+        for (k = 0; k < 2; k++) {
+            while (p < last && (*p == ' ' || *p == '\t' || *p == '\r')) {
+                p++;
+            }
+
+            word[k] = p;
+
+            while (p < last && *p != ' ' && *p != '\t' && *p != '\r'
+                   && *p != '\n' && *p != ';' && *p != '#')
+            {
+                p++;
+            }
+
+            len[k] = p - word[k];
         }
 
-        rule6->mask = cidr.u.in6.mask;
-        rule6->addr = cidr.u.in6.addr;
-        rule6->deny = (value[0].data[0] == 'd') ? 1 : 0;
-        rule6->flags = flags;
+        while (p < last && *p != '\n' && *p != '#') {
+            if (*p != ' ' && *p != '\t' && *p != '\r' && *p != ';') {
+                len[0] = 1;
+                len[1] = 0;
+                break;
+            }
 
-        if (!all) {
-            break;
+            p++;
         }
 
-        /* "all" passes through */
-#endif
+        while (p < last && *p++ != '\n') { /* void */ }
 
-    default: /* AF_INET */
+        if (len[0] == 0) {
+            continue;
+        }
 
-        rule = ngx_array_push(&ascf->rules);
-        if (rule == NULL) {
-            return NGX_CONF_ERROR;
+        if (len[0] == sizeof("allow") - 1
+            && ngx_strncmp(word[0], "allow", len[0]) == 0)
+        {
+            deny = 0;
+
+        } else if (len[0] == sizeof("deny") - 1
+                   && ngx_strncmp(word[0], "deny", len[0]) == 0)
+        {
+            deny = 1;
+
+        } else {
+            deny = 0;
+            len[1] = 0;
         }
 
-        rule->mask = cidr.u.in.mask;
-        rule->addr = cidr.u.in.addr;
-        rule->deny = (value[0].data[0] == 'd') ? 1 : 0;
-        rule->flags = flags;
+        if (len[1] == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid rule in \"%V\" line %ui",
+                               &name, line);
+            goto done;
+        }
+
+        addr.data = word[1];
+        addr.len = len[1];
+
+        if (ngx_rtmp_access_add(cf, ascf, &addr, deny, flags) != NGX_OK) {
+            goto done;
+        }
     }
 
-    return NGX_CONF_OK;
+    rv = NGX_CONF_OK;
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &name);
+    }
+
+    return rv;
 }
 
 
@@ -63,6 +63,29 @@ ngx_rtmp_amf_debug(const char* op, ngx_log_t *log, u_char *p, size_t n)
 }
 #endif
 
+/* returns n contiguous bytes at cursor or NULL if data is split */
+static ngx_inline u_char *
+ngx_rtmp_amf_peek(ngx_rtmp_amf_ctx_t *ctx, size_t n)
+{
+    u_char         *pos;
+
+    while (ctx->link) {
+        pos = ctx->link->buf->pos + ctx->offset;
+
+        if (pos != ctx->link->buf->last || ctx->link->next == NULL) {
+            return ctx->link->buf->last >= pos + n ? pos : NULL;
+        }
+
+        /* current link is exhausted */
+
+        ctx->link = ctx->link->next;
+        ctx->offset = 0;
+    }
+
+    return NULL;
+}
+
+
 static ngx_int_t
 ngx_rtmp_amf_get(ngx_rtmp_amf_ctx_t *ctx, void *p, size_t n)
 {
@@ -78,6 +101,24 @@ ngx_rtmp_amf_get(ngx_rtmp_amf_ctx_t *ctx, void *p, size_t n)
     if (!n)
         return NGX_OK;
 
+    /* fast path: data is in current link */
+
+    pos = ngx_rtmp_amf_peek(ctx, n);
+
+    if (pos) {
+        if (p) {
+            ngx_memcpy(p, pos, n);
+        }
+
+        ctx->offset += n;
+
+#ifdef NGX_DEBUG
+        ngx_rtmp_amf_debug("read", ctx->log, (u_char*)op, on);
+#endif
+
+        return NGX_OK;
+    }
+
     for(l = ctx->link, offset = ctx->offset; l; l = l->next, offset = 0) {
 
         pos  = l->buf->pos + offset;
@@ -113,6 +154,44 @@ ngx_rtmp_amf_get(ngx_rtmp_amf_ctx_t *ctx, void *p, size_t n)
 }
 
 
+static ngx_int_t
+ngx_rtmp_amf_get_view(ngx_rtmp_amf_ctx_t *ctx, ngx_str_t *v, size_t n)
+{
+    u_char         *pos;
+    ngx_buf_t      *b;
+
+    v->len = n;
+
+    pos = ngx_rtmp_amf_peek(ctx, n);
+
+    if (pos) {
+        v->data = pos;
+        ctx->offset += n;
+        return NGX_OK;
+    }
+
+    /* split between chunks */
+
+    b = ctx->scratch;
+
+    if (b == NULL || (size_t) (b->end - b->last) < n) {
+        ngx_log_error(NGX_LOG_INFO, ctx->log, 0,
+                      "AMF string of %uz bytes is too long", n);
+        return NGX_ERROR;
+    }
+
+    v->data = b->last;
+
+    if (ngx_rtmp_amf_get(ctx, b->last, n) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->last += n;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_amf_put(ngx_rtmp_amf_ctx_t *ctx, void *p, size_t n)
 {
@@ -130,6 +209,13 @@ ngx_rtmp_amf_put(ngx_rtmp_amf_ctx_t *ctx, void *p, size_t n)
         ctx->first = ctx->link;
     }
 
+    /* fast path: fits in current shared buffer */
+
+    if (l && (size_t) (l->buf->end - l->buf->last) >= n) {
+        l->buf->last = ngx_cpymem(l->buf->last, p, n);
+        return NGX_OK;
+    }
+
     while(n) {
         b = l ? l->buf : NULL;
 
@@ -177,7 +263,7 @@ ngx_rtmp_amf_read_object(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
     uint16_t                len;
     size_t                  n, namelen, maxlen;
     ngx_int_t               rc;
-    u_char                  buf[2];
+    u_char                  buf[2], *p;
 
     maxlen = 0;
     for(n = 0; n < nelts; ++n) {
@@ -212,14 +298,24 @@ ngx_rtmp_amf_read_object(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
         if (!len)
             break;
 
+        /* match key in place if possible, longer keys cannot match */
+
+        p = NULL;
+
         if (len <= maxlen) {
-            rc = ngx_rtmp_amf_get(ctx, name, len);
+            p = ngx_rtmp_amf_peek(ctx, len);
+
+            if (p) {
+                ctx->offset += len;
+                rc = NGX_OK;
+
+            } else {
+                p = (u_char *) name;
+                rc = ngx_rtmp_amf_get(ctx, p, len);
+            }
 
         } else {
-            rc = ngx_rtmp_amf_get(ctx, name, maxlen);
-            if (rc != NGX_OK)
-                return NGX_ERROR;
-            rc = ngx_rtmp_amf_get(ctx, 0, len - maxlen);
+            rc = ngx_rtmp_amf_get(ctx, NULL, len);
         }
 
         if (rc != NGX_OK)
@@ -227,11 +323,15 @@ ngx_rtmp_amf_read_object(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
 
         /* TODO: if we require array to be sorted on name
          * then we could be able to use binary search */
-        for(n = 0; n < nelts
+        for(n = 0; p && n < nelts
                 && (len != elts[n].name.len
-                    || ngx_strncmp(name, elts[n].name.data, len));
+                    || ngx_strncmp(p, elts[n].name.data, len));
                 ++n);
 
+        if (p == NULL) {
+            n = nelts;
+        }
+
         if (ngx_rtmp_amf_read(ctx, n < nelts ? &elts[n] : NULL, 1) != NGX_OK)
             return NGX_ERROR;
     }
@@ -284,14 +384,17 @@ ngx_rtmp_amf_read_variant(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
     }
 
     ngx_memzero(&elt, sizeof(elt));
+    elt.type = type;
+
     for (n = 0; n < nelts; ++n, ++elts) {
-        if (type == elts->type) {
+        if (type == (elts->type & ~NGX_RTMP_AMF_VIEW)) {
+            elt.type = elts->type;
             elt.data = elts->data;
             elt.len  = elts->len;
         }
     }
 
-    elt.type = type | NGX_RTMP_AMF_TYPELESS;
+    elt.type |= NGX_RTMP_AMF_TYPELESS;
 
     return ngx_rtmp_amf_read(ctx, &elt, 1);
 }
@@ -322,13 +425,13 @@ ngx_rtmp_amf_read(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
     for(n = 0; n < nelts; ++n) {
 
         if (elts && elts->type & NGX_RTMP_AMF_TYPELESS) {
-            type = elts->type & ~NGX_RTMP_AMF_TYPELESS;
+            type = elts->type & ~(NGX_RTMP_AMF_TYPELESS|NGX_RTMP_AMF_VIEW);
             data = elts->data;
 
         } else {
             switch (ngx_rtmp_amf_get(ctx, &type8, 1)) {
                 case NGX_DONE:
-                    if (elts->type & NGX_RTMP_AMF_OPTIONAL) {
+                    if (elts && elts->type & NGX_RTMP_AMF_OPTIONAL) {
                         return NGX_OK;
                     }
                 case NGX_ERROR:
@@ -372,6 +475,9 @@ ngx_rtmp_amf_read(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_amf_elt_t *elts,
                 if (data == NULL) {
                     rc = ngx_rtmp_amf_get(ctx, data, len);
 
+                } else if (elts->type & NGX_RTMP_AMF_VIEW) {
+                    rc = ngx_rtmp_amf_get_view(ctx, data, len);
+
                 } else if (elts->len <= len) {
                     rc = ngx_rtmp_amf_get(ctx, data, elts->len - 1);
                     if (rc != NGX_OK)
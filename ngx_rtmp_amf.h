@@ -34,6 +34,12 @@
 #define NGX_RTMP_AMF_TYPELESS           0x2000
 #define NGX_RTMP_AMF_CONTEXT            0x4000
 
+/*
+ * read string as ngx_str_t view into input buffer; strings split
+ * between chunks are copied to ctx->scratch
+ */
+#define NGX_RTMP_AMF_VIEW               0x8000
+
 #define NGX_RTMP_AMF_VARIANT            (NGX_RTMP_AMF_VARIANT_\
                                         |NGX_RTMP_AMF_TYPELESS)
 
@@ -54,6 +60,7 @@ typedef struct {
     size_t                              offset;
     ngx_rtmp_amf_alloc_pt               alloc;
     void                               *arg;
+    ngx_buf_t                          *scratch;
     ngx_log_t                          *log;
 } ngx_rtmp_amf_ctx_t;
 
@@ -24,3 +24,119 @@ ngx_rtmp_update_bandwidth(ngx_rtmp_bandwidth_t *bw, uint32_t bytes)
     bw->bytes += bytes;
     bw->intl_bytes += bytes;
 }
+
+
+void
+ngx_rtmp_bucket_init(ngx_rtmp_bucket_t *b, size_t rate, size_t burst,
+    ngx_log_t *log)
+{
+    ngx_memzero(b, sizeof(*b));
+
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    b->last = ngx_current_msec;
+
+    ngx_queue_init(&b->waiting);
+
+    b->event.data = b;
+    b->event.log = log;
+}
+
+
+static void
+ngx_rtmp_bucket_fill(uint64_t *tokens, ngx_msec_t *last, size_t rate,
+    size_t burst)
+{
+    uint64_t    add;
+    ngx_msec_t  elapsed;
+
+    elapsed = ngx_current_msec - *last;
+
+    add = (uint64_t) rate * elapsed / 1000;
+
+    /* keep the fraction for the next time */
+
+    if (add == 0) {
+        return;
+    }
+
+    *last = ngx_current_msec;
+
+    *tokens += add;
+
+    if (*tokens > burst) {
+        *tokens = burst;
+    }
+}
+
+
+size_t
+ngx_rtmp_bucket_take(ngx_rtmp_bucket_t *b, size_t size)
+{
+    uint64_t                grab;
+    ngx_rtmp_bucket_shm_t  *sh;
+
+    sh = b->shared;
+
+    if (sh == NULL) {
+        ngx_rtmp_bucket_fill(&b->tokens, &b->last, b->rate, b->burst);
+        return (size_t) ngx_min(b->tokens, size);
+    }
+
+    /*
+     * Worker keeps a few tokens taken from shared bucket
+     * to avoid locking it on every send
+     */
+
+    if (b->tokens < size) {
+        grab = ngx_max(size - b->tokens, b->rate / 100);
+
+        ngx_spinlock(&sh->lock, ngx_pid, 1024);
+
+        ngx_rtmp_bucket_fill(&sh->tokens, &sh->last, b->rate, b->burst);
+
+        grab = ngx_min(grab, sh->tokens);
+        sh->tokens -= grab;
+
+        ngx_unlock(&sh->lock);
+
+        b->tokens += grab;
+    }
+
+    return (size_t) ngx_min(b->tokens, size);
+}
+
+
+void
+ngx_rtmp_bucket_consume(ngx_rtmp_bucket_t *b, size_t size,
+    ngx_uint_t throttled)
+{
+    b->tokens -= ngx_min(b->tokens, size);
+
+    if (!throttled) {
+        return;
+    }
+
+    if (b->shared) {
+        (void) ngx_atomic_fetch_add(&b->shared->throttled, size);
+        return;
+    }
+
+    b->throttled += size;
+}
+
+
+ngx_msec_t
+ngx_rtmp_bucket_delay(ngx_rtmp_bucket_t *b, size_t size)
+{
+    return (ngx_msec_t) ((uint64_t) ngx_min(size, b->burst) * 1000 / b->rate)
+           + 1;
+}
+
+
+uint64_t
+ngx_rtmp_bucket_throttled(ngx_rtmp_bucket_t *b)
+{
+    return b->shared ? (uint64_t) b->shared->throttled : b->throttled;
+}
@@ -10,6 +10,7 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include <ngx_event.h>
 
 
 /* Bandwidth update interval in seconds */
@@ -25,7 +26,41 @@ typedef struct {
 } ngx_rtmp_bandwidth_t;
 
 
+/* Max bytes sent by shaped session at once before yielding to others */
+#define NGX_RTMP_BUCKET_QUANTUM         16384
+
+
+/* Part of token bucket shared by workers */
+typedef struct {
+    ngx_atomic_t        lock;
+    uint64_t            tokens;
+    ngx_msec_t          last;
+    ngx_atomic_t        throttled;      /* bytes */
+} ngx_rtmp_bucket_shm_t;
+
+
+/* Output token bucket */
+typedef struct {
+    size_t                  rate;       /* bytes/sec */
+    size_t                  burst;
+    uint64_t                tokens;
+    ngx_msec_t              last;
+    uint64_t                throttled;  /* bytes */
+    ngx_rtmp_bucket_shm_t  *shared;     /* NULL for per-session buckets */
+    ngx_queue_t             waiting;    /* throttled sessions */
+    ngx_event_t             event;
+} ngx_rtmp_bucket_t;
+
+
 void ngx_rtmp_update_bandwidth(ngx_rtmp_bandwidth_t *bw, uint32_t bytes);
 
+void ngx_rtmp_bucket_init(ngx_rtmp_bucket_t *b, size_t rate, size_t burst,
+    ngx_log_t *log);
+size_t ngx_rtmp_bucket_take(ngx_rtmp_bucket_t *b, size_t size);
+void ngx_rtmp_bucket_consume(ngx_rtmp_bucket_t *b, size_t size,
+    ngx_uint_t throttled);
+ngx_msec_t ngx_rtmp_bucket_delay(ngx_rtmp_bucket_t *b, size_t size);
+uint64_t ngx_rtmp_bucket_throttled(ngx_rtmp_bucket_t *b);
+
 
 #endif /* _NGX_RTMP_BANDWIDTH_H_INCLUDED_ */
@@ -31,6 +31,8 @@ static void ngx_rtmp_codec_parse_aac_header(ngx_rtmp_session_t *s,
 
 static void ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
+static void ngx_rtmp_codec_parse_hevc_header(ngx_rtmp_session_t *s,
+       ngx_chain_t *in);
 #if (NGX_DEBUG)
 static void ngx_rtmp_codec_dump_header(ngx_rtmp_session_t *s, const char *type,
        ngx_chain_t *in);
@@ -123,8 +125,17 @@ video_codecs[] = {
     "On2-VP6-Alpha",
     "ScreenVideo2",
     "H264",
+    "",
+    "",
+    "",
+    "",
+    "H265",
 };
 
+
+/* Enhanced RTMP FourCC of HEVC */
+#define NGX_RTMP_CODEC_FOURCC_HVC1  0x68766331
+
 enum {
     AUDIO_CODEC_MP3_VERSION_MPEG_VERSION25,
     AUDIO_CODEC_MP3_VERSION_MPEG_RESERVED,
@@ -326,6 +337,140 @@ ngx_rtmp_codec_parse_mp3_frame_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
 
 
 
+static uint32_t
+ngx_rtmp_codec_get_fourcc(u_char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+           | ((uint32_t) p[2] << 8) | p[3];
+}
+
+
+static int32_t
+ngx_rtmp_codec_get_cts(u_char *p)
+{
+    int32_t  cts;
+
+    /* SI24 */
+
+    cts = ((int32_t) p[0] << 16) | ((int32_t) p[1] << 8) | p[2];
+
+    if (cts & 0x800000) {
+        cts -= 0x1000000;
+    }
+
+    return cts;
+}
+
+
+/*
+ * Tag header is assumed to fit the first chunk; legacy AVC/HEVC tags
+ * and Enhanced RTMP ones differ in layout only
+ */
+
+ngx_int_t
+ngx_rtmp_codec_parse_video_tag(ngx_chain_t *in,
+    ngx_rtmp_codec_video_tag_t *tag)
+{
+    u_char  *p;
+    size_t   n;
+
+    p = in->buf->pos;
+    n = in->buf->last - p;
+
+    if (n < 5) {
+        return NGX_ERROR;
+    }
+
+    tag->frame_type = (p[0] & 0x70) >> 4;
+
+    if (!(p[0] & NGX_RTMP_VIDEO_EX_HEADER)) {
+
+        /* AVCPacketType, CompositionTime */
+
+        tag->packet_type = p[1];
+        tag->cts = ngx_rtmp_codec_get_cts(p + 2);
+        tag->size = 5;
+
+        return NGX_OK;
+    }
+
+    /* PacketType, FourCC */
+
+    tag->packet_type = p[0] & 0x0f;
+    tag->cts = 0;
+    tag->size = 5;
+
+    switch (tag->packet_type) {
+
+    case NGX_RTMP_VIDEO_PACKET_FRAME:
+
+        /* PacketTypeCodedFrames, CompositionTime */
+
+        if (n < 8) {
+            return NGX_ERROR;
+        }
+
+        tag->cts = ngx_rtmp_codec_get_cts(p + 5);
+        tag->size = 8;
+        break;
+
+    case 3:
+
+        /* PacketTypeCodedFramesX, zero composition time */
+
+        tag->packet_type = NGX_RTMP_VIDEO_PACKET_FRAME;
+        break;
+    }
+
+    return NGX_OK;
+}
+
+
+/* RFC 6381 codecs parameter of video track */
+
+u_char *
+ngx_rtmp_codec_video_codecs(u_char *p, u_char *last,
+    ngx_rtmp_codec_ctx_t *ctx)
+{
+    uint32_t     compat;
+    ngx_uint_t   i, n;
+
+    static char *profile_space[] = { "", "A", "B", "C" };
+
+    if (ctx->video_codec_id != NGX_RTMP_VIDEO_H265) {
+        return ngx_slprintf(p, last, "avc1.%02uxi%02uxi%02uxi",
+                            ctx->avc_profile, ctx->avc_compat,
+                            ctx->avc_level);
+    }
+
+    /* ISO/IEC 14496-15 E.3: compatibility flags in reverse bit order */
+
+    compat = 0;
+
+    for (i = 0; i < 32; i++) {
+        compat |= ((ctx->hevc_compat >> i) & 1) << (31 - i);
+    }
+
+    p = ngx_slprintf(p, last, "hvc1.%s%ui.%uxD.%c%ui",
+                     profile_space[ctx->hevc_profile_space & 0x03],
+                     ctx->hevc_profile, compat,
+                     ctx->hevc_tier ? 'H' : 'L', ctx->hevc_level);
+
+    /* constraint flags, trailing zero bytes omitted */
+
+    for (n = 6; n && ctx->hevc_constraints[n - 1] == 0; n--) {
+        /* void */
+    }
+
+    for (i = 0; i < n; i++) {
+        p = ngx_slprintf(p, last, ".%uXi",
+                         (ngx_uint_t) ctx->hevc_constraints[i]);
+    }
+
+    return p;
+}
+
+
 static ngx_uint_t
 ngx_rtmp_codec_get_next_version()
 {
@@ -411,17 +556,33 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         if (ctx->sample_rate == 0) {
             ctx->sample_rate = sample_rates[(fmt & 0x0c) >> 2];
         }
+    } else if (fmt & NGX_RTMP_VIDEO_EX_HEADER) {
+
+        /* Enhanced RTMP, codecs other than HEVC are relayed only */
+
+        if (in->buf->last - in->buf->pos >= 5
+            && ngx_rtmp_codec_get_fourcc(in->buf->pos + 1)
+               == NGX_RTMP_CODEC_FOURCC_HVC1)
+        {
+            ctx->video_codec_id = NGX_RTMP_VIDEO_H265;
+
+        } else {
+            ctx->video_codec_id = 0;
+        }
+
     } else {
         ctx->video_codec_id = (fmt & 0x0f);
     }
 
-    /* save AVC/AAC header */
+    /* save AVC/HEVC/AAC header */
     if (in->buf->last - in->buf->pos < 3) {                   
         return NGX_OK;
     }
 
     /* no conf */
-    if (!ngx_rtmp_is_codec_header(in)) {
+    if (h->type == NGX_RTMP_MSG_AUDIO ? !ngx_rtmp_is_codec_header(in)
+                                      : !ngx_rtmp_is_video_codec_header(in))
+    {
         return NGX_OK;
     }
 
@@ -440,6 +601,10 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         if (ctx->video_codec_id == NGX_RTMP_VIDEO_H264) {
             header = &ctx->avc_header;
             ngx_rtmp_codec_parse_avc_header(s, in);
+
+        } else if (ctx->video_codec_id == NGX_RTMP_VIDEO_H265) {
+            header = &ctx->avc_header;
+            ngx_rtmp_codec_parse_hevc_header(s, in);
         }
     }
 
@@ -744,6 +909,194 @@ ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
 }
 
 
+static void
+ngx_rtmp_codec_parse_hevc_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
+{
+    u_char                  sps[256], *p, *last, *dst;
+    size_t                  len;
+    ngx_uint_t              i, n, narrays, nnals, type, max_sub_layers,
+                            profile_present, level_present, cf_idc,
+                            width, height, sub_width, sub_height,
+                            conf_left, conf_right, conf_top, conf_bottom;
+    ngx_rtmp_codec_ctx_t   *ctx;
+    ngx_rtmp_bit_reader_t   br;
+
+#if (NGX_DEBUG)
+    ngx_rtmp_codec_dump_header(s, "hevc", in);
+#endif
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    ngx_rtmp_bit_init_reader(&br, in->buf->pos, in->buf->last);
+
+    /* tag header, configuration version */
+    ngx_rtmp_bit_read(&br, 48);
+
+    ctx->hevc_profile_space = (ngx_uint_t) ngx_rtmp_bit_read(&br, 2);
+    ctx->hevc_tier = (ngx_uint_t) ngx_rtmp_bit_read(&br, 1);
+    ctx->hevc_profile = (ngx_uint_t) ngx_rtmp_bit_read(&br, 5);
+    ctx->hevc_compat = ngx_rtmp_bit_read_32(&br);
+
+    for (i = 0; i < 6; i++) {
+        ctx->hevc_constraints[i] = ngx_rtmp_bit_read_8(&br);
+    }
+
+    ctx->hevc_level = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
+
+    /*
+     * min spatial segmentation, parallelism type, chroma format,
+     * bit depths, average frame rate
+     */
+    ngx_rtmp_bit_read(&br, 64);
+
+    /* nal bytes */
+    ctx->avc_nal_bytes = (ngx_uint_t) ((ngx_rtmp_bit_read_8(&br) & 0x03) + 1);
+
+    narrays = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
+
+    /* find first SPS */
+
+    p = NULL;
+    len = 0;
+
+    for (i = 0; i < narrays && p == NULL; i++) {
+        type = (ngx_uint_t) (ngx_rtmp_bit_read_8(&br) & 0x3f);
+        nnals = (ngx_uint_t) ngx_rtmp_bit_read_16(&br);
+
+        for (n = 0; n < nnals; n++) {
+            len = (size_t) ngx_rtmp_bit_read_16(&br);
+
+            if (ngx_rtmp_bit_read_err(&br)
+                || (size_t) (br.last - br.pos) < len)
+            {
+                return;
+            }
+
+            if (type == 33) {
+                p = br.pos;
+                break;
+            }
+
+            br.pos += len;
+        }
+    }
+
+    if (p == NULL) {
+        return;
+    }
+
+    /* SPS, emulation prevention bytes removed */
+
+    last = p + len;
+    dst = sps;
+
+    for (n = 0; p < last && dst < sps + sizeof(sps); p++) {
+
+        if (n == 2 && *p == 0x03) {
+            n = 0;
+            continue;
+        }
+
+        n = (*p == 0 ? n + 1 : 0);
+        *dst++ = *p;
+    }
+
+    ngx_rtmp_bit_init_reader(&br, sps, dst);
+
+    /* NAL header */
+    ngx_rtmp_bit_read(&br, 16);
+
+    /* VPS id */
+    ngx_rtmp_bit_read(&br, 4);
+
+    /* max sub layers - 1 */
+    max_sub_layers = (ngx_uint_t) ngx_rtmp_bit_read(&br, 3);
+
+    /* temporal id nesting */
+    ngx_rtmp_bit_read(&br, 1);
+
+    /* profile tier level: general profile and level */
+    ngx_rtmp_bit_read(&br, 64);
+    ngx_rtmp_bit_read(&br, 32);
+
+    profile_present = 0;
+    level_present = 0;
+
+    for (i = 0; i < max_sub_layers; i++) {
+        profile_present |= (ngx_uint_t) ngx_rtmp_bit_read(&br, 1) << i;
+        level_present |= (ngx_uint_t) ngx_rtmp_bit_read(&br, 1) << i;
+    }
+
+    if (max_sub_layers) {
+        for (i = max_sub_layers; i < 8; i++) {
+            ngx_rtmp_bit_read(&br, 2);
+        }
+    }
+
+    for (i = 0; i < max_sub_layers; i++) {
+
+        if (profile_present & (1 << i)) {
+            ngx_rtmp_bit_read(&br, 64);
+            ngx_rtmp_bit_read(&br, 24);
+        }
+
+        if (level_present & (1 << i)) {
+            ngx_rtmp_bit_read(&br, 8);
+        }
+    }
+
+    /* SPS id */
+    ngx_rtmp_bit_read_golomb(&br);
+
+    /* chroma format idc */
+    cf_idc = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    if (cf_idc == 3) {
+
+        /* separate colour plane */
+        ngx_rtmp_bit_read(&br, 1);
+    }
+
+    /* pic width & height in luma samples */
+    width = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+    height = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    /* conformance window */
+    if (ngx_rtmp_bit_read(&br, 1)) {
+
+        conf_left = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        conf_right = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        conf_top = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        conf_bottom = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    } else {
+
+        conf_left = 0;
+        conf_right = 0;
+        conf_top = 0;
+        conf_bottom = 0;
+    }
+
+    if (ngx_rtmp_bit_read_err(&br)) {
+        return;
+    }
+
+    sub_width = (cf_idc == 1 || cf_idc == 2) ? 2 : 1;
+    sub_height = (cf_idc == 1) ? 2 : 1;
+
+    ctx->width = width - (conf_left + conf_right) * sub_width;
+    ctx->height = height - (conf_top + conf_bottom) * sub_height;
+
+    ngx_log_debug7(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "codec: hevc header "
+                   "profile=%ui, tier=%ui, level=%ui, compat=%uxD, "
+                   "nal_bytes=%ui, width=%ui, height=%ui",
+                   ctx->hevc_profile, ctx->hevc_tier, ctx->hevc_level,
+                   ctx->hevc_compat, ctx->avc_nal_bytes,
+                   ctx->width, ctx->height);
+}
+
+
 #if (NGX_DEBUG)
 static void
 ngx_rtmp_codec_dump_header(ngx_rtmp_session_t *s, const char *type,
@@ -1074,6 +1427,12 @@ ngx_rtmp_codec_meta_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ctx->frame_rate = (ngx_uint_t) v.frame_rate;
     ctx->video_data_rate = v.video_data_rate;
     ctx->video_codec_id = (ngx_uint_t) v.video_codec_id_n;
+
+    if (ctx->video_codec_id == NGX_RTMP_CODEC_FOURCC_HVC1
+        || ngx_strncmp(v.video_codec_id_s, "hvc1", sizeof("hvc1")) == 0)
+    {
+        ctx->video_codec_id = NGX_RTMP_VIDEO_H265;
+    }
     ctx->audio_data_rate = v.audio_data_rate;
     ctx->audio_codec_id = (v.audio_codec_id_n == -1
             ? 0 : v.audio_codec_id_n == 0
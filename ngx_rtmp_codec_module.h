@@ -41,14 +41,32 @@ enum {
     NGX_RTMP_VIDEO_ON2_VP6          = 4,
     NGX_RTMP_VIDEO_ON2_VP6_ALPHA    = 5,
     NGX_RTMP_VIDEO_SCREEN2          = 6,
-    NGX_RTMP_VIDEO_H264             = 7
+    NGX_RTMP_VIDEO_H264             = 7,
+    /* legacy FLV id, also used for Enhanced RTMP 'hvc1' */
+    NGX_RTMP_VIDEO_H265             = 12
 };
 
 
+/* Video packet types: AVCPacketType and Enhanced RTMP alike */
+#define NGX_RTMP_VIDEO_PACKET_HEADER    0
+#define NGX_RTMP_VIDEO_PACKET_FRAME     1
+#define NGX_RTMP_VIDEO_PACKET_END       2
+
+
+typedef struct {
+    ngx_uint_t                  frame_type;
+    ngx_uint_t                  packet_type;
+    int32_t                     cts;            /* composition offset, ms */
+    size_t                      size;           /* tag header before NALs */
+} ngx_rtmp_codec_video_tag_t;
+
+
 u_char * ngx_rtmp_get_audio_codec_name(ngx_uint_t id);
 u_char * ngx_rtmp_get_video_codec_name(ngx_uint_t id);
 ngx_int_t ngx_rtmp_codec_parse_mp3_frame_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
+ngx_int_t ngx_rtmp_codec_parse_video_tag(ngx_chain_t *in,
+       ngx_rtmp_codec_video_tag_t *tag);
 
 typedef struct {
     ngx_uint_t                  width;
@@ -66,15 +84,21 @@ typedef struct {
     ngx_uint_t                  avc_profile;
     ngx_uint_t                  avc_compat;
     ngx_uint_t                  avc_level;
-    ngx_uint_t                  avc_nal_bytes;
+    ngx_uint_t                  avc_nal_bytes;  /* AVC and HEVC */
     ngx_uint_t                  avc_ref_frames;
+    ngx_uint_t                  hevc_profile_space;
+    ngx_uint_t                  hevc_tier;
+    ngx_uint_t                  hevc_profile;
+    uint32_t                    hevc_compat;
+    u_char                      hevc_constraints[6];
+    ngx_uint_t                  hevc_level;
     ngx_uint_t                  sample_rate;    /* 5512, 11025, 22050, 44100 */
     ngx_uint_t                  sample_size;    /* 1=8bit, 2=16bit */
     ngx_uint_t                  audio_channels; /* 1, 2 */
     u_char                      profile[32];
     u_char                      level[32];
 
-    ngx_chain_t                *avc_header;
+    ngx_chain_t                *avc_header;     /* AVC or HEVC */
     ngx_chain_t                *aac_header;
 	
     ngx_chain_t                *received_meta;
@@ -83,6 +107,10 @@ typedef struct {
 } ngx_rtmp_codec_ctx_t;
 
 
+u_char *ngx_rtmp_codec_video_codecs(u_char *p, u_char *last,
+    ngx_rtmp_codec_ctx_t *ctx);
+
+
 extern ngx_module_t  ngx_rtmp_codec_module;
 
 
@@ -12,6 +12,7 @@
 
 
 static void *ngx_rtmp_core_create_main_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_core_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -24,6 +25,10 @@ static char *ngx_rtmp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_rtmp_core_application(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_rtmp_core_session_out_rate(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_rtmp_core_out_rate(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 ngx_rtmp_core_main_conf_t      *ngx_rtmp_core_main_conf;
@@ -107,6 +112,20 @@ static ngx_command_t  ngx_rtmp_core_commands[] = {
       offsetof(ngx_rtmp_core_srv_conf_t, chunk_size),
       NULL },
 
+    { ngx_string("chunk_size_auto"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, chunk_size_auto),
+      NULL },
+
+    { ngx_string("chunk_size_max"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, chunk_size_max),
+      NULL },
+
     { ngx_string("max_message"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -114,6 +133,13 @@ static ngx_command_t  ngx_rtmp_core_commands[] = {
       offsetof(ngx_rtmp_core_srv_conf_t, max_message),
       NULL },
 
+    { ngx_string("in_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, in_buffer),
+      NULL },
+
     { ngx_string("out_queue"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -157,6 +183,27 @@ static ngx_command_t  ngx_rtmp_core_commands[] = {
       offsetof(ngx_rtmp_core_srv_conf_t, buflen),
       NULL },
 
+    { ngx_string("session_out_rate"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_core_session_out_rate,
+      NGX_RTMP_APP_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("app_out_rate"),
+      NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_core_out_rate,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_app_conf_t, out_bucket),
+      NULL },
+
+    { ngx_string("total_out_rate"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_core_out_rate,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_main_conf_t, out_bucket),
+      NULL },
+
       ngx_null_command
 };
 
@@ -165,7 +212,7 @@ static ngx_rtmp_module_t  ngx_rtmp_core_module_ctx = {
     NULL,                                   /* preconfiguration */
     NULL,                                   /* postconfiguration */
     ngx_rtmp_core_create_main_conf,         /* create main configuration */
-    NULL,                                   /* init main configuration */
+    ngx_rtmp_core_init_main_conf,           /* init main configuration */
     ngx_rtmp_core_create_srv_conf,          /* create server configuration */
     ngx_rtmp_core_merge_srv_conf,           /* merge server configuration */
     ngx_rtmp_core_create_app_conf,          /* create app configuration */
@@ -214,10 +261,91 @@ ngx_rtmp_core_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    if (ngx_array_init(&cmcf->buckets, cf->pool, 1,
+                       sizeof(ngx_rtmp_bucket_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
     return cmcf;
 }
 
 
+static ngx_int_t
+ngx_rtmp_core_init_buckets_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_rtmp_core_main_conf_t  *ocmcf = data;
+
+    ngx_uint_t                  n;
+    ngx_slab_pool_t            *shpool;
+    ngx_rtmp_bucket_t         **b;
+    ngx_rtmp_bucket_shm_t      *sh;
+    ngx_rtmp_core_main_conf_t  *cmcf;
+
+    cmcf = shm_zone->data;
+    b = cmcf->buckets.elts;
+
+    if (ocmcf && ocmcf->buckets.nelts == cmcf->buckets.nelts) {
+        sh = ocmcf->buckets_shm;
+
+    } else {
+        shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+        sh = ngx_slab_alloc(shpool, sizeof(ngx_rtmp_bucket_shm_t)
+                                    * cmcf->buckets.nelts);
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (n = 0; n < cmcf->buckets.nelts; n++) {
+            sh[n].lock = 0;
+            sh[n].tokens = b[n]->burst;
+            sh[n].last = ngx_current_msec;
+            sh[n].throttled = 0;
+        }
+    }
+
+    cmcf->buckets_shm = sh;
+
+    /* worker buckets only cache tokens taken from shared ones */
+
+    for (n = 0; n < cmcf->buckets.nelts; n++) {
+        b[n]->shared = &sh[n];
+        b[n]->tokens = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_rtmp_core_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_core_main_conf_t  *cmcf = conf;
+
+    ngx_shm_zone_t             *shm_zone;
+    static ngx_str_t            shm_name = ngx_string("rtmp_bandwidth");
+
+    if (cmcf->buckets.nelts == 0) {
+        return NGX_CONF_OK;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &shm_name,
+                                     ngx_pagesize * 8 + cmcf->buckets.nelts
+                                     * sizeof(ngx_rtmp_bucket_shm_t),
+                                     &ngx_rtmp_core_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_rtmp_core_init_buckets_zone;
+    shm_zone->data = cmcf;
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf)
 {
@@ -241,8 +369,11 @@ ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf)
     conf->so_keepalive = NGX_CONF_UNSET;
     conf->max_streams = NGX_CONF_UNSET;
     conf->chunk_size = NGX_CONF_UNSET;
+    conf->chunk_size_auto = NGX_CONF_UNSET;
+    conf->chunk_size_max = NGX_CONF_UNSET_SIZE;
     conf->ack_window = NGX_CONF_UNSET_UINT;
     conf->max_message = NGX_CONF_UNSET_SIZE;
+    conf->in_buffer = NGX_CONF_UNSET_SIZE;
     conf->out_queue = NGX_CONF_UNSET_SIZE;
     conf->out_cork = NGX_CONF_UNSET_SIZE;
     conf->play_time_fix = NGX_CONF_UNSET;
@@ -267,9 +398,13 @@ ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->so_keepalive, prev->so_keepalive, 0);
     ngx_conf_merge_value(conf->max_streams, prev->max_streams, 32);
     ngx_conf_merge_value(conf->chunk_size, prev->chunk_size, 4096);
+    ngx_conf_merge_value(conf->chunk_size_auto, prev->chunk_size_auto, 0);
+    ngx_conf_merge_size_value(conf->chunk_size_max, prev->chunk_size_max,
+            65536);
     ngx_conf_merge_uint_value(conf->ack_window, prev->ack_window, 5000000);
     ngx_conf_merge_size_value(conf->max_message, prev->max_message,
             1 * 1024 * 1024);
+    ngx_conf_merge_size_value(conf->in_buffer, prev->in_buffer, 0);
     ngx_conf_merge_size_value(conf->out_queue, prev->out_queue, 256);
     ngx_conf_merge_size_value(conf->out_cork, prev->out_cork,
             conf->out_queue / 8);
@@ -308,6 +443,9 @@ ngx_rtmp_core_create_app_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    conf->session_rate = NGX_CONF_UNSET_SIZE;
+    conf->session_burst = NGX_CONF_UNSET_SIZE;
+
     return conf;
 }
 
@@ -318,8 +456,105 @@ ngx_rtmp_core_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_rtmp_core_app_conf_t *prev = parent;
     ngx_rtmp_core_app_conf_t *conf = child;
 
-    (void)prev;
-    (void)conf;
+    ngx_conf_merge_size_value(conf->session_rate, prev->session_rate, 0);
+    ngx_conf_merge_size_value(conf->session_burst, prev->session_burst,
+                              conf->session_rate);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_rtmp_core_parse_rate(ngx_conf_t *cf, size_t *rate, size_t *burst)
+{
+    ngx_str_t  *value, s;
+
+    value = cf->args->elts;
+
+    *rate = ngx_parse_size(&value[1]);
+    if (*rate == (size_t) NGX_ERROR || *rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    *burst = *rate;
+
+    if (cf->args->nelts == 3) {
+        if (value[2].len <= 6
+            || ngx_strncmp(value[2].data, "burst=", 6) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 6;
+        s.len = value[2].len - 6;
+
+        *burst = ngx_parse_size(&s);
+        if (*burst == (size_t) NGX_ERROR || *burst == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid burst \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_rtmp_core_session_out_rate(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_rtmp_core_app_conf_t  *cacf = conf;
+
+    if (cacf->session_rate != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    return ngx_rtmp_core_parse_rate(cf, &cacf->session_rate,
+                                    &cacf->session_burst);
+}
+
+
+static char *
+ngx_rtmp_core_out_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    size_t                      rate, burst;
+    ngx_rtmp_bucket_t         **bp, **pb;
+    ngx_rtmp_core_main_conf_t  *cmcf;
+
+    bp = (ngx_rtmp_bucket_t **) (p + cmd->offset);
+
+    if (*bp) {
+        return "is duplicate";
+    }
+
+    if (ngx_rtmp_core_parse_rate(cf, &rate, &burst) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    *bp = ngx_palloc(cf->pool, sizeof(ngx_rtmp_bucket_t));
+    if (*bp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_rtmp_bucket_init(*bp, rate, burst, &cf->cycle->new_log);
+
+    /* all workers draw from the same bucket in shared memory */
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+    pb = ngx_array_push(&cmcf->buckets);
+    if (pb == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *pb = *bp;
 
     return NGX_CONF_OK;
 }
@@ -737,6 +972,11 @@ ngx_rtmp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "ssl") == 0) {
+            ls->ssl = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "the invalid \"%V\" parameter", &value[i]);
         return NGX_CONF_ERROR;
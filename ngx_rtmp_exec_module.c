@@ -8,6 +8,7 @@
 #include <ngx_core.h>
 #include "ngx_rtmp_cmd_module.h"
 #include "ngx_rtmp_record_module.h"
+#include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_eval.h"
 #include <stdlib.h>
 
@@ -45,6 +46,7 @@ static char *ngx_rtmp_exec_kill_signal(ngx_conf_t *cf, ngx_command_t *cmd,
 
 #define NGX_RTMP_EXEC_PUBLISHING        0x01
 #define NGX_RTMP_EXEC_PLAYING           0x02
+#define NGX_RTMP_EXEC_PIPED             0x04
 
 
 enum {
@@ -56,6 +58,7 @@ enum {
     NGX_RTMP_EXEC_PLAY,
     NGX_RTMP_EXEC_PLAY_DONE,
     NGX_RTMP_EXEC_RECORD_DONE,
+    NGX_RTMP_EXEC_PIPE,
 
     NGX_RTMP_EXEC_MAX,
 
@@ -63,15 +66,39 @@ enum {
 };
 
 
+typedef struct ngx_rtmp_exec_pool_s  ngx_rtmp_exec_pool_t;
+
+
 typedef struct {
     ngx_str_t                           id;
     ngx_uint_t                          type;
     ngx_str_t                           cmd;
     ngx_array_t                         args;       /* ngx_str_t */
     ngx_array_t                         names;
+    ngx_str_t                           output;     /* exec_pipe stdout */
+    ngx_rtmp_exec_pool_t               *pool;       /* exec_pipe warm pool */
 } ngx_rtmp_exec_conf_t;
 
 
+/* exec_pipe: FLV to child stdin and optionally back from its stdout */
+typedef struct {
+    ngx_rtmp_session_t                 *session;
+    ngx_connection_t                    in_conn;
+    ngx_event_t                         in_rev, in_wev;
+    ngx_buf_t                           in;
+    uint32_t                            epoch;
+    ngx_uint_t                          ndropped;
+    ngx_connection_t                    out_conn;
+    ngx_event_t                         out_rev, out_wev;
+    ngx_buf_t                           out;
+    ngx_rtmp_session_t                 *publish;
+    unsigned                            started:1;
+    unsigned                            wait_key:1;
+    unsigned                            out_header:1;
+    unsigned                            out_failed:1;
+} ngx_rtmp_exec_pipe_t;
+
+
 typedef struct {
     ngx_rtmp_exec_conf_t               *conf;
     ngx_log_t                          *log;
@@ -79,6 +106,7 @@ typedef struct {
     void                               *eval_ctx;
     unsigned                            active:1;
     unsigned                            managed:1;
+    unsigned                            pooled:1;
     ngx_pid_t                           pid;
     ngx_pid_t                          *save_pid;
     int                                 pipefd;
@@ -87,12 +115,24 @@ typedef struct {
     ngx_event_t                         respawn_evt;
     ngx_msec_t                          respawn_timeout;
     ngx_int_t                           kill_signal;
+    ngx_rtmp_exec_pipe_t               *pipe;
 } ngx_rtmp_exec_t;
 
 
+/* pre-spawned exec_pipe children waiting for a publisher, per worker */
+struct ngx_rtmp_exec_pool_s {
+    ngx_rtmp_exec_conf_t                conf;
+    ngx_uint_t                          size;
+    size_t                              buffer;
+    ngx_flag_t                          respawn;
+    ngx_rtmp_exec_t                    *exec;
+};
+
+
 typedef struct {
     ngx_array_t                         static_conf; /* ngx_rtmp_exec_conf_t */
     ngx_array_t                         static_exec; /* ngx_rtmp_exec_t */
+    ngx_array_t                         pools;  /* ngx_rtmp_exec_pool_t * */
     ngx_msec_t                          respawn_timeout;
     ngx_int_t                           kill_signal;
     ngx_log_t                          *log;
@@ -117,6 +157,7 @@ typedef struct {
                                                      /* ngx_rtmp_exec_conf_t */
     ngx_flag_t                          respawn;
     ngx_flag_t                          options;
+    size_t                              pipe_buffer;
     ngx_uint_t                          nbuckets;
     ngx_rtmp_exec_pull_ctx_t          **pull;
 } ngx_rtmp_exec_app_conf_t;
@@ -132,6 +173,8 @@ typedef struct {
     u_char                              name[NGX_RTMP_MAX_NAME];
     u_char                              args[NGX_RTMP_MAX_ARGS];
     ngx_array_t                         push_exec;   /* ngx_rtmp_exec_t */
+    ngx_array_t                         pipe_exec;   /* ngx_rtmp_exec_t * */
+    ngx_rtmp_exec_pipe_t               *pipe;        /* piped output */
     ngx_rtmp_exec_pull_ctx_t           *pull;
 } ngx_rtmp_exec_ctx_t;
 
@@ -140,6 +183,9 @@ typedef struct {
 static void ngx_rtmp_exec_respawn(ngx_event_t *ev);
 static ngx_int_t ngx_rtmp_exec_kill(ngx_rtmp_exec_t *e, ngx_int_t kill_signal);
 static ngx_int_t ngx_rtmp_exec_run(ngx_rtmp_exec_t *e);
+static void ngx_rtmp_exec_abort(ngx_rtmp_exec_t *e, ngx_int_t kill_signal);
+static ngx_int_t ngx_rtmp_exec_pipe_create(ngx_pool_t *pool, ngx_rtmp_exec_t *e,
+    size_t size);
 #endif
 
 
@@ -217,6 +263,21 @@ static ngx_command_t  ngx_rtmp_exec_commands[] = {
       NGX_RTMP_EXEC_RECORD_DONE * sizeof(ngx_array_t),
       NULL },
 
+    { ngx_string("exec_pipe"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_1MORE,
+      ngx_rtmp_exec_conf,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_exec_app_conf_t, conf) +
+      NGX_RTMP_EXEC_PIPE * sizeof(ngx_array_t),
+      NULL },
+
+    { ngx_string("exec_pipe_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_exec_app_conf_t, pipe_buffer),
+      NULL },
+
     { ngx_string("exec_static"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_1MORE,
       ngx_rtmp_exec_conf,
@@ -490,6 +551,7 @@ ngx_rtmp_exec_create_app_conf(ngx_conf_t *cf)
 
     eacf->respawn = NGX_CONF_UNSET;
     eacf->options = NGX_CONF_UNSET;
+    eacf->pipe_buffer = NGX_CONF_UNSET_SIZE;
     eacf->nbuckets = NGX_CONF_UNSET_UINT;
 
     return eacf;
@@ -531,9 +593,12 @@ ngx_rtmp_exec_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_rtmp_exec_app_conf_t   *prev = parent;
     ngx_rtmp_exec_app_conf_t   *conf = child;
 
-    ngx_uint_t  n;
+    ngx_uint_t             n;
+    ngx_rtmp_exec_conf_t  *ec;
 
     ngx_conf_merge_value(conf->respawn, prev->respawn, 1);
+    ngx_conf_merge_size_value(conf->pipe_buffer, prev->pipe_buffer,
+                              1024 * 1024);
     ngx_conf_merge_uint_value(conf->nbuckets, prev->nbuckets, 1024);
 
     for (n = 0; n < NGX_RTMP_EXEC_MAX; n++) {
@@ -548,6 +613,21 @@ ngx_rtmp_exec_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         }
     }
 
+    ec = conf->conf[NGX_RTMP_EXEC_PIPE].elts;
+    for (n = 0; n < conf->conf[NGX_RTMP_EXEC_PIPE].nelts; n++, ec++) {
+        if (ec->pool == NULL) {
+            continue;
+        }
+
+        if (ec->pool->buffer < conf->pipe_buffer) {
+            ec->pool->buffer = conf->pipe_buffer;
+        }
+
+        /* application using the pool merges last */
+
+        ec->pool->respawn = conf->respawn;
+    }
+
     if (conf->conf[NGX_RTMP_EXEC_PULL].nelts > 0) {
         conf->pull = ngx_pcalloc(cf->pool, sizeof(void *) * conf->nbuckets);
         if (conf->pull == NULL) {
@@ -567,22 +647,56 @@ ngx_rtmp_exec_init_process(ngx_cycle_t *cycle)
     ngx_rtmp_core_srv_conf_t  **cscf;
     ngx_rtmp_conf_ctx_t        *cctx;
     ngx_rtmp_exec_main_conf_t  *emcf;
+    ngx_rtmp_exec_pool_t      **pool;
     ngx_rtmp_exec_t            *e;
-    ngx_uint_t                  n;
+    ngx_uint_t                  n, k;
 
     if (cmcf == NULL || cmcf->servers.nelts == 0) {
         return NGX_OK;
     }
 
+    cscf = cmcf->servers.elts;
+    cctx = (*cscf)->ctx;
+    emcf = cctx->main_conf[ngx_rtmp_exec_module.ctx_index];
+
+    /* pipe pools serve local publishers and are started by each worker */
+
+    pool = emcf->pools.elts;
+    for (n = 0; n < emcf->pools.nelts; n++) {
+        e = ngx_pcalloc(cycle->pool, sizeof(ngx_rtmp_exec_t) * pool[n]->size);
+        if (e == NULL) {
+            return NGX_ERROR;
+        }
+
+        pool[n]->exec = e;
+
+        for (k = 0; k < pool[n]->size; k++, e++) {
+            e->conf = &pool[n]->conf;
+            e->managed = 1;
+            e->pooled = 1;
+            e->log = emcf->log;
+            e->respawn_timeout = (pool[n]->respawn ? emcf->respawn_timeout :
+                                  NGX_CONF_UNSET_MSEC);
+            e->kill_signal = emcf->kill_signal;
+
+            if (ngx_rtmp_exec_pipe_create(cycle->pool, e, pool[n]->buffer)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            e->respawn_evt.data = e;
+            e->respawn_evt.log = e->log;
+            e->respawn_evt.handler = ngx_rtmp_exec_respawn;
+            ngx_post_event((&e->respawn_evt), &ngx_rtmp_init_queue);
+        }
+    }
+
     /* execs are always started by the first worker */
     if (ngx_process_slot) {
         return NGX_OK;
     }
 
-    cscf = cmcf->servers.elts;
-    cctx = (*cscf)->ctx;
-    emcf = cctx->main_conf[ngx_rtmp_exec_module.ctx_index];
-
     /* FreeBSD note:
      * When worker is restarted, child process (ffmpeg) will
      * not be terminated if it's connected to another
@@ -615,6 +729,574 @@ ngx_rtmp_exec_respawn(ngx_event_t *ev)
 }
 
 
+static void
+ngx_rtmp_exec_pipe_close(ngx_rtmp_exec_t *e)
+{
+    ngx_rtmp_exec_pipe_t  *p;
+    ngx_rtmp_exec_ctx_t   *ctx;
+
+    p = e->pipe;
+
+    if (p->in_conn.fd != -1) {
+        if (p->in_wev.active) {
+            ngx_del_event(&p->in_wev, NGX_WRITE_EVENT, 0);
+        }
+
+        if (p->in_wev.posted) {
+            ngx_delete_posted_event(&p->in_wev);
+        }
+
+        close(p->in_conn.fd);
+        p->in_conn.fd = -1;
+    }
+
+    if (p->out_conn.fd != -1) {
+        if (p->out_rev.active) {
+            ngx_del_event(&p->out_rev, NGX_READ_EVENT, 0);
+        }
+
+        if (p->out_rev.posted) {
+            ngx_delete_posted_event(&p->out_rev);
+        }
+
+        close(p->out_conn.fd);
+        p->out_conn.fd = -1;
+    }
+
+    if (p->publish) {
+        ctx = ngx_rtmp_get_module_ctx(p->publish, ngx_rtmp_exec_module);
+        if (ctx) {
+            ctx->pipe = NULL;
+        }
+
+        ngx_rtmp_finalize_session(p->publish);
+        p->publish = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_exec_pipe_flush(ngx_rtmp_exec_t *e)
+{
+    ssize_t                n;
+    ngx_err_t              err;
+    ngx_buf_t             *b;
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = e->pipe;
+    b = &p->in;
+
+    while (b->pos != b->last) {
+        n = write(p->in_conn.fd, b->pos, b->last - b->pos);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_EAGAIN) {
+                p->in_wev.ready = 0;
+
+                if (ngx_handle_write_event(&p->in_wev, 0) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                return NGX_AGAIN;
+            }
+
+            ngx_log_error(NGX_LOG_INFO, e->log, err,
+                          "exec: pipe write failed pid=%i", (ngx_int_t) e->pid);
+            return NGX_ERROR;
+        }
+
+        b->pos += n;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_exec_pipe_write_handler(ngx_event_t *ev)
+{
+    ngx_connection_t  *c = ev->data;
+    ngx_rtmp_exec_t   *e;
+
+    e = c->data;
+
+    if (ngx_rtmp_exec_pipe_flush(e) == NGX_ERROR) {
+        ngx_rtmp_exec_abort(e, e->kill_signal);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_exec_pipe_tag(ngx_rtmp_exec_t *e, ngx_uint_t type,
+    uint32_t timestamp, ngx_chain_t *in)
+{
+    size_t                 size, mlen;
+    ngx_buf_t             *b;
+    ngx_chain_t           *cl;
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = e->pipe;
+    b = &p->in;
+
+    mlen = 0;
+    for (cl = in; cl; cl = cl->next) {
+        mlen += cl->buf->last - cl->buf->pos;
+    }
+
+    size = 11 + mlen + 4;
+
+    if ((size_t) (b->end - b->last) < size && b->pos != b->start) {
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    if ((size_t) (b->end - b->last) < size) {
+        return NGX_AGAIN;
+    }
+
+    *b->last++ = (u_char) type;
+
+    *b->last++ = (u_char) (mlen >> 16);
+    *b->last++ = (u_char) (mlen >> 8);
+    *b->last++ = (u_char) mlen;
+
+    *b->last++ = (u_char) (timestamp >> 16);
+    *b->last++ = (u_char) (timestamp >> 8);
+    *b->last++ = (u_char) timestamp;
+    *b->last++ = (u_char) (timestamp >> 24);
+
+    *b->last++ = 0;
+    *b->last++ = 0;
+    *b->last++ = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        b->last = ngx_cpymem(b->last, cl->buf->pos,
+                             cl->buf->last - cl->buf->pos);
+    }
+
+    size -= 4;
+
+    *b->last++ = (u_char) (size >> 24);
+    *b->last++ = (u_char) (size >> 16);
+    *b->last++ = (u_char) (size >> 8);
+    *b->last++ = (u_char) size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_exec_pipe_av(ngx_rtmp_exec_t *e, ngx_rtmp_header_t *h,
+    ngx_chain_t *in, ngx_uint_t key, ngx_uint_t header)
+{
+    ngx_buf_t             *b;
+    ngx_rtmp_exec_pipe_t  *p;
+    ngx_rtmp_codec_ctx_t  *codec_ctx;
+
+    static u_char          flv_header[] = {
+        'F', 'L', 'V', 0x01,
+        0x05,                     /* audio and video */
+        0x00, 0x00, 0x00, 0x09,   /* header size */
+        0x00, 0x00, 0x00, 0x00    /* previous tag size */
+    };
+
+    p = e->pipe;
+    b = &p->in;
+
+    codec_ctx = ngx_rtmp_get_module_ctx(p->session, ngx_rtmp_codec_module);
+
+    if (p->wait_key && !header) {
+
+        /* audio-only stream has no key frames to wait for */
+
+        if (!key && (h->type == NGX_RTMP_MSG_VIDEO ||
+                     codec_ctx == NULL || codec_ctx->video_codec_id))
+        {
+            p->ndropped++;
+            return;
+        }
+
+        p->wait_key = 0;
+    }
+
+    if (!p->started) {
+        p->started = 1;
+        p->epoch = h->timestamp;
+
+        b->last = ngx_cpymem(b->last, flv_header, sizeof(flv_header));
+
+        /* child may be (re)started in the middle of the stream */
+
+        if (codec_ctx && codec_ctx->aac_header) {
+            ngx_rtmp_exec_pipe_tag(e, NGX_RTMP_MSG_AUDIO, 0,
+                                   codec_ctx->aac_header);
+        }
+
+        if (codec_ctx && codec_ctx->avc_header) {
+            ngx_rtmp_exec_pipe_tag(e, NGX_RTMP_MSG_VIDEO, 0,
+                                   codec_ctx->avc_header);
+        }
+    }
+
+    if (ngx_rtmp_exec_pipe_tag(e, h->type, h->timestamp - p->epoch, in)
+        != NGX_OK)
+    {
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, e->log, 0,
+                       "exec: pipe overflow pid=%i dropped=%ui",
+                       (ngx_int_t) e->pid, p->ndropped);
+
+        p->ndropped++;
+        p->wait_key = 1;
+    }
+
+    if (p->in_wev.ready && ngx_rtmp_exec_pipe_flush(e) == NGX_ERROR) {
+        ngx_rtmp_exec_abort(e, e->kill_signal);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_exec_pipe_publish(ngx_rtmp_exec_t *e)
+{
+    ngx_str_t              name;
+    ngx_rtmp_session_t    *s, *ps;
+    ngx_rtmp_conf_ctx_t    cctx;
+    ngx_rtmp_publish_t     v;
+    ngx_rtmp_exec_ctx_t   *ctx;
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = e->pipe;
+    s = p->session;
+
+    cctx.main_conf = s->main_conf;
+    cctx.srv_conf = s->srv_conf;
+    cctx.app_conf = s->app_conf;
+
+    ps = ngx_rtmp_init_virtual_session(&cctx, &e->conf->cmd, e->log);
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx = ngx_pcalloc(ps->connection->pool, sizeof(ngx_rtmp_exec_ctx_t));
+    if (ctx == NULL) {
+        goto failed;
+    }
+
+    /* no execs for piped output, that would chain children endlessly */
+
+    ctx->flags = NGX_RTMP_EXEC_PIPED;
+    ctx->pipe = p;
+    ngx_rtmp_set_ctx(ps, ctx, ngx_rtmp_exec_module);
+
+    ps->app.len = s->app.len;
+    ps->app.data = ngx_pstrdup(ps->connection->pool, &s->app);
+    if (ps->app.data == NULL) {
+        goto failed;
+    }
+
+    ngx_str_set(&ps->flashver, "ngx-exec-pipe");
+
+    ngx_memzero(&v, sizeof(v));
+
+    if (ngx_rtmp_eval(s, &e->conf->output, ngx_rtmp_exec_push_eval, &name,
+                      e->log)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    ngx_cpystrn(v.name, name.data, ngx_min(name.len + 1, NGX_RTMP_MAX_NAME));
+    ngx_free(name.data);
+
+    ngx_cpystrn(v.type, (u_char *) "live", NGX_RTMP_MAX_NAME);
+
+    ngx_log_error(NGX_LOG_INFO, e->log, 0,
+                  "exec: pipe output pid=%i name='%s'",
+                  (ngx_int_t) e->pid, v.name);
+
+    p->publish = ps;
+
+    if (ngx_rtmp_publish(ps, &v) != NGX_OK) {
+        p->publish = NULL;
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ctx = ngx_rtmp_get_module_ctx(ps, ngx_rtmp_exec_module);
+    if (ctx) {
+        ctx->pipe = NULL;
+    }
+
+    ngx_rtmp_finalize_session(ps);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_rtmp_exec_pipe_parse(ngx_rtmp_exec_t *e)
+{
+    u_char                *pos;
+    size_t                 size;
+    ngx_buf_t             *b, buf;
+    ngx_chain_t            cl;
+    ngx_rtmp_header_t      h;
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = e->pipe;
+    b = &p->out;
+
+    if (!p->out_header) {
+        if (b->last - b->pos < 13) {
+            return NGX_OK;
+        }
+
+        pos = b->pos;
+
+        if (pos[0] != 'F' || pos[1] != 'L' || pos[2] != 'V') {
+            ngx_log_error(NGX_LOG_ERR, e->log, 0,
+                          "exec: pipe output is not FLV pid=%i",
+                          (ngx_int_t) e->pid);
+            return NGX_ERROR;
+        }
+
+        /* skip header with the first previous tag size */
+
+        size = ((size_t) pos[5] << 24) | ((size_t) pos[6] << 16)
+               | ((size_t) pos[7] << 8) | pos[8];
+
+        if (size < 9 || size + 4 > (size_t) (b->end - b->start)) {
+            ngx_log_error(NGX_LOG_ERR, e->log, 0,
+                          "exec: bad FLV header size=%uz", size);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (b->last - b->pos) < size + 4) {
+            return NGX_OK;
+        }
+
+        b->pos += size + 4;
+        p->out_header = 1;
+    }
+
+    while (b->last - b->pos >= 11) {
+        pos = b->pos;
+
+        size = ((size_t) pos[1] << 16) | ((size_t) pos[2] << 8) | pos[3];
+
+        if (11 + size + 4 > (size_t) (b->end - b->start)) {
+            ngx_log_error(NGX_LOG_ERR, e->log, 0,
+                          "exec: pipe tag too big size=%uz", size);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (b->last - b->pos) < 11 + size + 4) {
+            break;
+        }
+
+        b->pos += 11 + size + 4;
+
+        if (size == 0 || (pos[0] != NGX_RTMP_MSG_AUDIO &&
+                          pos[0] != NGX_RTMP_MSG_VIDEO &&
+                          pos[0] != NGX_RTMP_MSG_AMF_META))
+        {
+            continue;
+        }
+
+        if (p->publish == NULL) {
+
+            /* idle pooled child has no source session */
+
+            if (p->out_failed || p->session == NULL) {
+                continue;
+            }
+
+            if (ngx_rtmp_exec_pipe_publish(e) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, e->log, 0,
+                              "exec: pipe output publish failed pid=%i",
+                              (ngx_int_t) e->pid);
+                p->out_failed = 1;
+                continue;
+            }
+        }
+
+        if (p->publish->connection->destroyed) {
+            continue;
+        }
+
+        ngx_memzero(&h, sizeof(h));
+
+        h.type = pos[0];
+        h.mlen = size;
+        h.msid = NGX_RTMP_MSID;
+        h.timestamp = ((uint32_t) pos[7] << 24) | ((uint32_t) pos[4] << 16)
+                      | ((uint32_t) pos[5] << 8) | pos[6];
+
+        switch (h.type) {
+        case NGX_RTMP_MSG_AUDIO:
+            h.csid = NGX_RTMP_CSID_AUDIO;
+            break;
+        case NGX_RTMP_MSG_VIDEO:
+            h.csid = NGX_RTMP_CSID_VIDEO;
+            break;
+        default:
+            h.csid = NGX_RTMP_CSID_AMF;
+        }
+
+        ngx_memzero(&buf, sizeof(buf));
+
+        buf.start = pos + 11;
+        buf.pos = buf.start;
+        buf.last = buf.start + size;
+        buf.end = buf.last;
+        buf.memory = 1;
+
+        cl.buf = &buf;
+        cl.next = NULL;
+
+        if (ngx_rtmp_receive_message(p->publish, &h, &cl) != NGX_OK) {
+            ngx_rtmp_finalize_session(p->publish);
+        }
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+
+    } else if (b->pos != b->start) {
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_exec_pipe_read_handler(ngx_event_t *ev)
+{
+    ngx_connection_t      *c = ev->data;
+
+    ssize_t                n;
+    ngx_err_t              err;
+    ngx_buf_t             *b;
+    ngx_rtmp_exec_t       *e;
+
+    e = c->data;
+    b = &e->pipe->out;
+
+    for ( ;; ) {
+        n = read(c->fd, b->last, b->end - b->last);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_EAGAIN) {
+                ev->ready = 0;
+
+                if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+                    ngx_rtmp_exec_abort(e, e->kill_signal);
+                }
+
+                return;
+            }
+
+            ngx_log_error(NGX_LOG_INFO, e->log, err,
+                          "exec: pipe read failed pid=%i", (ngx_int_t) e->pid);
+            ngx_rtmp_exec_abort(e, e->kill_signal);
+            return;
+        }
+
+        if (n == 0) {
+
+            /* child closed its stdout; exit is handled by control pipe */
+
+            if (ev->active) {
+                ngx_del_event(ev, NGX_READ_EVENT, 0);
+            }
+
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_rtmp_exec_pipe_parse(e) != NGX_OK) {
+            ngx_rtmp_exec_abort(e, e->kill_signal);
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_exec_pipe_init(ngx_rtmp_exec_t *e, int infd, int outfd)
+{
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = e->pipe;
+
+    p->started = 0;
+    p->wait_key = 1;
+    p->out_header = 0;
+    p->out_failed = 0;
+
+    p->in.pos = p->in.start;
+    p->in.last = p->in.start;
+
+    p->in_conn.fd = infd;
+    p->in_conn.data = e;
+    p->in_conn.read = &p->in_rev;
+    p->in_conn.write = &p->in_wev;
+    p->in_rev.data = &p->in_conn;
+    p->in_wev.data = &p->in_conn;
+    p->in_rev.log = e->log;
+    p->in_wev.log = e->log;
+    p->in_wev.write = 1;
+    p->in_wev.ready = 1;
+    p->in_wev.handler = ngx_rtmp_exec_pipe_write_handler;
+
+    p->out_conn.fd = outfd;
+
+    if (outfd == -1) {
+        return;
+    }
+
+    p->out.pos = p->out.start;
+    p->out.last = p->out.start;
+
+    p->out_conn.data = e;
+    p->out_conn.read = &p->out_rev;
+    p->out_conn.write = &p->out_wev;
+    p->out_rev.data = &p->out_conn;
+    p->out_wev.data = &p->out_conn;
+    p->out_rev.log = e->log;
+    p->out_wev.log = e->log;
+    p->out_wev.write = 1;
+    p->out_rev.handler = ngx_rtmp_exec_pipe_read_handler;
+
+    if (ngx_handle_read_event(&p->out_rev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_INFO, e->log, ngx_errno,
+                      "exec: failed to add pipe output event");
+    }
+}
+
+
 static void
 ngx_rtmp_exec_child_dead(ngx_event_t *ev)
 {
@@ -628,7 +1310,14 @@ ngx_rtmp_exec_child_dead(ngx_event_t *ev)
                   e->respawn_timeout == NGX_CONF_UNSET_MSEC ? "respawning" :
                                                                "ignoring");
 
-    ngx_rtmp_exec_kill(e, 0);
+    ngx_rtmp_exec_abort(e, 0);
+}
+
+
+static void
+ngx_rtmp_exec_abort(ngx_rtmp_exec_t *e, ngx_int_t kill_signal)
+{
+    ngx_rtmp_exec_kill(e, kill_signal);
 
     if (e->respawn_timeout == NGX_CONF_UNSET_MSEC) {
         return;
@@ -670,6 +1359,11 @@ ngx_rtmp_exec_kill(ngx_rtmp_exec_t *e, ngx_int_t kill_signal)
 
     e->active = 0;
     close(e->pipefd);
+
+    if (e->pipe) {
+        ngx_rtmp_exec_pipe_close(e);
+    }
+
     if (e->save_pid) {
         *e->save_pid = NGX_INVALID_PID;
     }
@@ -693,14 +1387,16 @@ ngx_rtmp_exec_kill(ngx_rtmp_exec_t *e, ngx_int_t kill_signal)
 static ngx_int_t
 ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
 {
-    int                     fd, ret, maxfd, pipefd[2];
+    int                     fd, ret, maxfd, pipefd[2], infd[2], outfd[2];
     char                  **args, **arg_out;
     ngx_pid_t               pid;
     ngx_str_t              *arg_in, a;
     ngx_uint_t              n;
     ngx_rtmp_exec_conf_t   *ec;
+    ngx_rtmp_exec_pipe_t   *p;
 
     ec = e->conf;
+    p = e->pipe;
 
     ngx_log_error(NGX_LOG_INFO, e->log, 0,
                   "exec: starting %s child '%V'",
@@ -708,6 +1404,10 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
 
     pipefd[0] = -1;
     pipefd[1] = -1;
+    infd[0] = -1;
+    infd[1] = -1;
+    outfd[0] = -1;
+    outfd[1] = -1;
 
     if (e->managed) {
 
@@ -744,6 +1444,20 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
         }
     }
 
+    if (p) {
+        if (pipe(infd) == -1
+            || (p->out.start && pipe(outfd) == -1)
+            || ngx_nonblocking(infd[1]) == -1
+            || (outfd[0] != -1 && ngx_nonblocking(outfd[0]) == -1)
+            || fcntl(infd[1], F_SETFD, FD_CLOEXEC) == -1
+            || (outfd[0] != -1 && fcntl(outfd[0], F_SETFD, FD_CLOEXEC) == -1))
+        {
+            ngx_log_error(NGX_LOG_INFO, e->log, ngx_errno,
+                          "exec: media pipe failed");
+            goto failed;
+        }
+    }
+
     pid = fork();
 
     switch (pid) {
@@ -752,18 +1466,10 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
 
             /* failure */
 
-            if (pipefd[0] != -1) {
-                close(pipefd[0]);
-            }
-
-            if (pipefd[1] != -1) {
-                close(pipefd[1]);
-            }
-
             ngx_log_error(NGX_LOG_INFO, e->log, ngx_errno,
                           "exec: fork failed");
 
-            return NGX_ERROR;
+            goto failed;
 
         case 0:
 
@@ -775,11 +1481,11 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
             }
 #endif
 
-            /* close all descriptors but pipe write end */
+            /* close all descriptors but pipe write end and media pipes */
 
             maxfd = sysconf(_SC_OPEN_MAX);
             for (fd = 0; fd < maxfd; ++fd) {
-                if (fd == pipefd[1]) {
+                if (fd == pipefd[1] || fd == infd[0] || fd == outfd[1]) {
                     continue;
                 }
 
@@ -788,9 +1494,9 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
 
             fd = open("/dev/null", O_RDWR);
 
-            dup2(fd, STDIN_FILENO);
-            dup2(fd, STDOUT_FILENO);
             dup2(fd, STDERR_FILENO);
+            dup2(outfd[1] != -1 ? outfd[1] : fd, STDOUT_FILENO);
+            dup2(infd[0] != -1 ? infd[0] : fd, STDIN_FILENO);
 
             args = ngx_alloc((ec->args.nelts + 2) * sizeof(char *), e->log);
             if (args == NULL) {
@@ -880,6 +1586,16 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
                 }
             }
 
+            if (p) {
+                close(infd[0]);
+
+                if (outfd[1] != -1) {
+                    close(outfd[1]);
+                }
+
+                ngx_rtmp_exec_pipe_init(e, infd[1], outfd[0]);
+            }
+
             ngx_log_debug2(NGX_LOG_DEBUG_RTMP, e->log, 0,
                            "exec: child '%V' started pid=%i",
                            &ec->cmd, (ngx_int_t) pid);
@@ -887,6 +1603,24 @@ ngx_rtmp_exec_run(ngx_rtmp_exec_t *e)
     }
 
     return NGX_OK;
+
+failed:
+
+    for (n = 0; n < 2; n++) {
+        if (pipefd[n] != -1) {
+            close(pipefd[n]);
+        }
+
+        if (infd[n] != -1) {
+            close(infd[n]);
+        }
+
+        if (outfd[n] != -1) {
+            close(outfd[n]);
+        }
+    }
+
+    return NGX_ERROR;
 }
 
 
@@ -895,8 +1629,8 @@ ngx_rtmp_exec_init_ctx(ngx_rtmp_session_t *s, u_char name[NGX_RTMP_MAX_NAME],
     u_char args[NGX_RTMP_MAX_ARGS], ngx_uint_t flags)
 {
     ngx_uint_t                  n;
-    ngx_array_t                *push_conf;
-    ngx_rtmp_exec_t            *e;
+    ngx_array_t                *push_conf, *pipe_conf;
+    ngx_rtmp_exec_t            *e, **pe;
     ngx_rtmp_exec_ctx_t        *ctx;
     ngx_rtmp_exec_conf_t       *ec;
     ngx_rtmp_exec_app_conf_t   *eacf;
@@ -952,6 +1686,32 @@ ngx_rtmp_exec_init_ctx(ngx_rtmp_session_t *s, u_char name[NGX_RTMP_MAX_NAME],
         }
     }
 
+    pipe_conf = &eacf->conf[NGX_RTMP_EXEC_PIPE];
+
+    /* media pipes only make sense for publishers */
+
+    pipe_conf = &eacf->conf[NGX_RTMP_EXEC_PIPE];
+
+    if (pipe_conf->nelts > 0 && (flags & NGX_RTMP_EXEC_PUBLISHING)) {
+
+        if (ngx_array_init(&ctx->pipe_exec, s->connection->pool,
+                           pipe_conf->nelts,
+                           sizeof(ngx_rtmp_exec_t *)) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        pe = ngx_array_push_n(&ctx->pipe_exec, pipe_conf->nelts);
+
+        if (pe == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* children are taken from pool or started on publish */
+
+        ngx_memzero(pe, sizeof(ngx_rtmp_exec_t *) * pipe_conf->nelts);
+    }
+
 done:
 
     ngx_memcpy(ctx->name, name, NGX_RTMP_MAX_NAME);
@@ -1136,6 +1896,120 @@ ngx_rtmp_exec_unmanaged(ngx_rtmp_session_t *s, ngx_array_t *e, const char *op)
 }
 
 
+static ngx_int_t
+ngx_rtmp_exec_pipe_create(ngx_pool_t *pool, ngx_rtmp_exec_t *e, size_t size)
+{
+    ngx_rtmp_exec_pipe_t  *p;
+
+    p = ngx_pcalloc(pool, sizeof(ngx_rtmp_exec_pipe_t));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p->in_conn.fd = -1;
+    p->out_conn.fd = -1;
+
+    p->in.start = ngx_palloc(pool, size);
+    if (p->in.start == NULL) {
+        return NGX_ERROR;
+    }
+
+    p->in.end = p->in.start + size;
+
+    if (e->conf->output.len) {
+        p->out.start = ngx_palloc(pool, size);
+        if (p->out.start == NULL) {
+            return NGX_ERROR;
+        }
+
+        p->out.end = p->out.start + size;
+    }
+
+    e->pipe = p;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_exec_pipe_start(ngx_rtmp_session_t *s, ngx_rtmp_exec_ctx_t *ctx)
+{
+    ngx_uint_t                  n, k;
+    ngx_rtmp_exec_t            *e, **pe;
+    ngx_rtmp_exec_conf_t       *ec;
+    ngx_rtmp_exec_app_conf_t   *eacf;
+    ngx_rtmp_exec_main_conf_t  *emcf;
+
+    if (ctx->pipe_exec.nelts == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "exec: pipe %uz managed command(s)", ctx->pipe_exec.nelts);
+
+    eacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_exec_module);
+    emcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_exec_module);
+
+    ec = eacf->conf[NGX_RTMP_EXEC_PIPE].elts;
+    pe = ctx->pipe_exec.elts;
+
+    for (n = 0; n < ctx->pipe_exec.nelts; n++, ec++, pe++) {
+        if (ngx_rtmp_exec_filter(s, ec) != NGX_OK) {
+            continue;
+        }
+
+        /* take a warm child if there is an idle one */
+
+        if (*pe == NULL && ec->pool && ec->pool->exec) {
+            e = ec->pool->exec;
+            for (k = 0; k < ec->pool->size; k++, e++) {
+                if (e->active && e->pipe->session == NULL) {
+                    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                                  "exec: pipe taken from pool pid=%i",
+                                  (ngx_int_t) e->pid);
+
+                    e->pipe->session = s;
+                    *pe = e;
+                    break;
+                }
+            }
+
+            if (*pe) {
+                continue;
+            }
+        }
+
+        if (*pe == NULL) {
+            e = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_exec_t));
+            if (e == NULL) {
+                continue;
+            }
+
+            e->conf = ec;
+            e->managed = 1;
+            e->log = s->connection->log;
+            e->eval = ngx_rtmp_exec_push_eval;
+            e->eval_ctx = s;
+            e->kill_signal = emcf->kill_signal;
+            e->respawn_timeout = (eacf->respawn ? emcf->respawn_timeout :
+                                  NGX_CONF_UNSET_MSEC);
+
+            if (ngx_rtmp_exec_pipe_create(s->connection->pool, e,
+                                          eacf->pipe_buffer)
+                != NGX_OK)
+            {
+                continue;
+            }
+
+            e->pipe->session = s;
+            *pe = e;
+        }
+
+        ngx_rtmp_exec_run(*pe);
+    }
+}
+
+
 static void
 ngx_rtmp_exec_managed(ngx_rtmp_session_t *s, ngx_array_t *e, const char *op)
 {
@@ -1174,6 +2048,12 @@ ngx_rtmp_exec_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         goto next;
     }
 
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_exec_module);
+
+    if (ctx && (ctx->flags & NGX_RTMP_EXEC_PIPED)) {
+        goto next;
+    }
+
     if (ngx_rtmp_exec_init_ctx(s, v->name, v->args, NGX_RTMP_EXEC_PUBLISHING)
         != NGX_OK)
     {
@@ -1185,6 +2065,7 @@ ngx_rtmp_exec_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_exec_module);
 
     ngx_rtmp_exec_managed(s, &ctx->push_exec, "push");
+    ngx_rtmp_exec_pipe_start(s, ctx);
 
 next:
     return next_publish(s, v);
@@ -1232,7 +2113,7 @@ static ngx_int_t
 ngx_rtmp_exec_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
     size_t                     n;
-    ngx_rtmp_exec_t           *e;
+    ngx_rtmp_exec_t           *e, **pe;
     ngx_rtmp_exec_ctx_t       *ctx;
     ngx_rtmp_exec_pull_ctx_t  *pctx, **ppctx;
     ngx_rtmp_exec_app_conf_t  *eacf;
@@ -1257,7 +2138,12 @@ ngx_rtmp_exec_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
                                 "play_done");
     }
 
-    ctx->flags = 0;
+    if (ctx->pipe) {
+        ctx->pipe->publish = NULL;
+        ctx->pipe = NULL;
+    }
+
+    ctx->flags &= NGX_RTMP_EXEC_PIPED;
 
     if (ctx->push_exec.nelts > 0) {
         ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
@@ -1270,6 +2156,34 @@ ngx_rtmp_exec_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
         }
     }
 
+    if (ctx->pipe_exec.nelts > 0) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "exec: delete %uz pipe command(s)",
+                       ctx->pipe_exec.nelts);
+
+        pe = ctx->pipe_exec.elts;
+        for (n = 0; n < ctx->pipe_exec.nelts; n++, pe++) {
+            e = *pe;
+
+            if (e == NULL) {
+                continue;
+            }
+
+            if (!e->pooled) {
+                ngx_rtmp_exec_kill(e, e->kill_signal);
+                continue;
+            }
+
+            /* child has seen the stream; replace it with a fresh one */
+
+            e->pipe->session = NULL;
+            ngx_rtmp_exec_kill(e, e->kill_signal);
+            ngx_rtmp_exec_run(e);
+
+            *pe = NULL;
+        }
+    }
+
     pctx = ctx->pull;
 
     if (pctx && --pctx->counter == 0) {
@@ -1359,6 +2273,42 @@ ngx_rtmp_exec_record_done(ngx_rtmp_session_t *s, ngx_rtmp_record_done_t *v)
 next:
     return next_record_done(s, v);
 }
+
+
+static ngx_int_t
+ngx_rtmp_exec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    size_t                 n;
+    ngx_uint_t             key, header;
+    ngx_rtmp_exec_t      **pe;
+    ngx_rtmp_exec_ctx_t   *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_exec_module);
+    if (ctx == NULL || ctx->pipe_exec.nelts == 0 || in == NULL) {
+        return NGX_OK;
+    }
+
+    if (!(ctx->flags & NGX_RTMP_EXEC_PUBLISHING)) {
+        return NGX_OK;
+    }
+
+    key = (h->type == NGX_RTMP_MSG_VIDEO &&
+           ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_KEY_FRAME);
+
+    header = (h->type == NGX_RTMP_MSG_VIDEO
+              ? ngx_rtmp_is_video_codec_header(in)
+              : ngx_rtmp_is_codec_header(in));
+
+    pe = ctx->pipe_exec.elts;
+    for (n = 0; n < ctx->pipe_exec.nelts; n++, pe++) {
+        if (*pe && (*pe)->active) {
+            ngx_rtmp_exec_pipe_av(*pe, h, in, key, header);
+        }
+    }
+
+    return NGX_OK;
+}
 #endif /* NGX_WIN32 */
 
 
@@ -1367,11 +2317,13 @@ ngx_rtmp_exec_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *p = conf;
 
-    size_t                     n, nargs;
-    ngx_str_t                 *s, *value, v;
-    ngx_array_t               *confs;
-    ngx_rtmp_exec_conf_t      *ec;
-    ngx_rtmp_exec_app_conf_t  *eacf;
+    size_t                      n, nargs;
+    ngx_str_t                  *s, *value, v;
+    ngx_array_t                *confs;
+    ngx_rtmp_exec_conf_t       *ec;
+    ngx_rtmp_exec_pool_t       *pool, **ppool;
+    ngx_rtmp_exec_app_conf_t   *eacf;
+    ngx_rtmp_exec_main_conf_t  *emcf;
 
     confs = (ngx_array_t *) (p + cmd->offset);
 
@@ -1434,6 +2386,51 @@ ngx_rtmp_exec_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
         }
 
+        if (confs == &eacf->conf[NGX_RTMP_EXEC_PIPE]
+            && v.len > 7 && ngx_strncmp(v.data, "output=", 7) == 0)
+        {
+            ec->output.data = v.data + 7;
+            ec->output.len = v.len - 7;
+
+            continue;
+        }
+
+        if (confs == &eacf->conf[NGX_RTMP_EXEC_PIPE]
+            && v.len > 5 && ngx_strncmp(v.data, "pool=", 5) == 0)
+        {
+            pool = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_exec_pool_t));
+            if (pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            pool->size = ngx_atoi(v.data + 5, v.len - 5);
+            if (pool->size == (ngx_uint_t) NGX_ERROR || pool->size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid pool size \"%V\"", &v);
+                return NGX_CONF_ERROR;
+            }
+
+            emcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_exec_module);
+
+            if (emcf->pools.nalloc == 0
+                && ngx_array_init(&emcf->pools, cf->pool, 1,
+                                  sizeof(ngx_rtmp_exec_pool_t *))
+                   != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            ppool = ngx_array_push(&emcf->pools);
+            if (ppool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *ppool = pool;
+            ec->pool = pool;
+
+            continue;
+        }
+
         s = ngx_array_push(&ec->args);
         if (s == NULL) {
             return NGX_CONF_ERROR;
@@ -1442,6 +2439,13 @@ ngx_rtmp_exec_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         *s = v;
     }
 
+    if (ec->pool) {
+
+        /* pooled children are started with no session to substitute */
+
+        ec->pool->conf = *ec;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -1585,6 +2589,22 @@ static ngx_int_t
 ngx_rtmp_exec_postconfiguration(ngx_conf_t *cf)
 {
 #if !(NGX_WIN32)
+    ngx_rtmp_core_main_conf_t  *cmcf;
+    ngx_rtmp_handler_pt        *h;
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+    *h = ngx_rtmp_exec_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+    *h = ngx_rtmp_exec_av;
 
     next_publish = ngx_rtmp_publish;
     ngx_rtmp_publish = ngx_rtmp_exec_publish;
@@ -0,0 +1,269 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <nginx.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_expire.h"
+
+
+static void ngx_rtmp_expire_insert(ngx_rtmp_expire_t *ex, u_char *path,
+    size_t len, time_t expire, time_t max_age, ngx_log_t *log);
+
+
+static ngx_int_t
+ngx_rtmp_expire_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_rtmp_expire_t      *oex = data;
+
+    ngx_rtmp_expire_t      *ex;
+
+    ex = shm_zone->data;
+
+    if (oex) {
+        ex->shpool = oex->shpool;
+        ex->sh = oex->sh;
+        return NGX_OK;
+    }
+
+    ex->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ex->sh = ex->shpool->data;
+        return NGX_OK;
+    }
+
+    ex->sh = ngx_slab_alloc(ex->shpool, sizeof(ngx_rtmp_expire_sh_t));
+    if (ex->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&ex->sh->queue);
+    ex->sh->dropped = 0;
+
+    ex->shpool->data = ex->sh;
+
+#if (nginx_version >= 1005013)
+    /* full queue is not an error, directory scan catches up */
+    ex->shpool->log_nomem = 0;
+#endif
+
+    return NGX_OK;
+}
+
+
+ngx_rtmp_expire_t *
+ngx_rtmp_expire_add_zone(ngx_conf_t *cf, char *module, ngx_str_t *path,
+    size_t size, void *tag)
+{
+    size_t                  len;
+    u_char                 *p;
+    ngx_str_t               name;
+    ngx_shm_zone_t         *shm_zone;
+    ngx_rtmp_expire_t      *ex;
+
+    static ngx_str_t        prefix = ngx_string("rtmp_expire:");
+
+    if (size < 8 * ngx_pagesize) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "cleanup queue of \"%V\" is too small", path);
+        return NULL;
+    }
+
+    len = ngx_strlen(module);
+
+    name.len = prefix.len + len + 1 + path->len;
+    name.data = ngx_pnalloc(cf->pool, name.len);
+    if (name.data == NULL) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(name.data, prefix.data, prefix.len);
+    p = ngx_cpymem(p, module, len);
+    *p++ = ':';
+    ngx_memcpy(p, path->data, path->len);
+
+    /*
+     * applications of one module sharing a path share its queue,
+     * other modules writing there get queues of their own
+     */
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        return shm_zone->data;
+    }
+
+    ex = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_expire_t));
+    if (ex == NULL) {
+        return NULL;
+    }
+
+    ex->shm_zone = shm_zone;
+
+    shm_zone->init = ngx_rtmp_expire_init_zone;
+    shm_zone->data = ex;
+
+    return ex;
+}
+
+
+static void
+ngx_rtmp_expire_insert(ngx_rtmp_expire_t *ex, u_char *path, size_t len,
+    time_t expire, time_t max_age, ngx_log_t *log)
+{
+    ngx_queue_t            *q;
+    ngx_rtmp_expire_node_t *node, *prev;
+
+    ngx_shmtx_lock(&ex->shpool->mutex);
+
+    node = ngx_slab_alloc_locked(ex->shpool,
+                                 offsetof(ngx_rtmp_expire_node_t, path) + len);
+    if (node == NULL) {
+        ex->sh->dropped++;
+        ngx_shmtx_unlock(&ex->shpool->mutex);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, log, 0,
+                       "expire: queue full, '%*s' left to directory scan",
+                       len, path);
+        return;
+    }
+
+    node->expire = expire;
+    node->max_age = max_age;
+    node->len = len;
+    ngx_memcpy(node->path, path, len);
+
+    /* nearly always appended; apps sharing a path may differ in max_age */
+
+    for (q = ngx_queue_last(&ex->sh->queue);
+         q != ngx_queue_sentinel(&ex->sh->queue);
+         q = ngx_queue_prev(q))
+    {
+        prev = ngx_queue_data(q, ngx_rtmp_expire_node_t, queue);
+        if (prev->expire <= expire) {
+            break;
+        }
+    }
+
+    ngx_queue_insert_after(q, &node->queue);
+
+    ngx_shmtx_unlock(&ex->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "expire: queued '%*s' expire=%T", len, path, expire);
+}
+
+
+void
+ngx_rtmp_expire_push(ngx_rtmp_expire_t *ex, u_char *path, time_t max_age,
+    ngx_log_t *log)
+{
+    ngx_rtmp_expire_insert(ex, path, ngx_strlen(path), ngx_time() + max_age,
+                           max_age, log);
+}
+
+
+/*
+ * Deletes files which expired by now. Returns NGX_OK if directory
+ * scan is due as well, NGX_DECLINED otherwise. Sets delay in seconds
+ * before the next call.
+ */
+
+ngx_int_t
+ngx_rtmp_expire_run(ngx_rtmp_expire_t *ex, time_t period, time_t *next)
+{
+    u_char                  path[NGX_MAX_PATH + 1];
+    size_t                  len;
+    time_t                  now, expire, max_age;
+    ngx_int_t               rc;
+    ngx_queue_t            *q;
+    ngx_file_info_t         fi;
+    ngx_rtmp_expire_node_t *node;
+
+    now = ngx_time();
+
+    if (period < 1) {
+        period = 1;
+    }
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&ex->shpool->mutex);
+
+        if (ngx_queue_empty(&ex->sh->queue)) {
+            expire = now + period;
+            break;
+        }
+
+        q = ngx_queue_head(&ex->sh->queue);
+        node = ngx_queue_data(q, ngx_rtmp_expire_node_t, queue);
+
+        if (node->expire > now) {
+            expire = node->expire;
+            break;
+        }
+
+        ngx_queue_remove(q);
+
+        len = ngx_min(node->len, NGX_MAX_PATH);
+        *ngx_cpymem(path, node->path, len) = 0;
+        max_age = node->max_age;
+
+        ngx_slab_free_locked(ex->shpool, node);
+
+        ngx_shmtx_unlock(&ex->shpool->mutex);
+
+        /* file could be gone or rewritten since it was queued */
+
+        if (ngx_file_info(path, &fi) == NGX_FILE_ERROR) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                           "expire: '%s' is gone", path);
+            continue;
+        }
+
+        if (ngx_file_mtime(&fi) + max_age > now) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                           "expire: '%s' modified, requeued", path);
+
+            ngx_rtmp_expire_insert(ex, path, len, ngx_file_mtime(&fi) + max_age,
+                                   max_age, ngx_cycle->log);
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ngx_cycle->log, 0,
+                       "expire: delete '%s'", path);
+
+        if (ngx_delete_file(path) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                          "expire: " ngx_delete_file_n " failed on '%s'",
+                          path);
+        }
+    }
+
+    rc = NGX_DECLINED;
+
+    /* files which did not fit into the queue are left to the scan */
+
+    if (now >= ex->scan || ex->sh->dropped) {
+        ex->sh->dropped = 0;
+        ex->scan = now + period * NGX_RTMP_EXPIRE_SCAN_FACTOR;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&ex->shpool->mutex);
+
+    *next = ngx_min(expire, ex->scan) - now;
+
+    if (*next < 1) {
+        *next = 1;
+    }
+
+    return rc;
+}
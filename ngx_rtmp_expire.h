@@ -0,0 +1,51 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#ifndef _NGX_RTMP_EXPIRE_H_INCLUDED_
+#define _NGX_RTMP_EXPIRE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* Directory scan runs this many cleanup periods apart when queue is used */
+#define NGX_RTMP_EXPIRE_SCAN_FACTOR     10
+
+
+typedef struct {
+    ngx_queue_t         queue;
+    time_t              expire;
+    time_t              max_age;
+    size_t              len;
+    u_char              path[1];
+} ngx_rtmp_expire_node_t;
+
+
+typedef struct {
+    ngx_queue_t         queue;      /* ngx_rtmp_expire_node_t by expire */
+    ngx_uint_t          dropped;    /* files not queued since last scan */
+} ngx_rtmp_expire_sh_t;
+
+
+/* Deletion queue of files created in one cleanup path */
+typedef struct {
+    ngx_shm_zone_t         *shm_zone;
+    ngx_slab_pool_t        *shpool;
+    ngx_rtmp_expire_sh_t   *sh;
+    time_t                  scan;   /* next directory scan, manager only */
+} ngx_rtmp_expire_t;
+
+
+ngx_rtmp_expire_t *ngx_rtmp_expire_add_zone(ngx_conf_t *cf, char *module,
+    ngx_str_t *path, size_t size, void *tag);
+void ngx_rtmp_expire_push(ngx_rtmp_expire_t *ex, u_char *path,
+    time_t max_age, ngx_log_t *log);
+ngx_int_t ngx_rtmp_expire_run(ngx_rtmp_expire_t *ex, time_t period,
+    time_t *next);
+
+
+#endif /* _NGX_RTMP_EXPIRE_H_INCLUDED_ */
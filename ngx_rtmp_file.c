@@ -0,0 +1,163 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_file.h"
+
+
+/*
+ * Allocates disk blocks for data to be appended at offset so that
+ * small writes land in one extent. File size is left intact, readers
+ * never see the reserved tail. Returns NGX_OK if space was reserved
+ * and should be trimmed when file is complete, NGX_DECLINED otherwise.
+ */
+
+ngx_int_t
+ngx_rtmp_file_reserve(ngx_fd_t fd, off_t offset, off_t size, ngx_log_t *log)
+{
+#if (NGX_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    ngx_err_t  err;
+#endif
+
+    if (size <= 0) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+
+    /* posix_fallocate() is not used, glibc emulates it writing zeros */
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size) == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_EOPNOTSUPP || err == NGX_ENOSYS) {
+            ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0,
+                           "file: preallocation not supported");
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, log, err,
+                      "fallocate(%O, %O) failed", offset, size);
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "file: reserved %O bytes at %O", size, offset);
+
+    return NGX_OK;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+/* Releases blocks reserved beyond the data actually written */
+
+void
+ngx_rtmp_file_trim(ngx_fd_t fd, off_t size, ngx_log_t *log)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "file: trim at %O", size);
+
+    if (ngx_truncate_file(fd, size) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                      ngx_truncate_file_n " failed");
+    }
+}
+
+
+/*
+ * Starts writeback of a finished range without waiting for it. Dirty
+ * pages cannot be dropped from cache, so callers advise the range with
+ * ngx_rtmp_file_drop_cache() later, when the next fragment is finished.
+ */
+
+void
+ngx_rtmp_file_writeback(ngx_fd_t fd, off_t offset, off_t size,
+    ngx_log_t *log)
+{
+    if (size <= 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "file: writeback %O bytes at %O", size, offset);
+
+#if (NGX_LINUX) && defined(SYNC_FILE_RANGE_WRITE)
+
+    if (sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE) == -1) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                      "sync_file_range(%O, %O) failed", offset, size);
+    }
+
+#endif
+}
+
+
+/*
+ * Drops written data from page cache when files are served by another
+ * host. Pages still being written back stay cached.
+ */
+
+void
+ngx_rtmp_file_drop_cache(ngx_fd_t fd, off_t offset, off_t size,
+    ngx_log_t *log)
+{
+#if (NGX_HAVE_POSIX_FADVISE)
+    ngx_err_t  err;
+
+    if (size <= 0) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "file: drop cache %O bytes at %O", size, offset);
+
+    err = posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+
+    if (err) {
+        ngx_log_error(NGX_LOG_WARN, log, err,
+                      "posix_fadvise(POSIX_FADV_DONTNEED) failed");
+    }
+#endif
+}
+
+
+/*
+ * Playlists and manifests are built in memory and written at once.
+ * Buffer is shared by all streams of the worker and only grows.
+ */
+
+u_char *
+ngx_rtmp_file_get_buffer(size_t size, ngx_log_t *log)
+{
+    static u_char  *buffer;
+    static size_t   buffer_size;
+
+    u_char         *p;
+
+    if (size > buffer_size) {
+        size = ngx_align(size, ngx_pagesize);
+
+        p = ngx_alloc(size, log);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (buffer) {
+            ngx_free(buffer);
+        }
+
+        buffer = p;
+        buffer_size = size;
+    }
+
+    return buffer;
+}
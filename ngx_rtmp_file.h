@@ -0,0 +1,29 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#ifndef _NGX_RTMP_FILE_H_INCLUDED_
+#define _NGX_RTMP_FILE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* Space reserved for the next fragment given the size of previous one */
+#define ngx_rtmp_file_estimate(size)    ((size) + (size) / 4)
+
+
+ngx_int_t ngx_rtmp_file_reserve(ngx_fd_t fd, off_t offset, off_t size,
+    ngx_log_t *log);
+void ngx_rtmp_file_trim(ngx_fd_t fd, off_t size, ngx_log_t *log);
+void ngx_rtmp_file_writeback(ngx_fd_t fd, off_t offset, off_t size,
+    ngx_log_t *log);
+void ngx_rtmp_file_drop_cache(ngx_fd_t fd, off_t offset, off_t size,
+    ngx_log_t *log);
+u_char *ngx_rtmp_file_get_buffer(size_t size, ngx_log_t *log);
+
+
+#endif /* _NGX_RTMP_FILE_H_INCLUDED_ */
@@ -11,6 +11,9 @@
 
 
 static void ngx_rtmp_recv(ngx_event_t *rev);
+static void ngx_rtmp_recv_buffered(ngx_event_t *rev);
+static ngx_int_t ngx_rtmp_recv_chunk(ngx_rtmp_session_t *s,
+       ngx_rtmp_in_block_t *blk);
 static void ngx_rtmp_send(ngx_event_t *rev);
 static void ngx_rtmp_ping(ngx_event_t *rev);
 static ngx_int_t ngx_rtmp_finalize_set_chunk_size(ngx_rtmp_session_t *s);
@@ -84,9 +87,13 @@ void
 ngx_rtmp_cycle(ngx_rtmp_session_t *s)
 {
     ngx_connection_t           *c;
+    ngx_rtmp_core_srv_conf_t   *cscf;
 
     c = s->connection;
-    c->read->handler =  ngx_rtmp_recv;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    c->read->handler = cscf->in_buffer ? ngx_rtmp_recv_buffered
+                                       : ngx_rtmp_recv;
     c->write->handler = ngx_rtmp_send;
 
     s->ping_evt.data = c;
@@ -94,7 +101,7 @@ ngx_rtmp_cycle(ngx_rtmp_session_t *s)
     s->ping_evt.handler = ngx_rtmp_ping;
     ngx_rtmp_reset_ping(s);
 
-    ngx_rtmp_recv(c->read);
+    c->read->handler(c->read);
 }
 
 
@@ -189,6 +196,36 @@ ngx_rtmp_ping(ngx_event_t *pev)
 }
 
 
+static ngx_int_t
+ngx_rtmp_recv_account(ngx_rtmp_session_t *s, size_t n)
+{
+    s->ping_reset = 1;
+    ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
+    s->in_bytes += n;
+
+    if (s->in_bytes >= 0xf0000000) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "resetting byte counter");
+        s->in_bytes = 0;
+        s->in_last_ack = 0;
+    }
+
+    if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
+
+        s->in_last_ack = s->in_bytes;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "sending RTMP ACK(%uD)", s->in_bytes);
+
+        if (ngx_rtmp_send_ack(s, s->in_bytes)) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_rtmp_recv(ngx_event_t *rev)
 {
@@ -267,29 +304,11 @@ ngx_rtmp_recv(ngx_event_t *rev)
                 return;
             }
 
-            s->ping_reset = 1;
-            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
             b->last += n;
-            s->in_bytes += n;
-
-            if (s->in_bytes >= 0xf0000000) {
-                ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                               "resetting byte counter");
-                s->in_bytes = 0;
-                s->in_last_ack = 0;
-            }
-
-            if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
-
-                s->in_last_ack = s->in_bytes;
-
-                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                        "sending RTMP ACK(%uD)", s->in_bytes);
 
-                if (ngx_rtmp_send_ack(s, s->in_bytes)) {
-                    ngx_rtmp_finalize_session(s);
-                    return;
-                }
+            if (ngx_rtmp_recv_account(s, n) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+                return;
             }
         }
 
@@ -486,12 +505,518 @@ ngx_rtmp_recv(ngx_event_t *rev)
 }
 
 
+static ngx_rtmp_in_block_t *
+ngx_rtmp_alloc_in_block(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_in_block_t        *blk;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    size_t                      size;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    size = ngx_max(cscf->in_buffer,
+                   s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER);
+
+    while (s->in_free_blocks) {
+        blk = s->in_free_blocks;
+        s->in_free_blocks = blk->next;
+
+        /* blocks left over from smaller chunk size stay in pool */
+        if ((size_t) (blk->end - blk->start) >= size) {
+            goto done;
+        }
+    }
+
+    blk = ngx_palloc(s->in_pool, sizeof(ngx_rtmp_in_block_t) + size);
+    if (blk == NULL) {
+        return NULL;
+    }
+
+    blk->start = (u_char *) (blk + 1);
+    blk->end = blk->start + size;
+
+done:
+
+    blk->ref = 0;
+    blk->next = NULL;
+    blk->pos = blk->last = blk->start;
+
+    return blk;
+}
+
+
+static void
+ngx_rtmp_free_in_block(ngx_rtmp_session_t *s, ngx_rtmp_in_block_t *blk)
+{
+    if (blk->ref || blk == s->in_block) {
+        return;
+    }
+
+    blk->next = s->in_free_blocks;
+    s->in_free_blocks = blk;
+}
+
+
+/*
+ * in_buffer mode: reads as much as fits into a large block and parses all
+ * complete chunks from it. Chunk payloads are linked to their streams as
+ * slices pointing into the block; only an incomplete chunk at the end of
+ * the block is copied when switching to the next one.
+ */
+static void
+ngx_rtmp_recv_buffered(ngx_event_t *rev)
+{
+    ngx_int_t                   n, rc;
+    ngx_connection_t           *c;
+    ngx_rtmp_session_t         *s;
+    ngx_rtmp_in_block_t        *blk, *old;
+    size_t                      size;
+
+    c = rev->data;
+    s = c->data;
+
+    if (c->destroyed) {
+        return;
+    }
+
+    for ( ;; ) {
+
+        blk = s->in_block;
+        size = s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+
+        if (blk == NULL || (size_t) (blk->end - blk->last) < size) {
+
+            old = blk;
+
+            blk = ngx_rtmp_alloc_in_block(s);
+            if (blk == NULL) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                        "in block alloc failed");
+                ngx_rtmp_finalize_session(s);
+                return;
+            }
+
+            s->in_block = blk;
+
+            if (old) {
+                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                        "moving unparsed data to new block: %uz",
+                        (size_t) (old->last - old->pos));
+
+                blk->last = ngx_cpymem(blk->pos, old->pos,
+                                       old->last - old->pos);
+                old->pos = old->last;
+
+                ngx_rtmp_free_in_block(s, old);
+            }
+        }
+
+        n = c->recv(c, blk->last, blk->end - blk->last);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+            }
+            return;
+        }
+
+        blk->last += n;
+
+        if (ngx_rtmp_recv_account(s, n) != NGX_OK) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+
+        do {
+            rc = ngx_rtmp_recv_chunk(s, blk);
+
+            if (rc == NGX_ERROR) {
+                ngx_rtmp_finalize_session(s);
+                return;
+            }
+
+        } while (rc == NGX_OK);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_recv_chunk(ngx_rtmp_session_t *s, ngx_rtmp_in_block_t *blk)
+{
+    ngx_int_t                   rc;
+    ngx_connection_t           *c;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_header_t          *h;
+    ngx_rtmp_stream_t          *st;
+    ngx_chain_t                *cl, *head, *last;
+    ngx_buf_t                  *b;
+    u_char                     *p, *pp;
+    size_t                      size, fsize;
+    uint8_t                     fmt, ext, type;
+    uint32_t                    csid, timestamp, mlen, msid;
+
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    p = blk->pos;
+
+    if (blk->last - p < 1) {
+        return NGX_AGAIN;
+    }
+
+    /* chunk basic header */
+    fmt  = (*p >> 6) & 0x03;
+    csid = *p++ & 0x3f;
+
+    if (csid == 0) {
+        if (blk->last - p < 1) {
+            return NGX_AGAIN;
+        }
+        csid = 64;
+        csid += *(uint8_t*)p++;
+
+    } else if (csid == 1) {
+        if (blk->last - p < 2) {
+            return NGX_AGAIN;
+        }
+        csid = 64;
+        csid += *(uint8_t*)p++;
+        csid += (uint32_t)256 * (*(uint8_t*)p++);
+    }
+
+    if (csid >= (uint32_t)cscf->max_streams) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+            "RTMP in chunk stream too big: %D >= %D",
+            csid, cscf->max_streams);
+        return NGX_ERROR;
+    }
+
+    st = &s->in_streams[csid];
+    h = &st->hdr;
+
+    /* parse into locals, stream is updated once the whole chunk is here */
+
+    ext = st->ext;
+    timestamp = st->dtime;
+    mlen = h->mlen;
+    type = h->type;
+    msid = h->msid;
+
+    if (fmt <= 2 ) {
+        if (blk->last - p < 3) {
+            return NGX_AGAIN;
+        }
+        pp = (u_char*)&timestamp;
+        pp[2] = *p++;
+        pp[1] = *p++;
+        pp[0] = *p++;
+        pp[3] = 0;
+
+        ext = (timestamp == 0x00ffffff);
+
+        if (fmt <= 1) {
+            if (blk->last - p < 4) {
+                return NGX_AGAIN;
+            }
+            pp = (u_char*)&mlen;
+            pp[2] = *p++;
+            pp[1] = *p++;
+            pp[0] = *p++;
+            pp[3] = 0;
+            type = *(uint8_t*)p++;
+
+            if (fmt == 0) {
+                if (blk->last - p < 4) {
+                    return NGX_AGAIN;
+                }
+                pp = (u_char*)&msid;
+                pp[0] = *p++;
+                pp[1] = *p++;
+                pp[2] = *p++;
+                pp[3] = *p++;
+            }
+        }
+    }
+
+    /* extended header */
+    if (ext) {
+        if (blk->last - p < 4) {
+            return NGX_AGAIN;
+        }
+        pp = (u_char*)&timestamp;
+        pp[3] = *p++;
+        pp[2] = *p++;
+        pp[1] = *p++;
+        pp[0] = *p++;
+    }
+
+    if (mlen > cscf->max_message) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                "too big message: %uz", cscf->max_message);
+        return NGX_ERROR;
+    }
+
+    if (mlen < st->len) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                "RTMP message length changed in the middle: %uD < %uD",
+                mlen, st->len);
+        return NGX_ERROR;
+    }
+
+    fsize = mlen - st->len;
+    size = ngx_min(fsize, s->in_chunk_size);
+
+    if ((size_t) (blk->last - p) < size) {
+        return NGX_AGAIN;
+    }
+
+    /* chunk is complete */
+
+    h->csid = csid;
+    h->mlen = mlen;
+    h->type = type;
+    h->msid = msid;
+
+    if (st->len == 0) {
+        st->ext = (ext && cscf->publish_time_fix);
+        if (fmt) {
+            st->dtime = timestamp;
+        } else {
+            h->timestamp = timestamp;
+            st->dtime = 0;
+        }
+    }
+
+    ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
+            "RTMP mheader fmt=%d %s (%d) "
+            "time=%uD+%uD mlen=%D len=%D msid=%D",
+            (int)fmt, ngx_rtmp_message_type(h->type), (int)h->type,
+            h->timestamp, st->dtime, h->mlen, st->len, h->msid);
+
+    /* link payload slice */
+
+    cl = s->in_free;
+
+    if (cl) {
+        s->in_free = cl->next;
+        b = cl->buf;
+
+    } else {
+        cl = ngx_alloc_chain_link(s->in_pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ngx_calloc_buf(s->in_pool);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = b;
+    }
+
+    b->start = b->pos = p;
+    b->end = b->last = p + size;
+    b->tag = (ngx_buf_tag_t) blk;
+
+    blk->ref++;
+    blk->pos = p + size;
+
+    if (st->in == NULL) {
+        cl->next = cl;
+    } else {
+        cl->next = st->in->next;
+        st->in->next = cl;
+    }
+    st->in = cl;
+
+    if (fsize > s->in_chunk_size) {
+        /* collect fragmented chunks */
+        st->len += size;
+        return NGX_OK;
+    }
+
+    /* handle! */
+
+    last = st->in;
+    head = last->next;
+    last->next = NULL;
+    st->in = NULL;
+    st->len = 0;
+    h->timestamp += st->dtime;
+
+    rc = ngx_rtmp_receive_message(s, h, head);
+
+    /* release slices */
+
+    for (cl = head; cl; cl = cl->next) {
+        blk = (ngx_rtmp_in_block_t *) cl->buf->tag;
+        blk->ref--;
+        ngx_rtmp_free_in_block(s, blk);
+    }
+
+    last->next = s->in_free;
+    s->in_free = head;
+
+    return rc == NGX_OK ? NGX_OK : NGX_ERROR;
+}
+
+
+static void
+ngx_rtmp_bucket_wake(ngx_event_t *ev)
+{
+    ngx_queue_t         *q;
+    ngx_rtmp_bucket_t   *b;
+    ngx_rtmp_session_t  *s;
+
+    b = ev->data;
+
+    /* resume throttled sessions in the order they were stopped */
+
+    while (!ngx_queue_empty(&b->waiting)) {
+        q = ngx_queue_head(&b->waiting);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_rtmp_session_t, out_wait);
+        s->out_wait_bucket = NULL;
+        s->out_throttling = 1;
+
+        ngx_post_event(s->connection->write, &ngx_posted_events);
+    }
+}
+
+
+/*
+ * Limits *size to what session may send now. Returns NGX_DECLINED if no
+ * bucket applies and NGX_AGAIN if session has to wait. Waiting sessions
+ * are queued to the exhausted bucket; new senders queue behind them so
+ * that buckets are shared round-robin.
+ */
+static ngx_int_t
+ngx_rtmp_shape(ngx_rtmp_session_t *s, size_t *size)
+{
+    size_t                      n, avail;
+    ngx_uint_t                  i;
+    ngx_rtmp_bucket_t          *b[3];
+    ngx_rtmp_core_app_conf_t   *cacf;
+    ngx_rtmp_core_main_conf_t  *cmcf;
+
+    n = 0;
+
+    if (s->connection->fd == -1) {
+        return NGX_DECLINED;
+    }
+
+    if (s->app_conf) {
+        cacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_core_module);
+
+        if (cacf->session_rate) {
+            if (s->out_bucket == NULL) {
+                s->out_bucket = ngx_palloc(s->connection->pool,
+                                           sizeof(ngx_rtmp_bucket_t));
+                if (s->out_bucket == NULL) {
+                    return NGX_DECLINED;
+                }
+
+                ngx_rtmp_bucket_init(s->out_bucket, cacf->session_rate,
+                                     cacf->session_burst,
+                                     s->connection->log);
+            }
+
+            b[n++] = s->out_bucket;
+        }
+
+        if (cacf->out_bucket) {
+            b[n++] = cacf->out_bucket;
+        }
+    }
+
+    cmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_core_module);
+
+    if (cmcf->out_bucket) {
+        b[n++] = cmcf->out_bucket;
+    }
+
+    if (n == 0) {
+        return NGX_DECLINED;
+    }
+
+    *size = ngx_min(*size, NGX_RTMP_BUCKET_QUANTUM);
+
+    for (i = 0; i < n; i++) {
+
+        avail = 0;
+
+        if (s->out_throttling || ngx_queue_empty(&b[i]->waiting)) {
+            avail = ngx_rtmp_bucket_take(b[i], *size);
+        }
+
+        if (avail == 0) {
+            if (s->out_wait_bucket == NULL) {
+                ngx_queue_insert_tail(&b[i]->waiting, &s->out_wait);
+                s->out_wait_bucket = b[i];
+            }
+
+            if (!b[i]->event.timer_set) {
+                b[i]->event.handler = ngx_rtmp_bucket_wake;
+                ngx_add_timer(&b[i]->event,
+                              ngx_rtmp_bucket_delay(b[i], *size));
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                           "shape: wait rate=%uz size=%uz", b[i]->rate, *size);
+            return NGX_AGAIN;
+        }
+
+        *size = avail;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_shape_sent(ngx_rtmp_session_t *s, size_t size)
+{
+    ngx_rtmp_core_app_conf_t   *cacf;
+    ngx_rtmp_core_main_conf_t  *cmcf;
+
+    if (s->out_bucket) {
+        ngx_rtmp_bucket_consume(s->out_bucket, size, s->out_throttling);
+    }
+
+    if (s->app_conf) {
+        cacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_core_module);
+
+        if (cacf->out_bucket) {
+            ngx_rtmp_bucket_consume(cacf->out_bucket, size, s->out_throttling);
+        }
+    }
+
+    cmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_core_module);
+
+    if (cmcf->out_bucket) {
+        ngx_rtmp_bucket_consume(cmcf->out_bucket, size, s->out_throttling);
+    }
+
+    if (s->out_throttling) {
+        s->out_throttled += size;
+    }
+}
+
+
 static void
 ngx_rtmp_send(ngx_event_t *wev)
 {
     ngx_connection_t           *c;
     ngx_rtmp_session_t         *s;
-    ngx_int_t                   n;
+    ngx_int_t                   n, rc;
+    size_t                      size;
     ngx_rtmp_core_srv_conf_t   *cscf;
 
     c = wev->data;
@@ -518,8 +1043,25 @@ ngx_rtmp_send(ngx_event_t *wev)
         s->out_bpos = s->out_chain->buf->pos;
     }
 
+    rc = NGX_DECLINED;
+
     while (s->out_chain) {
-        n = c->send(c, s->out_bpos, s->out_chain->buf->last - s->out_bpos);
+        if (s->out_wait_bucket) {
+            return;
+        }
+
+        size = s->out_chain->buf->last - s->out_bpos;
+
+        rc = ngx_rtmp_shape(s, &size);
+
+        if (rc == NGX_AGAIN) {
+            if (wev->active) {
+                ngx_del_event(wev, NGX_WRITE_EVENT, 0);
+            }
+            return;
+        }
+
+        n = c->send(c, s->out_bpos, size);
 
         if (n == NGX_AGAIN || n == 0) {
             ngx_add_timer(c->write, s->timeout);
@@ -536,6 +1078,12 @@ ngx_rtmp_send(ngx_event_t *wev)
 
         s->out_bytes += n;
         s->ping_reset = 1;
+        if (s->out_time) {
+            s->out_size -= n;
+        }
+        if (rc == NGX_OK) {
+            ngx_rtmp_shape_sent(s, n);
+        }
         ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
         s->out_bpos += n;
         if (s->out_bpos == s->out_chain->buf->last) {
@@ -552,8 +1100,16 @@ ngx_rtmp_send(ngx_event_t *wev)
             }
             s->out_bpos = s->out_chain->buf->pos;
         }
+
+        if (rc == NGX_OK) {
+            /* yield to other shaped sessions after each quantum */
+            ngx_post_event(wev, &ngx_posted_events);
+            return;
+        }
     }
 
+    s->out_throttling = 0;
+
     if (wev->active) {
         ngx_del_event(wev, NGX_WRITE_EVENT, 0);
     }
@@ -706,11 +1262,112 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+static ngx_int_t
+ngx_rtmp_send_overflow(ngx_rtmp_session_t *s)
+{
+    ngx_msec_t                      lag;
+
+    if (s->out_pos == s->out_last) {
+        return NGX_OK;
+    }
+
+    lag = ngx_current_msec - s->out_time[s->out_pos];
+
+    if ((s->out_max_size == 0 || s->out_size < s->out_max_size)
+        && (s->out_max_lag == 0 || lag < s->out_max_lag))
+    {
+        return NGX_OK;
+    }
+
+    ++s->out_overflows;
+
+    if (s->out_policy == NGX_RTMP_OUT_RECONNECT
+        && !s->connection->destroyed)
+    {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                "output queue overflow, size=%uz lag=%M, closing",
+                s->out_size, lag);
+        ngx_rtmp_finalize_session(s);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * Messages chunked for another chunk size class are copied to buffers of
+ * session class. Single chunk messages are left as is: their payload fits
+ * into session chunk size as long as buffer class is not above session
+ * class. That holds since such messages are either allocated from the
+ * default class or prepared for the class of the receiving session.
+ */
+static ngx_chain_t *
+ngx_rtmp_rechunk_message(ngx_rtmp_session_t *s, ngx_chain_t *in)
+{
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_chain_t                    *out, *l, *cl, **ll;
+    u_char                         *p, *th;
+    size_t                          hsize, thsize, n;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    /* payload of shared buffers starts after reserved header space */
+    hsize = in->buf->start + NGX_RTMP_MAX_CHUNK_HEADER - in->buf->pos;
+    th = in->next->buf->pos;
+    thsize = in->next->buf->start + NGX_RTMP_MAX_CHUNK_HEADER - th;
+
+    out = NULL;
+    ll = &out;
+    l = NULL;
+
+    for (cl = in; cl; cl = cl->next) {
+        p = cl->buf->start + NGX_RTMP_MAX_CHUNK_HEADER;
+
+        while (p < cl->buf->last) {
+            if (l == NULL || l->buf->last == l->buf->end) {
+                l = ngx_rtmp_alloc_class_buf(cscf, s->out_chunk_class);
+                if (l == NULL) {
+                    if (out) {
+                        ngx_rtmp_free_shared_chain(cscf, out);
+                    }
+                    return NULL;
+                }
+
+                *ll = l;
+                ll = &l->next;
+            }
+
+            n = ngx_min((size_t) (l->buf->end - l->buf->last),
+                        (size_t) (cl->buf->last - p));
+
+            l->buf->last = ngx_cpymem(l->buf->last, p, n);
+            p += n;
+        }
+    }
+
+    out->buf->pos -= hsize;
+    ngx_memcpy(out->buf->pos, in->buf->pos, hsize);
+
+    for (l = out->next; l; l = l->next) {
+        l->buf->pos -= thsize;
+        ngx_memcpy(l->buf->pos, th, thsize);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+            "RTMP rechunk message class %ui -> %ui",
+            ngx_rtmp_shared_chain_class(cscf, in), s->out_chunk_class);
+
+    return out;
+}
+
+
 ngx_int_t
 ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         ngx_uint_t priority)
 {
     ngx_uint_t                      nmsg;
+    ngx_chain_t                    *cl, *rechunked;
+    ngx_rtmp_core_srv_conf_t       *cscf;
 
     nmsg = (s->out_last - s->out_pos) % s->out_queue + 1;
 
@@ -720,17 +1377,59 @@ ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
 
     /* drop packet?
      * Note we always leave 1 slot free */
-    if (nmsg + priority * s->out_queue / 4 >= s->out_queue) {
+    if (nmsg + priority * s->out_queue / 4 >= s->out_queue
+        || (s->out_time && ngx_rtmp_send_overflow(s) != NGX_OK))
+    {
         ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                 "RTMP drop message bufs=%ui, priority=%ui",
                 nmsg, priority);
+        ++s->out_dropped;
         return NGX_AGAIN;
     }
 
+    rechunked = NULL;
+
+    if (out->next) {
+        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+        if (ngx_rtmp_shared_chain_class(cscf, out) != s->out_chunk_class) {
+            rechunked = ngx_rtmp_rechunk_message(s, out);
+            if (rechunked == NULL) {
+                return NGX_ERROR;
+            }
+
+            out = rechunked;
+        }
+    }
+
+#if (NGX_DEBUG)
+    if (out->next == NULL) {
+        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+        if (ngx_rtmp_shared_chain_class(cscf, out) > s->out_chunk_class) {
+            ngx_log_error(NGX_LOG_ALERT, s->connection->log, 0,
+                    "single chunk message of class %ui sent to class %ui",
+                    ngx_rtmp_shared_chain_class(cscf, out),
+                    s->out_chunk_class);
+        }
+    }
+#endif
+
+    if (s->out_time) {
+        s->out_time[s->out_last] = ngx_current_msec;
+
+        for (cl = out; cl; cl = cl->next) {
+            s->out_size += cl->buf->last - cl->buf->pos;
+        }
+    }
+
     s->out[s->out_last++] = out;
     s->out_last %= s->out_queue;
 
-    ngx_rtmp_acquire_shared_chain(out);
+    /* rechunked copy is owned by the queue */
+    if (rechunked == NULL) {
+        ngx_rtmp_acquire_shared_chain(out);
+    }
 
     ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
             "RTMP send nmsg=%ui, priority=%ui #%ui",
@@ -757,6 +1456,24 @@ ngx_rtmp_receive_message(ngx_rtmp_session_t *s,
     ngx_array_t                *evhs;
     size_t                      n;
     ngx_rtmp_handler_pt        *evh;
+    ngx_rtmp_session_t         *ms;
+
+    if (h->msid && h->msid < s->nmux && s->mux[h->msid]) {
+
+        /* message stream owned by a multiplexed session */
+
+        ms = s->mux[h->msid];
+
+        if (ms->connection->destroyed) {
+            return NGX_OK;
+        }
+
+        if (ngx_rtmp_receive_message(ms, h, in) != NGX_OK) {
+            ngx_rtmp_finalize_session(ms);
+        }
+
+        return NGX_OK;
+    }
 
     cmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_core_module);
 
@@ -823,6 +1540,12 @@ ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size)
 
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
+    if (cscf->in_buffer && s->in_pool) {
+        /* blocks are sized on allocation, slices are never moved */
+        s->in_chunk_size = size;
+        return NGX_OK;
+    }
+
     s->in_old_pool = s->in_pool;
     s->in_chunk_size = size;
     s->in_pool = ngx_create_pool(size, s->connection->log);
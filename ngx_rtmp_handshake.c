@@ -89,19 +89,62 @@ ngx_rtmp_client_version[4] = {
 #define NGX_RTMP_HANDSHAKE_CLIENT_DONE              10
 
 
-static ngx_str_t            ngx_rtmp_server_full_key
-    = { sizeof(ngx_rtmp_server_key), ngx_rtmp_server_key };
-static ngx_str_t            ngx_rtmp_server_partial_key
-    = { 36, ngx_rtmp_server_key };
+typedef struct {
+    ngx_str_t               key;
+    HMAC_CTX               *hmac;   /* keyed state, NULL if not cached */
+} ngx_rtmp_handshake_key_t;
 
-static ngx_str_t            ngx_rtmp_client_full_key
-    = { sizeof(ngx_rtmp_client_key), ngx_rtmp_client_key };
-static ngx_str_t            ngx_rtmp_client_partial_key
-    = { 30, ngx_rtmp_client_key };
+
+static ngx_rtmp_handshake_key_t ngx_rtmp_server_full_key
+    = { { sizeof(ngx_rtmp_server_key), ngx_rtmp_server_key }, NULL };
+static ngx_rtmp_handshake_key_t ngx_rtmp_server_partial_key
+    = { { 36, ngx_rtmp_server_key }, NULL };
+
+static ngx_rtmp_handshake_key_t ngx_rtmp_client_full_key
+    = { { sizeof(ngx_rtmp_client_key), ngx_rtmp_client_key }, NULL };
+static ngx_rtmp_handshake_key_t ngx_rtmp_client_partial_key
+    = { { 30, ngx_rtmp_client_key }, NULL };
+
+
+static ngx_rtmp_handshake_key_t *ngx_rtmp_handshake_keys[] = {
+    &ngx_rtmp_server_full_key,
+    &ngx_rtmp_server_partial_key,
+    &ngx_rtmp_client_full_key,
+    &ngx_rtmp_client_partial_key
+};
+
+
+/* digest offset bases of both schemes; the one matched last goes first */
+static size_t               ngx_rtmp_digest_base[] = { 772, 8 };
+static ngx_uint_t           ngx_rtmp_digest_hint;
+
+
+static void
+ngx_rtmp_init_handshake_keys(void)
+{
+    ngx_uint_t                  n;
+    ngx_rtmp_handshake_key_t   *k;
+    static HMAC_CTX             hmac[sizeof(ngx_rtmp_handshake_keys)
+                                     / sizeof(ngx_rtmp_handshake_keys[0])];
+
+    /*
+     * Keys are fixed; hashing key pads once and copying the keyed
+     * state later saves two SHA256 blocks per digest
+     */
+
+    for (n = 0; n < sizeof(hmac) / sizeof(hmac[0]); ++n) {
+        k = ngx_rtmp_handshake_keys[n];
+
+        HMAC_CTX_init(&hmac[n]);
+        HMAC_Init_ex(&hmac[n], k->key.data, k->key.len, EVP_sha256(), NULL);
+
+        k->hmac = &hmac[n];
+    }
+}
 
 
 static ngx_int_t
-ngx_rtmp_make_digest(ngx_str_t *key, ngx_buf_t *src,
+ngx_rtmp_make_digest(ngx_rtmp_handshake_key_t *key, ngx_buf_t *src,
         u_char *skip, u_char *dst, ngx_log_t *log)
 {
     static HMAC_CTX         hmac;
@@ -110,10 +153,25 @@ ngx_rtmp_make_digest(ngx_str_t *key, ngx_buf_t *src,
 
     if (!hmac_initialized) {
         HMAC_CTX_init(&hmac);
+        ngx_rtmp_init_handshake_keys();
         hmac_initialized = 1;
     }
 
-    HMAC_Init_ex(&hmac, key->data, key->len, EVP_sha256(), NULL);
+    if (key->hmac) {
+
+        /* copy re-initializes digest states of destination, free them */
+
+        HMAC_CTX_cleanup(&hmac);
+
+        if (!HMAC_CTX_copy(&hmac, key->hmac)) {
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                          "handshake: HMAC_CTX_copy() failed");
+            return NGX_ERROR;
+        }
+
+    } else {
+        HMAC_Init_ex(&hmac, key->key.data, key->key.len, EVP_sha256(), NULL);
+    }
 
     if (skip && src->pos <= skip && skip <= src->last) {
         if (skip != src->pos) {
@@ -134,7 +192,8 @@ ngx_rtmp_make_digest(ngx_str_t *key, ngx_buf_t *src,
 
 
 static ngx_int_t
-ngx_rtmp_find_digest(ngx_buf_t *b, ngx_str_t *key, size_t base, ngx_log_t *log)
+ngx_rtmp_find_digest(ngx_buf_t *b, ngx_rtmp_handshake_key_t *key, size_t base,
+        ngx_log_t *log)
 {
     size_t                  n, offs;
     u_char                  digest[NGX_RTMP_HANDSHAKE_KEYLEN];
@@ -160,8 +219,8 @@ ngx_rtmp_find_digest(ngx_buf_t *b, ngx_str_t *key, size_t base, ngx_log_t *log)
 
 
 static ngx_int_t
-ngx_rtmp_write_digest(ngx_buf_t *b, ngx_str_t *key, size_t base,
-        ngx_log_t *log)
+ngx_rtmp_write_digest(ngx_buf_t *b, ngx_rtmp_handshake_key_t *key,
+        size_t base, ngx_log_t *log)
 {
     size_t                  n, offs;
     u_char                 *p;
@@ -184,8 +243,17 @@ ngx_rtmp_write_digest(ngx_buf_t *b, ngx_str_t *key, size_t base,
 static void
 ngx_rtmp_fill_random_buffer(ngx_buf_t *b)
 {
+    uint32_t    r;
+
+    /* padding needs no strong randomness; take 4 bytes per call */
+
+    while (b->end - b->last >= 4) {
+        r = (uint32_t) ngx_random();
+        b->last = ngx_cpymem(b->last, &r, 4);
+    }
+
     for (; b->last != b->end; ++b->last) {
-        *b->last = (u_char) rand();
+        *b->last = (u_char) ngx_random();
     }
 }
 
@@ -194,30 +262,29 @@ static ngx_buf_t *
 ngx_rtmp_alloc_handshake_buffer(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_core_srv_conf_t   *cscf;
-    ngx_chain_t                *cl;
     ngx_buf_t                  *b;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-            "handshake: allocating buffer");
-
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
+    /* free buffers are linked through shadow pointer */
+
     if (cscf->free_hs) {
-        cl = cscf->free_hs;
-        b = cl->buf;
-        cscf->free_hs = cl->next;
-        ngx_free_chain(cscf->pool, cl);
+        b = cscf->free_hs;
+        cscf->free_hs = b->shadow;
+        b->shadow = NULL;
 
     } else {
-        b = ngx_pcalloc(cscf->pool, sizeof(ngx_buf_t));
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "handshake: allocating buffer");
+
+        b = ngx_palloc(cscf->pool, sizeof(ngx_buf_t)
+                                   + NGX_RTMP_HANDSHAKE_BUFSIZE);
         if (b == NULL) {
             return NULL;
         }
+        ngx_memzero(b, sizeof(ngx_buf_t));
         b->memory = 1;
-        b->start = ngx_pcalloc(cscf->pool, NGX_RTMP_HANDSHAKE_BUFSIZE);
-        if (b->start == NULL) {
-            return NULL;
-        }
+        b->start = (u_char *) (b + 1);
         b->end = b->start + NGX_RTMP_HANDSHAKE_BUFSIZE;
     }
 
@@ -231,26 +298,20 @@ void
 ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_core_srv_conf_t   *cscf;
-    ngx_chain_t                *cl;
 
     if (s->hs_buf == NULL) {
         return;
     }
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-    cl = ngx_alloc_chain_link(cscf->pool);
-    if (cl == NULL) {
-        return;
-    }
-    cl->buf = s->hs_buf;
-    cl->next = cscf->free_hs;
-    cscf->free_hs = cl;
+    s->hs_buf->shadow = cscf->free_hs;
+    cscf->free_hs = s->hs_buf;
     s->hs_buf = NULL;
 }
 
 
 static ngx_int_t
 ngx_rtmp_handshake_create_challenge(ngx_rtmp_session_t *s,
-        const u_char version[4], ngx_str_t *key)
+        const u_char version[4], ngx_rtmp_handshake_key_t *key)
 {
     ngx_buf_t          *b;
 
@@ -271,11 +332,12 @@ ngx_rtmp_handshake_create_challenge(ngx_rtmp_session_t *s,
 
 static ngx_int_t
 ngx_rtmp_handshake_parse_challenge(ngx_rtmp_session_t *s,
-        ngx_str_t *peer_key, ngx_str_t *key)
+        ngx_rtmp_handshake_key_t *peer_key, ngx_rtmp_handshake_key_t *key)
 {
     ngx_buf_t              *b;
     u_char                 *p;
     ngx_int_t               offs;
+    ngx_uint_t              hint;
 
     b = s->hs_buf;
     if (*b->pos != '\x03') {
@@ -299,9 +361,19 @@ ngx_rtmp_handshake_parse_challenge(ngx_rtmp_session_t *s,
         return NGX_OK;
     }
 
-    offs = ngx_rtmp_find_digest(b, peer_key, 772, s->connection->log);
+    /* reconnecting clients are mostly of one kind; avoid double digests */
+
+    hint = ngx_rtmp_digest_hint;
+
+    offs = ngx_rtmp_find_digest(b, peer_key, ngx_rtmp_digest_base[hint],
+                                s->connection->log);
     if (offs == NGX_ERROR) {
-        offs = ngx_rtmp_find_digest(b, peer_key, 8, s->connection->log);
+        offs = ngx_rtmp_find_digest(b, peer_key,
+                                    ngx_rtmp_digest_base[hint ^ 1],
+                                    s->connection->log);
+        if (offs != NGX_ERROR) {
+            ngx_rtmp_digest_hint = hint ^ 1;
+        }
     }
     if (offs == NGX_ERROR) {
         ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
@@ -314,6 +386,9 @@ ngx_rtmp_handshake_parse_challenge(ngx_rtmp_session_t *s,
     b->pos += offs;
     b->last = b->pos + NGX_RTMP_HANDSHAKE_KEYLEN;
     s->hs_digest = ngx_palloc(s->connection->pool, NGX_RTMP_HANDSHAKE_KEYLEN);
+    if (s->hs_digest == NULL) {
+        return NGX_ERROR;
+    }
     if (ngx_rtmp_make_digest(key, b, NULL, s->hs_digest, s->connection->log)
             != NGX_OK)
     {
@@ -326,17 +401,18 @@ ngx_rtmp_handshake_parse_challenge(ngx_rtmp_session_t *s,
 static ngx_int_t
 ngx_rtmp_handshake_create_response(ngx_rtmp_session_t *s)
 {
-    ngx_buf_t          *b;
-    u_char             *p;
-    ngx_str_t           key;
+    ngx_buf_t                  *b;
+    u_char                     *p;
+    ngx_rtmp_handshake_key_t    key;
 
     b = s->hs_buf;
     b->pos = b->last = b->start + 1;
     ngx_rtmp_fill_random_buffer(b);
     if (s->hs_digest) {
         p = b->last - NGX_RTMP_HANDSHAKE_KEYLEN;
-        key.data = s->hs_digest;
-        key.len = NGX_RTMP_HANDSHAKE_KEYLEN;
+        key.key.data = s->hs_digest;
+        key.key.len = NGX_RTMP_HANDSHAKE_KEYLEN;
+        key.hmac = NULL;
         if (ngx_rtmp_make_digest(&key, b, p, p, s->connection->log) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -575,6 +651,14 @@ ngx_rtmp_handshake(ngx_rtmp_session_t *s)
     ngx_connection_t           *c;
 
     c = s->connection;
+
+    /* TLS goes first; ngx_rtmp_ssl_handshake() gets back here */
+
+    if (s->ssl && c->ssl == NULL) {
+        ngx_rtmp_ssl_handshake(s);
+        return;
+    }
+
     c->read->handler =  ngx_rtmp_handshake_recv;
     c->write->handler = ngx_rtmp_handshake_send;
 
@@ -582,6 +666,10 @@ ngx_rtmp_handshake(ngx_rtmp_session_t *s)
             "handshake: start server handshake");
 
     s->hs_buf = ngx_rtmp_alloc_handshake_buffer(s);
+    if (s->hs_buf == NULL) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
     s->hs_stage = NGX_RTMP_HANDSHAKE_SERVER_RECV_CHALLENGE;
 
     ngx_rtmp_handshake_recv(c->read);
@@ -601,6 +689,10 @@ ngx_rtmp_client_handshake(ngx_rtmp_session_t *s, unsigned async)
             "handshake: start client handshake");
 
     s->hs_buf = ngx_rtmp_alloc_handshake_buffer(s);
+    if (s->hs_buf == NULL) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
     s->hs_stage = NGX_RTMP_HANDSHAKE_CLIENT_SEND_CHALLENGE;
 
     if (ngx_rtmp_handshake_create_challenge(s,
@@ -11,6 +11,8 @@
 
 
 static void ngx_rtmp_close_connection(ngx_connection_t *c);
+static ssize_t ngx_rtmp_virtual_send(ngx_connection_t *c, u_char *buf,
+       size_t size);
 static u_char * ngx_rtmp_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 
@@ -130,6 +132,7 @@ ngx_rtmp_init_connection(ngx_connection_t *c)
      * done through unix socket */
 
     s->auto_pushed = unix_socket;
+    s->ssl = addr_conf->ssl;
 
     if (addr_conf->proxy_protocol) {
         ngx_rtmp_proxy_protocol(s);
@@ -216,6 +219,96 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
 }
 
 
+/*
+ * Virtual session has no socket of its own. Media is fed to it with
+ * ngx_rtmp_receive_message() by its owner, anything sent is discarded.
+ */
+
+ngx_rtmp_session_t *
+ngx_rtmp_init_virtual_session(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t *addr_text,
+    ngx_log_t *log)
+{
+    ngx_pool_t                     *pool;
+    ngx_log_t                      *vlog;
+    ngx_event_t                    *rev, *wev;
+    ngx_connection_t               *c;
+    ngx_rtmp_session_t             *s;
+    ngx_rtmp_conf_ctx_t            *addr_ctx;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+
+    pool = ngx_create_pool(4096, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    vlog = ngx_palloc(pool, sizeof(ngx_log_t));
+    c = ngx_pcalloc(pool, sizeof(ngx_connection_t));
+    rev = ngx_pcalloc(pool, sizeof(ngx_event_t));
+    wev = ngx_pcalloc(pool, sizeof(ngx_event_t));
+    addr_conf = ngx_pcalloc(pool, sizeof(ngx_rtmp_addr_conf_t));
+    addr_ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_conf_ctx_t));
+
+    if (vlog == NULL || c == NULL || rev == NULL || wev == NULL
+        || addr_conf == NULL || addr_ctx == NULL)
+    {
+        goto failed;
+    }
+
+    /* copy log to keep shared log unchanged */
+    *vlog = *log;
+
+    rev->data = c;
+    rev->log = vlog;
+
+    wev->data = c;
+    wev->log = vlog;
+    wev->write = 1;
+    wev->ready = 1;
+
+    c->fd = (ngx_socket_t) -1;
+    c->pool = pool;
+    c->log = vlog;
+    c->read = rev;
+    c->write = wev;
+    c->send = ngx_rtmp_virtual_send;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    c->addr_text.len = addr_text->len;
+    c->addr_text.data = ngx_pstrdup(pool, addr_text);
+    if (c->addr_text.data == NULL) {
+        goto failed;
+    }
+
+    addr_conf->ctx = addr_ctx;
+    addr_ctx->main_conf = cctx->main_conf;
+    addr_ctx->srv_conf = cctx->srv_conf;
+    ngx_str_set(&addr_conf->addr_text, "ngx-relay");
+
+    s = ngx_rtmp_init_session(c, addr_conf);
+    if (s == NULL) {
+        /* no need to destroy pool */
+        return NULL;
+    }
+
+    s->app_conf = cctx->app_conf;
+
+    return s;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static ssize_t
+ngx_rtmp_virtual_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    return size;
+}
+
+
 static u_char *
 ngx_rtmp_log_error(ngx_log_t *log, u_char *buf, size_t len)
 {
@@ -256,12 +349,28 @@ ngx_rtmp_close_connection(ngx_connection_t *c)
 
     ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0, "close connection");
 
+    pool = c->pool;
+
+    /* virtual session has no socket of its own */
+
+    if (c->fd != (ngx_socket_t) -1) {
+
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+
+            if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+                c->ssl->handler = ngx_rtmp_close_connection;
+                return;
+            }
+        }
+
 #if (NGX_STAT_STUB)
-    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+        (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
 #endif
 
-    pool = c->pool;
-    ngx_close_connection(c);
+        ngx_close_connection(c);
+    }
+
     ngx_destroy_pool(pool);
 }
 
@@ -286,6 +395,15 @@ ngx_rtmp_close_session_handler(ngx_event_t *e)
         ngx_del_timer(&s->ping_evt);
     }
 
+    if (s->out_wait_bucket) {
+        ngx_queue_remove(&s->out_wait);
+        s->out_wait_bucket = NULL;
+    }
+
+    if (s->out_bucket && s->out_bucket->event.timer_set) {
+        ngx_del_timer(&s->out_bucket->event);
+    }
+
     if (s->in_old_pool) {
         ngx_destroy_pool(s->in_old_pool);
     }
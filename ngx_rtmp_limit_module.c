@@ -7,19 +7,62 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+
+
+#define NGX_RTMP_LIMIT_ADDR     0
+#define NGX_RTMP_LIMIT_STREAM   1
 
 
 typedef struct {
     ngx_int_t       max_conn;
+    ngx_int_t       max_addr_conn;
+    ngx_int_t       addr_rate;      /* per second */
+    ngx_int_t       addr_burst;
+    ngx_int_t       max_viewers;
+    size_t          zone_size;
     ngx_shm_zone_t *shm_zone;
 } ngx_rtmp_limit_main_conf_t;
 
 
+/* keyed counter, follows ngx_rbtree_node_t up to color */
+typedef struct {
+    u_char          color;
+    u_char          type;
+    u_short         len;
+    ngx_queue_t     queue;
+    uint32_t        conn;
+    ngx_msec_t      last;
+    ngx_uint_t      excess;         /* rate excess * 1000 */
+    u_char          data[1];
+} ngx_rtmp_limit_node_t;
+
+
+typedef struct {
+    ngx_atomic_t    nconn;
+    ngx_rbtree_t    rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t     queue;          /* idle address nodes, LRU */
+} ngx_rtmp_limit_shctx_t;
+
+
+typedef struct {
+    ngx_rtmp_limit_node_t  *addr;
+    ngx_rtmp_limit_node_t  *stream;
+} ngx_rtmp_limit_ctx_t;
+
+
 static ngx_str_t    shm_name = ngx_string("rtmp_limit");
 
 
+static ngx_rtmp_play_pt             next_play;
+static ngx_rtmp_close_stream_pt     next_close_stream;
+
+
 static ngx_int_t ngx_rtmp_limit_postconfiguration(ngx_conf_t *cf);
 static void *ngx_rtmp_limit_create_main_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
 
 
 static ngx_command_t  ngx_rtmp_limit_commands[] = {
@@ -31,6 +74,34 @@ static ngx_command_t  ngx_rtmp_limit_commands[] = {
       offsetof(ngx_rtmp_limit_main_conf_t, max_conn),
       NULL },
 
+    { ngx_string("max_connections_per_ip"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_limit_main_conf_t, max_addr_conn),
+      NULL },
+
+    { ngx_string("connection_rate_per_ip"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_limit_rate,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("max_viewers_per_stream"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_limit_main_conf_t, max_viewers),
+      NULL },
+
+    { ngx_string("limit_zone_size"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_limit_main_conf_t, zone_size),
+      NULL },
+
       ngx_null_command
 };
 
@@ -74,46 +145,399 @@ ngx_rtmp_limit_create_main_conf(ngx_conf_t *cf)
     }
 
     lmcf->max_conn = NGX_CONF_UNSET;
+    lmcf->max_addr_conn = NGX_CONF_UNSET;
+    lmcf->addr_rate = NGX_CONF_UNSET;
+    lmcf->addr_burst = NGX_CONF_UNSET;
+    lmcf->max_viewers = NGX_CONF_UNSET;
+    lmcf->zone_size = NGX_CONF_UNSET_SIZE;
 
     return lmcf;
 }
 
 
+static ngx_rtmp_limit_node_t *
+ngx_rtmp_limit_lookup(ngx_rtmp_limit_shctx_t *sh, ngx_uint_t type,
+    u_char *data, size_t len, uint32_t hash)
+{
+    ngx_int_t               rc;
+    ngx_rbtree_node_t      *node, *sentinel;
+    ngx_rtmp_limit_node_t  *ln;
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        ln = (ngx_rtmp_limit_node_t *) &node->color;
+
+        rc = (ngx_int_t) ln->type - (ngx_int_t) type;
+
+        if (rc == 0) {
+            rc = ngx_memn2cmp(data, ln->data, len, (size_t) ln->len);
+        }
+
+        if (rc == 0) {
+            return ln;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_limit_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_int_t               rc;
+    ngx_rbtree_node_t     **p;
+    ngx_rtmp_limit_node_t  *ln, *lnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ln = (ngx_rtmp_limit_node_t *) &node->color;
+            lnt = (ngx_rtmp_limit_node_t *) &temp->color;
+
+            rc = (ngx_int_t) ln->type - (ngx_int_t) lnt->type;
+
+            if (rc == 0) {
+                rc = ngx_memn2cmp(ln->data, lnt->data, ln->len, lnt->len);
+            }
+
+            p = (rc < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_uint_t
+ngx_rtmp_limit_excess(ngx_rtmp_limit_main_conf_t *lmcf,
+    ngx_rtmp_limit_node_t *ln, ngx_msec_t now)
+{
+    ngx_msec_int_t  ms, excess;
+
+    ms = (ngx_msec_int_t) (now - ln->last);
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    excess = (ngx_msec_int_t) ln->excess - lmcf->addr_rate * ms;
+
+    return excess < 0 ? 0 : (ngx_uint_t) excess;
+}
+
+
+static void
+ngx_rtmp_limit_free(ngx_slab_pool_t *shpool, ngx_rtmp_limit_shctx_t *sh,
+    ngx_rtmp_limit_node_t *ln)
+{
+    ngx_rbtree_node_t  *node;
+
+    node = (ngx_rbtree_node_t *)
+           ((u_char *) ln - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_rbtree_delete(&sh->rbtree, node);
+    ngx_slab_free_locked(shpool, node);
+}
+
+
+/* drop a few idle address nodes which have no rate state left */
+static void
+ngx_rtmp_limit_expire(ngx_rtmp_limit_main_conf_t *lmcf,
+    ngx_slab_pool_t *shpool, ngx_rtmp_limit_shctx_t *sh, ngx_uint_t n)
+{
+    ngx_msec_t              now;
+    ngx_queue_t            *q;
+    ngx_rtmp_limit_node_t  *ln;
+
+    now = ngx_current_msec;
+
+    while (n-- && !ngx_queue_empty(&sh->queue)) {
+
+        q = ngx_queue_last(&sh->queue);
+        ln = ngx_queue_data(q, ngx_rtmp_limit_node_t, queue);
+
+        if (lmcf->addr_rate != NGX_CONF_UNSET
+            && ngx_rtmp_limit_excess(lmcf, ln, now))
+        {
+            return;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rtmp_limit_free(shpool, sh, ln);
+    }
+}
+
+
+static ngx_rtmp_limit_node_t *
+ngx_rtmp_limit_get(ngx_rtmp_limit_main_conf_t *lmcf, ngx_uint_t type,
+    u_char *data, size_t len)
+{
+    size_t                   size;
+    uint32_t                 hash;
+    ngx_slab_pool_t         *shpool;
+    ngx_rbtree_node_t       *node;
+    ngx_rtmp_limit_node_t   *ln;
+    ngx_rtmp_limit_shctx_t  *sh;
+
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
+    sh = lmcf->shm_zone->data;
+
+    hash = ngx_crc32_short(data, len);
+
+    ln = ngx_rtmp_limit_lookup(sh, type, data, len, hash);
+
+    if (ln) {
+        if (ln->conn == 0 && type == NGX_RTMP_LIMIT_ADDR) {
+            ngx_queue_remove(&ln->queue);
+        }
+
+        return ln;
+    }
+
+    ngx_rtmp_limit_expire(lmcf, shpool, sh, 2);
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_rtmp_limit_node_t, data)
+           + len;
+
+    node = ngx_slab_alloc_locked(shpool, size);
+
+    if (node == NULL) {
+        ngx_rtmp_limit_expire(lmcf, shpool, sh, (ngx_uint_t) -1);
+
+        node = ngx_slab_alloc_locked(shpool, size);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    node->key = hash;
+
+    ln = (ngx_rtmp_limit_node_t *) &node->color;
+
+    ln->type = (u_char) type;
+    ln->len = (u_short) len;
+    ln->conn = 0;
+    ln->last = ngx_current_msec;
+    ln->excess = 0;
+    ngx_memcpy(ln->data, data, len);
+
+    ngx_rbtree_insert(&sh->rbtree, node);
+
+    return ln;
+}
+
+
+static void
+ngx_rtmp_limit_put(ngx_rtmp_limit_main_conf_t *lmcf,
+    ngx_rtmp_limit_node_t *ln)
+{
+    ngx_slab_pool_t         *shpool;
+    ngx_rtmp_limit_shctx_t  *sh;
+
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
+    sh = lmcf->shm_zone->data;
+
+    if (ln->conn) {
+        return;
+    }
+
+    /* address nodes keep rate state after last connection is gone */
+
+    if (ln->type == NGX_RTMP_LIMIT_ADDR && lmcf->addr_rate != NGX_CONF_UNSET) {
+        ngx_queue_insert_head(&sh->queue, &ln->queue);
+        return;
+    }
+
+    ngx_rtmp_limit_free(shpool, sh, ln);
+}
+
+
+static ngx_int_t
+ngx_rtmp_limit_addr(ngx_rtmp_session_t *s, ngx_rtmp_limit_main_conf_t *lmcf)
+{
+    u_char                 *data;
+    size_t                  len;
+    ngx_int_t               rc;
+    ngx_uint_t              excess;
+    ngx_slab_pool_t        *shpool;
+    struct sockaddr_in     *sin;
+    ngx_rtmp_limit_ctx_t   *ctx;
+    ngx_rtmp_limit_node_t  *ln;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6    *sin6;
+#endif
+
+    /* relay etc */
+    if (s->connection->sockaddr == NULL || s->connection->listening == NULL) {
+        return NGX_OK;
+    }
+
+    switch (s->connection->sockaddr->sa_family) {
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) s->connection->sockaddr;
+        data = (u_char *) &sin->sin_addr.s_addr;
+        len = sizeof(in_addr_t);
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) s->connection->sockaddr;
+        data = sin6->sin6_addr.s6_addr;
+        len = 16;
+        break;
+#endif
+
+    default:
+        return NGX_OK;
+    }
+
+    ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_limit_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_limit_module);
+
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ln = ngx_rtmp_limit_get(lmcf, NGX_RTMP_LIMIT_ADDR, data, len);
+
+    if (ln == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "limit: zone is full");
+        return NGX_ERROR;
+    }
+
+    rc = NGX_OK;
+    excess = 0;
+
+    if (lmcf->addr_rate != NGX_CONF_UNSET) {
+        excess = ngx_rtmp_limit_excess(lmcf, ln, ngx_current_msec) + 1000;
+
+        if (excess > (ngx_uint_t) lmcf->addr_burst * 1000 + 1000) {
+            rc = NGX_DECLINED;
+        }
+    }
+
+    if (rc == NGX_OK && lmcf->max_addr_conn != NGX_CONF_UNSET
+        && ln->conn >= (ngx_uint_t) lmcf->max_addr_conn)
+    {
+        rc = NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        if (lmcf->addr_rate != NGX_CONF_UNSET) {
+            ln->excess = excess;
+            ln->last = ngx_current_msec;
+        }
+
+        ln->conn++;
+        ctx->addr = ln;
+
+    } else {
+        ngx_rtmp_limit_put(lmcf, ln);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "limit: connection rate exceeded for %V",
+                      &s->connection->addr_text);
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "limit: too many connections from %V: %i",
+                      &s->connection->addr_text, lmcf->max_addr_conn);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_limit_connect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
     ngx_rtmp_limit_main_conf_t *lmcf;
-    ngx_slab_pool_t            *shpool;
-    ngx_shm_zone_t             *shm_zone;
-    uint32_t                   *nconn, n;
-    ngx_int_t                   rc;
+    ngx_rtmp_limit_shctx_t     *sh;
+    ngx_atomic_uint_t           n;
 
     lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
-    if (lmcf->max_conn == NGX_CONF_UNSET) {
+    if (lmcf->shm_zone == NULL) {
         return NGX_OK;
     }
 
-    shm_zone = lmcf->shm_zone;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-    nconn = shm_zone->data;
+    sh = lmcf->shm_zone->data;
 
-    ngx_shmtx_lock(&shpool->mutex);
-    n = ++*nconn;
-    ngx_shmtx_unlock(&shpool->mutex);
+    if (lmcf->max_conn != NGX_CONF_UNSET) {
 
-    rc = n > (ngx_uint_t) lmcf->max_conn ? NGX_ERROR : NGX_OK;
+        /* plain counter needs no zone lock */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "limit: inc conection counter: %uD", n);
+        n = ngx_atomic_fetch_add(&sh->nconn, 1) + 1;
 
-    if (rc != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "limit: too many connections: %uD > %i",
-                      n, lmcf->max_conn);
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "limit: inc conection counter: %uA", n);
+
+        if (n > (ngx_atomic_uint_t) lmcf->max_conn) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "limit: too many connections: %uA > %i",
+                          n, lmcf->max_conn);
+            return NGX_ERROR;
+        }
     }
 
-    return rc;
+    if (lmcf->max_addr_conn == NGX_CONF_UNSET
+        && lmcf->addr_rate == NGX_CONF_UNSET)
+    {
+        return NGX_OK;
+    }
+
+    return ngx_rtmp_limit_addr(s, lmcf);
 }
 
 
@@ -122,36 +546,198 @@ ngx_rtmp_limit_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
     ngx_rtmp_limit_main_conf_t *lmcf;
+    ngx_rtmp_limit_shctx_t     *sh;
+    ngx_rtmp_limit_ctx_t       *ctx;
     ngx_slab_pool_t            *shpool;
-    ngx_shm_zone_t             *shm_zone;
-    uint32_t                   *nconn, n;
+    ngx_atomic_uint_t           n;
 
     lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
-    if (lmcf->max_conn == NGX_CONF_UNSET) {
+    if (lmcf->shm_zone == NULL) {
         return NGX_OK;
     }
 
-    shm_zone = lmcf->shm_zone;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-    nconn = shm_zone->data;
+    sh = lmcf->shm_zone->data;
+
+    if (lmcf->max_conn != NGX_CONF_UNSET) {
+        n = ngx_atomic_fetch_add(&sh->nconn, -1) - 1;
+
+        (void) n;
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "limit: dec conection counter: %uA", n);
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_limit_module);
+    if (ctx == NULL || ctx->addr == NULL) {
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
 
     ngx_shmtx_lock(&shpool->mutex);
-    n = --*nconn;
+
+    ctx->addr->conn--;
+    ngx_rtmp_limit_put(lmcf, ctx->addr);
+
     ngx_shmtx_unlock(&shpool->mutex);
 
-    (void) n;
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "limit: dec conection counter: %uD", n);
+    ctx->addr = NULL;
 
     return NGX_OK;
 }
 
 
+static void
+ngx_rtmp_limit_stream_done(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_limit_main_conf_t *lmcf;
+    ngx_rtmp_limit_ctx_t       *ctx;
+    ngx_slab_pool_t            *shpool;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_limit_module);
+    if (ctx == NULL || ctx->stream == NULL) {
+        return;
+    }
+
+    lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ctx->stream->conn--;
+    ngx_rtmp_limit_put(lmcf, ctx->stream);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ctx->stream = NULL;
+}
+
+
+static ngx_int_t
+ngx_rtmp_limit_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    u_char                     *p;
+    size_t                      len;
+    ngx_int_t                   rc;
+    ngx_slab_pool_t            *shpool;
+    ngx_rtmp_limit_ctx_t       *ctx;
+    ngx_rtmp_limit_node_t      *ln;
+    ngx_rtmp_limit_main_conf_t *lmcf;
+    u_char                      key[NGX_RTMP_MAX_NAME * 2];
+
+    lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
+
+    if (lmcf->max_viewers == NGX_CONF_UNSET || s->relay || s->auto_pushed) {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_limit_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_limit_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_limit_module);
+    }
+
+    ngx_rtmp_limit_stream_done(s);
+
+    p = ngx_snprintf(key, sizeof(key), "%V/%s", &s->app, v->name);
+    len = p - key;
+
+    shpool = (ngx_slab_pool_t *) lmcf->shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ln = ngx_rtmp_limit_get(lmcf, NGX_RTMP_LIMIT_STREAM, key, len);
+
+    if (ln == NULL) {
+        rc = NGX_DECLINED;
+
+    } else if (ln->conn >= (ngx_uint_t) lmcf->max_viewers) {
+        rc = NGX_ERROR;
+
+    } else {
+        rc = NGX_OK;
+        ln->conn++;
+        ctx->stream = ln;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "limit: zone is full");
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "limit: too many viewers of '%*s': %i",
+                      len, key, lmcf->max_viewers);
+        return NGX_ERROR;
+    }
+
+next:
+    return next_play(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_limit_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
+{
+    ngx_rtmp_limit_stream_done(s);
+
+    return next_close_stream(s, v);
+}
+
+
+static char *
+ngx_rtmp_limit_rate(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_limit_main_conf_t *lmcf = conf;
+
+    ngx_str_t                  *value;
+
+    value = cf->args->elts;
+
+    if (lmcf->addr_rate != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    lmcf->addr_rate = ngx_atoi(value[1].data, value[1].len);
+    if (lmcf->addr_rate == NGX_ERROR || lmcf->addr_rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rate \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lmcf->addr_burst = 0;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "burst=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        lmcf->addr_burst = ngx_atoi(value[2].data + 6, value[2].len - 6);
+        if (lmcf->addr_burst == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid burst \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_limit_shm_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_slab_pool_t    *shpool;
-    uint32_t           *nconn;
+    ngx_slab_pool_t         *shpool;
+    ngx_rtmp_limit_shctx_t  *sh;
 
     if (data) {
         shm_zone->data = data;
@@ -160,14 +746,19 @@ ngx_rtmp_limit_shm_init(ngx_shm_zone_t *shm_zone, void *data)
 
     shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    nconn = ngx_slab_alloc(shpool, 4);
-    if (nconn == NULL) {
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_rtmp_limit_shctx_t));
+    if (sh == NULL) {
         return NGX_ERROR;
     }
 
-    *nconn = 0;
+    sh->nconn = 0;
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                    ngx_rtmp_limit_rbtree_insert_value);
 
-    shm_zone->data = nconn;
+    ngx_queue_init(&sh->queue);
+
+    shm_zone->data = sh;
 
     return NGX_OK;
 }
@@ -179,6 +770,7 @@ ngx_rtmp_limit_postconfiguration(ngx_conf_t *cf)
     ngx_rtmp_core_main_conf_t  *cmcf;
     ngx_rtmp_limit_main_conf_t *lmcf;
     ngx_rtmp_handler_pt        *h;
+    size_t                      size;
 
     cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
 
@@ -188,12 +780,34 @@ ngx_rtmp_limit_postconfiguration(ngx_conf_t *cf)
     h = ngx_array_push(&cmcf->events[NGX_RTMP_DISCONNECT]);
     *h = ngx_rtmp_limit_disconnect;
 
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_limit_play;
+
+    next_close_stream = ngx_rtmp_close_stream;
+    ngx_rtmp_close_stream = ngx_rtmp_limit_close_stream;
+
     lmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_limit_module);
-    if (lmcf->max_conn == NGX_CONF_UNSET) {
-        return NGX_OK;
+
+    if (lmcf->max_addr_conn == NGX_CONF_UNSET
+        && lmcf->addr_rate == NGX_CONF_UNSET
+        && lmcf->max_viewers == NGX_CONF_UNSET)
+    {
+        if (lmcf->max_conn == NGX_CONF_UNSET) {
+            return NGX_OK;
+        }
+
+        size = ngx_pagesize * 2;
+
+    } else {
+        size = (lmcf->zone_size == NGX_CONF_UNSET_SIZE ? 1024 * 1024 :
+                lmcf->zone_size);
+
+        if (size < ngx_pagesize * 8) {
+            size = ngx_pagesize * 8;
+        }
     }
 
-    lmcf->shm_zone = ngx_shared_memory_add(cf, &shm_name, ngx_pagesize * 2,
+    lmcf->shm_zone = ngx_shared_memory_add(cf, &shm_name, size,
                                            &ngx_rtmp_limit_module);
     if (lmcf->shm_zone == NULL) {
         return NGX_ERROR;
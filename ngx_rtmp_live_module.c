@@ -601,11 +601,21 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
         }
     }
 
-    if (ctx->publishing || ctx->stream->active) {
+    if (ctx->publishing && s->relay_failover) {
+
+        /* relay switches origin; keep subscribers silently and make them
+         * wait for fresh codec headers from the next publisher */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live: relay failover");
+
+        ngx_rtmp_live_set_status(s, NULL, NULL, 0, 0);
+
+    } else if (ctx->publishing || ctx->stream->active) {
         ngx_rtmp_live_stop(s);
     }
 
-    if (ctx->publishing) {
+    if (ctx->publishing && !s->relay_failover) {
         ngx_rtmp_send_status(s, "NetStream.Unpublish.Success",
                              "status", "Stop publishing");
         if (!lacf->idle_streams) {
@@ -692,14 +702,74 @@ next:
     return next_pause(s, v);
 }
 
+static void
+ngx_rtmp_live_update_chunk_class(ngx_rtmp_session_t *s,
+    ngx_rtmp_live_stream_t *stream, size_t size)
+{
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_uint_t                      cls;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    stream->frame_size = (stream->frame_size * 15 + size) / 16;
+
+    /* grow until typical frame fits into one chunk,
+     * shrink when it fits into a quarter of chunk */
+
+    cls = stream->chunk_class;
+
+    while (cls + 1 < NGX_RTMP_CHUNK_CLASSES
+           && ngx_rtmp_class_chunk_size(cscf, cls + 1) <= cscf->chunk_size_max
+           && stream->frame_size > ngx_rtmp_class_chunk_size(cscf, cls))
+    {
+        cls++;
+    }
+
+    while (cls > 0
+           && stream->frame_size < ngx_rtmp_class_chunk_size(cscf, cls) / 4)
+    {
+        cls--;
+    }
+
+    if (cls != stream->chunk_class) {
+        ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live: frame_size=%uz, chunk_size %uz -> %uz",
+                       stream->frame_size,
+                       ngx_rtmp_class_chunk_size(cscf, stream->chunk_class),
+                       ngx_rtmp_class_chunk_size(cscf, cls));
+
+        stream->chunk_class = cls;
+    }
+}
+
+
+static void
+ngx_rtmp_live_set_chunk_class(ngx_rtmp_session_t *s, ngx_uint_t cls)
+{
+    ngx_rtmp_core_srv_conf_t       *cscf;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    /* new size applies to messages queued after Set Chunk Size */
+
+    if (ngx_rtmp_send_chunk_size(s, ngx_rtmp_class_chunk_size(cscf, cls))
+        == NGX_OK)
+    {
+        s->out_chunk_class = cls;
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                  ngx_chain_t *in)
 {
     ngx_rtmp_live_ctx_t            *ctx, *pctx;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
-    ngx_chain_t                    *header, *coheader, *meta,
-                                   *apkt, *aapkt, *acopkt, *rpkt;
+    ngx_chain_t                    *header, *coheader, *meta, *aapkt;
+    ngx_chain_t                    *apkt[NGX_RTMP_CHUNK_CLASSES],
+                                   *acopkt[NGX_RTMP_CHUNK_CLASSES],
+                                   *rpkt[NGX_RTMP_CHUNK_CLASSES];
     ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_rtmp_live_app_conf_t       *lacf;
     ngx_rtmp_session_t             *ss;
@@ -708,7 +778,7 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_uint_t                      prio;
     ngx_uint_t                      peers;
     ngx_uint_t                      meta_version;
-    ngx_uint_t                      csidx;
+    ngx_uint_t                      csidx, cls;
     uint32_t                        delta;
     ngx_rtmp_live_chunk_stream_t   *cs;
 #ifdef NGX_DEBUG
@@ -752,9 +822,10 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     s->current_time = h->timestamp;
 
     peers = 0;
-    apkt = NULL;
     aapkt = NULL;
-    acopkt = NULL;
+    ngx_memzero(apkt, sizeof(apkt));
+    ngx_memzero(acopkt, sizeof(acopkt));
+    ngx_memzero(rpkt, sizeof(rpkt));
     header = NULL;
     coheader = NULL;
     meta = NULL;
@@ -766,6 +837,10 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
+    if (cscf->chunk_size_auto && h->type == NGX_RTMP_MSG_VIDEO) {
+        ngx_rtmp_live_update_chunk_class(s, ctx->stream, h->mlen);
+    }
+
     csidx = !(lacf->interleave || h->type == NGX_RTMP_MSG_VIDEO);
 
     cs  = &ctx->cs[csidx];
@@ -802,10 +877,6 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ch.timestamp = lh.timestamp;
     }
 */
-    rpkt = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
-
-    ngx_rtmp_prepare_message(s, &ch, &lh, rpkt);
-
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
     if (codec_ctx) {
@@ -831,8 +902,9 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 coheader = codec_ctx->aac_header;
             }
 
-            if (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 &&
-                ngx_rtmp_is_codec_header(in))
+            if ((codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 ||
+                 codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265) &&
+                ngx_rtmp_is_video_codec_header(in))
             {
                 prio = 0;
                 mandatory = 1;
@@ -855,6 +927,16 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ss = pctx->session;
         cs = &pctx->cs[csidx];
 
+        /* packets are prepared once per chunk size class */
+
+        if (cscf->chunk_size_auto
+            && ss->out_chunk_class != ctx->stream->chunk_class)
+        {
+            ngx_rtmp_live_set_chunk_class(ss, ctx->stream->chunk_class);
+        }
+
+        cls = ss->out_chunk_class;
+
         /* send metadata */
 
         if (meta && meta_version != pctx->meta_version) {
@@ -894,8 +976,9 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 continue;
             }
 
-            if (lacf->wait_key && prio != NGX_RTMP_VIDEO_KEY_FRAME &&
-               (lacf->interleave || h->type == NGX_RTMP_MSG_VIDEO))
+            if ((lacf->wait_key || ss->out_policy == NGX_RTMP_OUT_KEYFRAME)
+                && prio != NGX_RTMP_VIDEO_KEY_FRAME
+                && (lacf->interleave || h->type == NGX_RTMP_MSG_VIDEO))
             {
                 ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                                "live: skip non-key");
@@ -922,24 +1005,27 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                type_s, lh.timestamp);
 
                 if (header) {
-                    if (apkt == NULL) {
-                        apkt = ngx_rtmp_append_shared_bufs(cscf, NULL, header);
-                        ngx_rtmp_prepare_message(s, &lh, NULL, apkt);
+                    if (apkt[cls] == NULL) {
+                        apkt[cls] = ngx_rtmp_append_class_bufs(cscf, cls, NULL,
+                                                               header);
+                        ngx_rtmp_prepare_message(s, &lh, NULL, apkt[cls]);
                     }
 
-                    rc = ngx_rtmp_send_message(ss, apkt, 0);
+                    rc = ngx_rtmp_send_message(ss, apkt[cls], 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
                 }
 
                 if (coheader) {
-                    if (acopkt == NULL) {
-                        acopkt = ngx_rtmp_append_shared_bufs(cscf, NULL, coheader);
-                        ngx_rtmp_prepare_message(s, &clh, NULL, acopkt);
+                    if (acopkt[cls] == NULL) {
+                        acopkt[cls] = ngx_rtmp_append_class_bufs(cscf, cls,
+                                                                 NULL,
+                                                                 coheader);
+                        ngx_rtmp_prepare_message(s, &clh, NULL, acopkt[cls]);
                     }
 
-                    rc = ngx_rtmp_send_message(ss, acopkt, 0);
+                    rc = ngx_rtmp_send_message(ss, acopkt[cls], 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
@@ -960,12 +1046,13 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                "live: abs %s packet timestamp=%uD",
                                type_s, ch.timestamp);
 
-                if (apkt == NULL) {
-                    apkt = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
-                    ngx_rtmp_prepare_message(s, &ch, NULL, apkt);
+                if (apkt[cls] == NULL) {
+                    apkt[cls] = ngx_rtmp_append_class_bufs(cscf, cls, NULL,
+                                                           in);
+                    ngx_rtmp_prepare_message(s, &ch, NULL, apkt[cls]);
                 }
 
-                rc = ngx_rtmp_send_message(ss, apkt, prio);
+                rc = ngx_rtmp_send_message(ss, apkt[cls], prio);
                 if (rc != NGX_OK) {
                     continue;
                 }
@@ -990,11 +1077,26 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                        "live: rel %s packet delta=%uD",
                        type_s, delta);
 
-        if (ngx_rtmp_send_message(ss, rpkt, prio) != NGX_OK) {
+        if (rpkt[cls] == NULL) {
+            rpkt[cls] = ngx_rtmp_append_class_bufs(cscf, cls, NULL, in);
+            ngx_rtmp_prepare_message(s, &ch, &lh, rpkt[cls]);
+        }
+
+        if (ngx_rtmp_send_message(ss, rpkt[cls], prio) != NGX_OK) {
             ++pctx->ndropped;
 
             cs->dropped += delta;
 
+            if (ss->out_policy == NGX_RTMP_OUT_KEYFRAME) {
+                ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                               "live: overflow, wait for key frame");
+
+                pctx->cs[0].active = 0;
+                pctx->cs[0].dropped = 0;
+                pctx->cs[1].active = 0;
+                pctx->cs[1].dropped = 0;
+            }
+
             if (mandatory) {
                 ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                                "live: mandatory packet failed");
@@ -1009,22 +1111,24 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ss->current_time = cs->timestamp;
     }
 
-    if (rpkt) {
-        ngx_rtmp_free_shared_chain(cscf, rpkt);
-    }
+    for (cls = 0; cls < NGX_RTMP_CHUNK_CLASSES; cls++) {
+        if (rpkt[cls]) {
+            ngx_rtmp_free_shared_chain(cscf, rpkt[cls]);
+        }
+
+        if (apkt[cls]) {
+            ngx_rtmp_free_shared_chain(cscf, apkt[cls]);
+        }
 
-    if (apkt) {
-        ngx_rtmp_free_shared_chain(cscf, apkt);
+        if (acopkt[cls]) {
+            ngx_rtmp_free_shared_chain(cscf, acopkt[cls]);
+        }
     }
 
     if (aapkt) {
         ngx_rtmp_free_shared_chain(cscf, aapkt);
     }
 
-    if (acopkt) {
-        ngx_rtmp_free_shared_chain(cscf, acopkt);
-    }
-
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_in, h->mlen);
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_out, h->mlen * peers);
 
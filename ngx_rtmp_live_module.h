@@ -52,6 +52,8 @@ struct ngx_rtmp_live_stream_s {
     ngx_rtmp_bandwidth_t                bw_in_video;
     ngx_rtmp_bandwidth_t                bw_out;
     ngx_msec_t                          epoch;
+    size_t                              frame_size;  /* average video */
+    ngx_uint_t                          chunk_class;
     unsigned                            active:1;
     unsigned                            publishing:1;
 };
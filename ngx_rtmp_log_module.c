@@ -24,6 +24,7 @@ static char * ngx_rtmp_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static char * ngx_rtmp_log_compile_format(ngx_conf_t *cf, ngx_array_t *ops,
        ngx_array_t *args, ngx_uint_t s);
+static void ngx_rtmp_log_exit_process(ngx_cycle_t *cycle);
 
 
 typedef struct ngx_rtmp_log_op_s ngx_rtmp_log_op_t;
@@ -57,10 +58,32 @@ typedef struct {
 } ngx_rtmp_log_fmt_t;
 
 
+/*
+ * Per-worker output buffer of log file. It is kept by this module rather
+ * than in file->data which http access_log may use for the same file.
+ */
+typedef struct {
+    ngx_open_file_t            *file;
+    u_char                     *start;
+    u_char                     *pos;
+    u_char                     *last;
+    ngx_event_t                *event;
+    ngx_msec_t                  flush;
+} ngx_rtmp_log_buf_t;
+
+
+static void ngx_rtmp_log_flush(ngx_rtmp_log_buf_t *buffer, ngx_log_t *log);
+static void ngx_rtmp_log_flush_handler(ngx_event_t *ev);
+
+
 typedef struct {
     ngx_open_file_t            *file;
+    ngx_rtmp_log_buf_t         *buffer;
     time_t                      disk_full_time;
     time_t                      error_log_time;
+#if (nginx_version >= 1007001)
+    ngx_syslog_peer_t          *syslog_peer;
+#endif
     ngx_rtmp_log_fmt_t *format;
 } ngx_rtmp_log_t;
 
@@ -73,6 +96,7 @@ typedef struct {
 
 typedef struct {
     ngx_array_t                 formats; /* ngx_rtmp_log_fmt_t */
+    ngx_array_t                 buffers; /* ngx_rtmp_log_buf_t * */
     ngx_uint_t                  combined_used;
 } ngx_rtmp_log_main_conf_t;
 
@@ -91,7 +115,7 @@ static ngx_str_t ngx_rtmp_access_log = ngx_string(NGX_HTTP_LOG_PATH);
 static ngx_command_t  ngx_rtmp_log_commands[] = {
 
     { ngx_string("access_log"),
-      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_1MORE,
       ngx_rtmp_log_set_log,
       NGX_RTMP_APP_CONF_OFFSET,
       0,
@@ -130,7 +154,7 @@ ngx_module_t  ngx_rtmp_log_module = {
     NULL,                                   /* init process */
     NULL,                                   /* init thread */
     NULL,                                   /* exit thread */
-    NULL,                                   /* exit process */
+    ngx_rtmp_log_exit_process,              /* exit process */
     NULL,                                   /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -487,6 +511,13 @@ ngx_rtmp_log_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    if (ngx_array_init(&lmcf->buffers, cf->pool, 1,
+                       sizeof(ngx_rtmp_log_buf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
     fmt = ngx_array_push(&lmcf->formats);
     if (fmt == NULL) {
         return NULL;
@@ -553,8 +584,12 @@ ngx_rtmp_log_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    log->buffer = NULL;
     log->disk_full_time = 0;
     log->error_log_time = 0;
+#if (nginx_version >= 1007001)
+    log->syslog_peer = NULL;
+#endif
 
     lmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_log_module);
     fmt = lmcf->formats.elts;
@@ -574,8 +609,11 @@ ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_rtmp_log_main_conf_t   *lmcf;
     ngx_rtmp_log_fmt_t         *fmt;
     ngx_rtmp_log_t             *log;
-    ngx_str_t                  *value, name;
+    ngx_rtmp_log_buf_t         *buffer, **pbuf;
+    ngx_str_t                  *value, name, s;
     ngx_uint_t                  n;
+    ssize_t                     size;
+    ngx_msec_t                  flush;
 
     value = cf->args->elts;
 
@@ -600,9 +638,28 @@ ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     lmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_log_module);
 
-    log->file = ngx_conf_open_file(cf->cycle, &value[1]);
-    if (log->file == NULL) {
+    if (ngx_strncmp(value[1].data, "syslog:", 7) == 0) {
+
+#if (nginx_version >= 1007001)
+        log->syslog_peer = ngx_pcalloc(cf->pool, sizeof(ngx_syslog_peer_t));
+        if (log->syslog_peer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_syslog_process_conf(cf, log->syslog_peer) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "syslog logging requires nginx 1.7.1 or later");
         return NGX_CONF_ERROR;
+#endif
+
+    } else {
+        log->file = ngx_conf_open_file(cf->cycle, &value[1]);
+        if (log->file == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     if (cf->args->nelts == 2) {
@@ -632,6 +689,127 @@ ngx_rtmp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    size = 0;
+    flush = 0;
+
+    for (n = 3; n < cf->args->nelts; n++) {
+
+        if (ngx_strncmp(value[n].data, "buffer=", 7) == 0) {
+            s.len = value[n].len - 7;
+            s.data = value[n].data + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[n].data, "flush=", 6) == 0) {
+            s.len = value[n].len - 6;
+            s.data = value[n].data + 6;
+
+            flush = ngx_parse_time(&s, 0);
+
+            if (flush == (ngx_msec_t) NGX_ERROR || flush == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[n]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (flush && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no buffer is defined for access_log \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (log->file == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "buffered logs cannot be used with syslog");
+        return NGX_CONF_ERROR;
+    }
+
+    /* logs of one file share the buffer to keep lines in order */
+
+    pbuf = lmcf->buffers.elts;
+    for (n = 0; n < lmcf->buffers.nelts; n++) {
+        buffer = pbuf[n];
+
+        if (buffer->file != log->file) {
+            continue;
+        }
+
+        if ((size_t) (buffer->last - buffer->start) != (size_t) size
+            || buffer->flush != flush)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "access_log \"%V\" already defined "
+                               "with conflicting parameters",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        log->buffer = buffer;
+
+        return NGX_CONF_OK;
+    }
+
+    buffer = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_log_buf_t));
+    if (buffer == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->file = log->file;
+
+    buffer->start = ngx_pnalloc(cf->pool, size);
+    if (buffer->start == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + size;
+
+    if (flush) {
+        buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+        if (buffer->event == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        buffer->event->data = buffer;
+        buffer->event->handler = ngx_rtmp_log_flush_handler;
+        buffer->event->log = &cf->cycle->new_log;
+#if (nginx_version >= 1007011)
+        buffer->event->cancelable = 1;
+#endif
+
+        buffer->flush = flush;
+    }
+
+    pbuf = ngx_array_push(&lmcf->buffers);
+    if (pbuf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *pbuf = buffer;
+    log->buffer = buffer;
+
     return NGX_CONF_OK;
 }
 
@@ -880,6 +1058,13 @@ ngx_rtmp_log_write(ngx_rtmp_session_t *s, ngx_rtmp_log_t *log, u_char *buf,
     ssize_t n;
     int     err;
 
+#if (nginx_version >= 1007001)
+    if (log->syslog_peer) {
+        (void) ngx_syslog_send(log->syslog_peer, buf, len);
+        return;
+    }
+#endif
+
     err = 0;
     name = log->file->name.data;
     n = ngx_write_fd(log->file->fd, buf, len);
@@ -913,6 +1098,75 @@ ngx_rtmp_log_write(ngx_rtmp_session_t *s, ngx_rtmp_log_t *log, u_char *buf,
 }
 
 
+static void
+ngx_rtmp_log_flush(ngx_rtmp_log_buf_t *buffer, ngx_log_t *log)
+{
+    size_t               len;
+    ssize_t              n;
+    ngx_open_file_t     *file;
+
+    file = buffer->file;
+
+    len = buffer->pos - buffer->start;
+
+    if (len == 0) {
+        return;
+    }
+
+    n = ngx_write_fd(file->fd, buffer->start, len);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed",
+                      file->name.data);
+
+    } else if ((size_t) n != len) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                      file->name.data, n, len);
+    }
+
+    buffer->pos = buffer->start;
+
+    if (buffer->event && buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+
+static void
+ngx_rtmp_log_flush_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                   "rtmp log buffer flush handler");
+
+    ngx_rtmp_log_flush(ev->data, ev->log);
+}
+
+
+static void
+ngx_rtmp_log_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  n;
+    ngx_rtmp_conf_ctx_t        *ctx;
+    ngx_rtmp_log_buf_t        **pbuf;
+    ngx_rtmp_log_main_conf_t   *lmcf;
+
+    ctx = (ngx_rtmp_conf_ctx_t *) ngx_get_conf(cycle->conf_ctx,
+                                               ngx_rtmp_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    lmcf = ctx->main_conf[ngx_rtmp_log_module.ctx_index];
+
+    pbuf = lmcf->buffers.elts;
+    for (n = 0; n < lmcf->buffers.nelts; n++) {
+        ngx_rtmp_log_flush(pbuf[n], cycle->log);
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                         ngx_chain_t *in)
@@ -920,6 +1174,7 @@ ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_log_app_conf_t    *lacf;
     ngx_rtmp_log_t             *log;
     ngx_rtmp_log_op_t          *op;
+    ngx_rtmp_log_buf_t         *buffer;
     ngx_uint_t                  n, i;
     u_char                     *line, *p;
     size_t                      len;
@@ -948,20 +1203,73 @@ ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             len += op->getlen(s, op);
         }
 
+#if (nginx_version >= 1007001)
+        if (log->syslog_peer) {
+            len += NGX_SYSLOG_MAX_STR;
+
+        } else {
+            len += NGX_LINEFEED_SIZE;
+        }
+#else
         len += NGX_LINEFEED_SIZE;
+#endif
+
+        buffer = log->buffer;
+
+        if (buffer) {
 
-        line = ngx_palloc(s->connection->pool, len);
+            if (len > (size_t) (buffer->last - buffer->pos)) {
+                ngx_rtmp_log_flush(buffer, s->connection->log);
+            }
+
+            if (len <= (size_t) (buffer->last - buffer->pos)) {
+
+                /* format straight into the buffer */
+
+                p = buffer->pos;
+
+                if (buffer->event && p == buffer->start) {
+                    ngx_add_timer(buffer->event, buffer->flush);
+                }
+
+                op = log->format->ops->elts;
+                for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
+                    p = op->getdata(s, p, op);
+                }
+
+                ngx_linefeed(p);
+
+                buffer->pos = p;
+
+                continue;
+            }
+        }
+
+        line = ngx_pnalloc(s->connection->pool, len);
         if (line == NULL) {
             return NGX_OK;
         }
 
         p = line;
+
+#if (nginx_version >= 1007001)
+        if (log->syslog_peer) {
+            p = ngx_syslog_add_header(log->syslog_peer, line);
+        }
+#endif
+
         op = log->format->ops->elts;
         for (n = 0; n < log->format->ops->nelts; ++n, ++op) {
             p = op->getdata(s, p, op);
         }
 
+#if (nginx_version >= 1007001)
+        if (log->syslog_peer == NULL) {
+            ngx_linefeed(p);
+        }
+#else
         ngx_linefeed(p);
+#endif
 
         ngx_rtmp_log_write(s, log, line, p - line);
     }
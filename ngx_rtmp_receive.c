@@ -12,6 +12,32 @@
 #include <string.h>
 
 
+#define NGX_RTMP_AMF_SCRATCH_SIZE   8192
+
+
+static u_char           ngx_rtmp_amf_scratch_data[NGX_RTMP_AMF_SCRATCH_SIZE];
+static ngx_buf_t        ngx_rtmp_amf_scratch;
+
+
+/*
+ * AMF string views split between chunks are copied to scratch buffer;
+ * they stay valid until next AMF message is read
+ */
+
+static ngx_buf_t *
+ngx_rtmp_amf_reset_scratch(void)
+{
+    ngx_buf_t  *b;
+
+    b = &ngx_rtmp_amf_scratch;
+
+    b->start = b->pos = b->last = ngx_rtmp_amf_scratch_data;
+    b->end = b->start + sizeof(ngx_rtmp_amf_scratch_data);
+
+    return b;
+}
+
+
 ngx_int_t
 ngx_rtmp_protocol_message_handler(ngx_rtmp_session_t *s,
         ngx_rtmp_header_t *h, ngx_chain_t *in)
@@ -372,15 +398,18 @@ ngx_rtmp_amf_message_handler(ngx_rtmp_session_t *s,
     ngx_rtmp_core_main_conf_t  *cmcf;
     ngx_array_t                *ch;
     ngx_rtmp_handler_pt        *ph;
-    size_t                      len, n;
+    ngx_uint_t                  key;
+    ngx_str_t                   name;
+    size_t                      n;
+    u_char                      low[128];
 
-    static u_char               func[128];
+    static ngx_str_t            func;
 
     static ngx_rtmp_amf_elt_t   elts[] = {
 
-        { NGX_RTMP_AMF_STRING,
+        { NGX_RTMP_AMF_STRING | NGX_RTMP_AMF_VIEW,
           ngx_null_string,
-          func,   sizeof(func) },
+          &func, 0 },
     };
 
     /* AMF command names come with string type, but shared object names
@@ -408,8 +437,9 @@ ngx_rtmp_amf_message_handler(ngx_rtmp_session_t *s,
     /* read AMF func name & transaction id */
     ngx_memzero(&act, sizeof(act));
     act.link = in;
+    act.scratch = ngx_rtmp_amf_reset_scratch();
     act.log = s->connection->log;
-    memset(func, 0, sizeof(func));
+    ngx_str_null(&func);
 
     if (ngx_rtmp_amf_read(&act, elts,
                 sizeof(elts) / sizeof(elts[0])) != NGX_OK)
@@ -423,17 +453,25 @@ ngx_rtmp_amf_message_handler(ngx_rtmp_session_t *s,
     in = act.link;
     in->buf->pos += act.offset;
 
-    len = ngx_strlen(func);
+    /* lowercase copy, input may be relayed as is */
 
-    ch = ngx_hash_find(&cmcf->amf_hash,
-            ngx_hash_strlow(func, func, len), func, len);
+    name.len = ngx_min(func.len, sizeof(low));
+    name.data = low;
+
+    key = ngx_hash_strlow(low, func.data, name.len);
+
+    ch = NULL;
+
+    if (func.len <= sizeof(low)) {
+        ch = ngx_hash_find(&cmcf->amf_hash, key, low, name.len);
+    }
 
     if (ch && ch->nelts) {
         ph = ch->elts;
         for (n = 0; n < ch->nelts; ++n, ++ph) {
             ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                "AMF func '%s' passed to handler %d/%d",
-                func, n, ch->nelts);
+                "AMF func '%V' passed to handler %d/%d",
+                &name, n, ch->nelts);
             switch ((*ph)(s, h, in)) {
                 case NGX_ERROR:
                     return NGX_ERROR;
@@ -443,7 +481,7 @@ ngx_rtmp_amf_message_handler(ngx_rtmp_session_t *s,
         }
     } else {
         ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-            "AMF cmd '%s' no handler", func);
+            "AMF cmd '%V' no handler", &name);
     }
 
     return NGX_OK;
@@ -458,6 +496,7 @@ ngx_rtmp_receive_amf(ngx_rtmp_session_t *s, ngx_chain_t *in,
 
     ngx_memzero(&act, sizeof(act));
     act.link = in;
+    act.scratch = ngx_rtmp_amf_reset_scratch();
     act.log = s->connection->log;
 
     return ngx_rtmp_amf_read(&act, elts, nelts);
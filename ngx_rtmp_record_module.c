@@ -1173,17 +1173,20 @@ ngx_rtmp_record_node_avd(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
     }
 
     if (h->type == NGX_RTMP_MSG_VIDEO) {
-        if (codec_ctx && codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 &&
+        if (codec_ctx && (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 ||
+                          codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265) &&
             !rctx->avc_header_sent)
         {
             ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                           "record: %V skipping until H264 header", &rracf->id);
+                           "record: %V skipping until H264/H265 header",
+                           &rracf->id);
             return NGX_OK;
         }
 
         if (ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_KEY_FRAME &&
-            ((codec_ctx && codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) ||
-             !ngx_rtmp_is_codec_header(in)))
+            ((codec_ctx && codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264 &&
+              codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H265) ||
+             !ngx_rtmp_is_video_codec_header(in)))
         {
             rctx->video_key_sent = 1;
         }
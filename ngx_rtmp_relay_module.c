@@ -27,6 +27,8 @@ static ngx_int_t ngx_rtmp_relay_publish(ngx_rtmp_session_t *s,
 static ngx_rtmp_relay_ctx_t * ngx_rtmp_relay_create_connection(
        ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
        ngx_rtmp_relay_target_t *target);
+static ngx_int_t ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s,
+       ngx_uint_t id);
 
 
 /*                _____
@@ -45,11 +47,13 @@ static ngx_rtmp_relay_ctx_t * ngx_rtmp_relay_create_connection(
 
 #define NGX_RTMP_RELAY_CONNECT_TRANS            1
 #define NGX_RTMP_RELAY_CREATE_STREAM_TRANS      2
+#define NGX_RTMP_RELAY_MUX_TRANS                16  /* and above */
 
 
 #define NGX_RTMP_RELAY_CSID_AMF_INI             3
 #define NGX_RTMP_RELAY_CSID_AMF                 5
 #define NGX_RTMP_RELAY_MSID                     1
+#define NGX_RTMP_RELAY_MUX_MAX_MSID             65536
 
 
 /* default flashVer */
@@ -93,6 +97,20 @@ static ngx_command_t  ngx_rtmp_relay_commands[] = {
       offsetof(ngx_rtmp_relay_app_conf_t, pull_reconnect),
       NULL },
 
+    { ngx_string("pull_stall_timeout"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_relay_app_conf_t, pull_stall_timeout),
+      NULL },
+
+    { ngx_string("pull_multiplex"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_relay_app_conf_t, pull_multiplex),
+      NULL },
+
     { ngx_string("session_relay"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -169,6 +187,8 @@ ngx_rtmp_relay_create_app_conf(ngx_conf_t *cf)
     racf->session_relay = NGX_CONF_UNSET;
     racf->push_reconnect = NGX_CONF_UNSET_MSEC;
     racf->pull_reconnect = NGX_CONF_UNSET_MSEC;
+    racf->pull_stall_timeout = NGX_CONF_UNSET_MSEC;
+    racf->pull_multiplex = NGX_CONF_UNSET_UINT;
 
     return racf;
 }
@@ -189,6 +209,9 @@ ngx_rtmp_relay_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
             3000);
     ngx_conf_merge_msec_value(conf->pull_reconnect, prev->pull_reconnect,
             3000);
+    ngx_conf_merge_msec_value(conf->pull_stall_timeout,
+            prev->pull_stall_timeout, 0);
+    ngx_conf_merge_uint_value(conf->pull_multiplex, prev->pull_multiplex, 0);
 
     return NGX_CONF_OK;
 }
@@ -282,6 +305,105 @@ ngx_rtmp_relay_push_reconnect(ngx_event_t *ev)
 }
 
 
+static ngx_rtmp_relay_origin_t *
+ngx_rtmp_relay_select_origin(ngx_rtmp_relay_target_t *target,
+        ngx_msec_t backoff, ngx_uint_t force)
+{
+    ngx_rtmp_relay_origin_t        *o, *best, *oldest;
+    ngx_uint_t                      n, k;
+
+    if (target->origins == NULL || target->origins->nelts == 0) {
+        return NULL;
+    }
+
+    o = target->origins->elts;
+    best = NULL;
+    oldest = NULL;
+
+    /* stick to the current origin while it's healthy; otherwise take
+     * the next one with the fewest consecutive errors which is not
+     * backing off after a recent failure */
+
+    for (k = 0; k < target->origins->nelts; ++k) {
+        n = (target->origin + k) % target->origins->nelts;
+
+        if (oldest == NULL || o[n].last_error < oldest->last_error) {
+            oldest = &o[n];
+        }
+
+        if (o[n].nerrors && ngx_current_msec - o[n].last_error < backoff) {
+            continue;
+        }
+
+        if (best == NULL || o[n].nerrors < best->nerrors) {
+            best = &o[n];
+        }
+    }
+
+    if (best == NULL && force) {
+        best = oldest;
+    }
+
+    if (best) {
+        target->origin = best - o;
+    }
+
+    return best;
+}
+
+
+static void
+ngx_rtmp_relay_origin_error(ngx_rtmp_relay_ctx_t *ctx)
+{
+    ngx_rtmp_relay_origin_t        *origin;
+
+    origin = ctx->origin;
+
+    origin->nerrors++;
+    origin->nfailures++;
+    origin->last_error = ngx_current_msec;
+
+    ngx_log_error(NGX_LOG_WARN, &ctx->log, 0,
+            "relay: origin failed url='%V' errors=%ui stalls=%ui",
+            &origin->url.url, origin->nerrors, origin->nstalls);
+}
+
+
+static void
+ngx_rtmp_relay_stall(ngx_event_t *ev)
+{
+    ngx_rtmp_session_t             *s = ev->data;
+
+    ngx_rtmp_relay_app_conf_t      *racf;
+    ngx_rtmp_relay_ctx_t           *ctx;
+    ngx_msec_t                      elapsed;
+
+    racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+    if (ctx == NULL || ctx->origin == NULL) {
+        return;
+    }
+
+    elapsed = ngx_current_msec - (ctx->last_media ? ctx->last_media :
+                                                    ctx->connect_start);
+
+    if (elapsed < racf->pull_stall_timeout) {
+        ngx_add_timer(ev, racf->pull_stall_timeout - elapsed);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+            "relay: origin stalled name='%V' url='%V' idle=%Mms",
+            &ctx->name, &ctx->url, elapsed);
+
+    ctx->origin->nstalls++;
+    ctx->stalled = 1;
+
+    ngx_rtmp_finalize_session(s);
+}
+
+
 static ngx_int_t
 ngx_rtmp_relay_get_peer(ngx_peer_connection_t *pc, void *data)
 {
@@ -317,52 +439,37 @@ ngx_rtmp_relay_copy_str(ngx_pool_t *pool, ngx_str_t *dst, ngx_str_t *src)
 
 
 static ngx_rtmp_relay_ctx_t *
-ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
-        ngx_rtmp_relay_target_t *target)
+ngx_rtmp_relay_create_ctx(ngx_pool_t *pool, ngx_str_t *name,
+        ngx_rtmp_relay_target_t *target, ngx_rtmp_relay_origin_t *origin)
 {
-    ngx_rtmp_relay_app_conf_t      *racf;
     ngx_rtmp_relay_ctx_t           *rctx;
-    ngx_rtmp_addr_conf_t           *addr_conf;
-    ngx_rtmp_conf_ctx_t            *addr_ctx;
-    ngx_rtmp_session_t             *rs;
-    ngx_peer_connection_t          *pc;
-    ngx_connection_t               *c;
-    ngx_addr_t                     *addr;
-    ngx_pool_t                     *pool;
-    ngx_int_t                       rc;
+    ngx_url_t                      *url;
     ngx_str_t                       v, *uri;
     u_char                         *first, *last, *p;
 
-    racf = ngx_rtmp_get_module_app_conf(cctx, ngx_rtmp_relay_module);
-
-    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, racf->log, 0,
-                   "relay: create remote context");
-
-    pool = NULL;
-    pool = ngx_create_pool(4096, racf->log);
-    if (pool == NULL) {
-        return NULL;
-    }
+    url = origin ? &origin->url : &target->url;
 
     rctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_relay_ctx_t));
     if (rctx == NULL) {
-        goto clear;
+        return NULL;
     }
 
     if (name && ngx_rtmp_relay_copy_str(pool, &rctx->name, name) != NGX_OK) {
-        goto clear;
+        return NULL;
     }
 
-    if (ngx_rtmp_relay_copy_str(pool, &rctx->url, &target->url.url) != NGX_OK) {
-        goto clear;
+    if (ngx_rtmp_relay_copy_str(pool, &rctx->url, &url->url) != NGX_OK) {
+        return NULL;
     }
 
     rctx->tag = target->tag;
     rctx->data = target->data;
+    rctx->origin = origin;
+    rctx->connect_start = ngx_current_msec;
 
 #define NGX_RTMP_RELAY_STR_COPY(to, from)                                     \
     if (ngx_rtmp_relay_copy_str(pool, &rctx->to, &target->from) != NGX_OK) {  \
-        goto clear;                                                           \
+        return NULL;                                                          \
     }
 
     NGX_RTMP_RELAY_STR_COPY(app,        app);
@@ -380,7 +487,7 @@ ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
 
     if (rctx->app.len == 0 || rctx->play_path.len == 0) {
         /* parse uri */
-        uri = &target->url.uri;
+        uri = &url->uri;
         first = uri->data;
         last  = uri->data + uri->len;
         if (first != last && *first == '/') {
@@ -399,7 +506,7 @@ ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
                 v.data = first;
                 v.len = p - first;
                 if (ngx_rtmp_relay_copy_str(pool, &rctx->app, &v) != NGX_OK) {
-                    goto clear;
+                    return NULL;
                 }
             }
 
@@ -414,26 +521,73 @@ ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
                 if (ngx_rtmp_relay_copy_str(pool, &rctx->play_path, &v)
                         != NGX_OK)
                 {
-                    goto clear;
+                    return NULL;
                 }
             }
         }
     }
 
+    return rctx;
+}
+
+
+static ngx_rtmp_relay_ctx_t *
+ngx_rtmp_relay_connect(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
+        ngx_rtmp_relay_target_t *target)
+{
+    ngx_rtmp_relay_app_conf_t      *racf;
+    ngx_rtmp_relay_ctx_t           *rctx;
+    ngx_rtmp_relay_origin_t        *origin;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+    ngx_rtmp_conf_ctx_t            *addr_ctx;
+    ngx_rtmp_session_t             *rs;
+    ngx_peer_connection_t          *pc;
+    ngx_connection_t               *c;
+    ngx_addr_t                     *addr;
+    ngx_url_t                      *url;
+    ngx_uint_t                     *counter;
+    ngx_pool_t                     *pool;
+    ngx_int_t                       rc;
+
+    racf = ngx_rtmp_get_module_app_conf(cctx, ngx_rtmp_relay_module);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, racf->log, 0,
+                   "relay: create remote context");
+
+    url = &target->url;
+    counter = &target->counter;
+
+    origin = ngx_rtmp_relay_select_origin(target, racf->pull_reconnect, 1);
+    if (origin) {
+        url = &origin->url;
+        counter = &origin->counter;
+    }
+
+    pool = NULL;
+    pool = ngx_create_pool(4096, racf->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    rctx = ngx_rtmp_relay_create_ctx(pool, name, target, origin);
+    if (rctx == NULL) {
+        goto clear;
+    }
+
     pc = ngx_pcalloc(pool, sizeof(ngx_peer_connection_t));
     if (pc == NULL) {
         goto clear;
     }
 
-    if (target->url.naddrs == 0) {
+    if (url->naddrs == 0) {
         ngx_log_error(NGX_LOG_ERR, racf->log, 0,
                       "relay: no address");
         goto clear;
     }
 
     /* get address */
-    addr = &target->url.addrs[target->counter % target->url.naddrs];
-    target->counter++;
+    addr = &url->addrs[*counter % url->naddrs];
+    (*counter)++;
 
     /* copy log to keep shared log unchanged */
     rctx->log = *racf->log;
@@ -452,6 +606,9 @@ ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
     if (rc != NGX_OK && rc != NGX_AGAIN ) {
         ngx_log_debug0(NGX_LOG_DEBUG_RTMP, racf->log, 0,
                 "relay: connection failed");
+        if (origin) {
+            ngx_rtmp_relay_origin_error(rctx);
+        }
         goto clear;
     }
     c = pc->connection;
@@ -487,6 +644,14 @@ ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
     (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
 
+    if (origin && racf->pull_stall_timeout) {
+        rctx->stall_evt.data = rs;
+        rctx->stall_evt.log = c->log;
+        rctx->stall_evt.handler = ngx_rtmp_relay_stall;
+
+        ngx_add_timer(&rctx->stall_evt, racf->pull_stall_timeout);
+    }
+
     ngx_rtmp_client_handshake(rs, 1);
     return rctx;
 
@@ -498,6 +663,141 @@ clear:
 }
 
 
+static ngx_rtmp_relay_ctx_t *
+ngx_rtmp_relay_mux_connect(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
+        ngx_rtmp_relay_target_t *target)
+{
+    ngx_rtmp_relay_app_conf_t      *racf;
+    ngx_rtmp_relay_ctx_t           *rctx, *mctx;
+    ngx_rtmp_relay_origin_t        *origin;
+    ngx_rtmp_relay_mux_t           *mux;
+    ngx_rtmp_session_t             *rs;
+
+    racf = ngx_rtmp_get_module_app_conf(cctx, ngx_rtmp_relay_module);
+
+    origin = ngx_rtmp_relay_select_origin(target, racf->pull_reconnect, 1);
+
+    for (mux = racf->mux; mux; mux = mux->next) {
+        if (mux->target == target && mux->origin == origin
+            && mux->nstreams < racf->pull_multiplex
+            && !mux->session->connection->destroyed)
+        {
+            break;
+        }
+    }
+
+    if (mux == NULL) {
+        mctx = ngx_rtmp_relay_connect(cctx, NULL, target);
+        if (mctx == NULL) {
+            return NULL;
+        }
+
+        /* carrier itself carries no media; streams watch for stalls */
+
+        if (mctx->stall_evt.timer_set) {
+            ngx_del_timer(&mctx->stall_evt);
+        }
+
+        mux = ngx_pcalloc(mctx->session->connection->pool,
+                          sizeof(ngx_rtmp_relay_mux_t));
+        if (mux == NULL) {
+            ngx_rtmp_finalize_session(mctx->session);
+            return NULL;
+        }
+
+        mux->session = mctx->session;
+        mux->target = target;
+        mux->origin = mctx->origin;
+        mux->trans = NGX_RTMP_RELAY_MUX_TRANS;
+        mux->next = racf->mux;
+        racf->mux = mux;
+        mctx->mux = mux;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, racf->log, 0,
+                "relay: new mux connection to '%V'", &mctx->url);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, racf->log, 0,
+            "relay: create mux stream '%V' nstreams=%ui",
+            name, mux->nstreams);
+
+    /* stream session shares the socket of its carrier */
+
+    rs = ngx_rtmp_init_virtual_session(cctx, &mux->origin->url.url,
+                                       racf->log);
+    if (rs == NULL) {
+        return NULL;
+    }
+
+    rctx = ngx_rtmp_relay_create_ctx(rs->connection->pool, name, target,
+                                     mux->origin);
+    if (rctx == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        return NULL;
+    }
+
+    rctx->log = *racf->log;
+    rs->relay = 1;
+    rctx->session = rs;
+    ngx_rtmp_set_ctx(rs, rctx, ngx_rtmp_relay_module);
+    ngx_str_set(&rs->flashver, "ngx-local-relay");
+    rs->app = (*(ngx_rtmp_core_app_conf_t **)rs->app_conf)->name;
+
+    if (racf->pull_stall_timeout) {
+        rctx->stall_evt.data = rs;
+        rctx->stall_evt.log = rs->connection->log;
+        rctx->stall_evt.handler = ngx_rtmp_relay_stall;
+
+        ngx_add_timer(&rctx->stall_evt, racf->pull_stall_timeout);
+    }
+
+    rctx->mux = mux;
+    rctx->trans = mux->trans++;
+    rctx->mux_next = mux->streams;
+    mux->streams = rctx;
+    mux->nstreams++;
+
+    if (mux->connected
+        && ngx_rtmp_relay_send_create_stream(mux->session, rctx->trans)
+           != NGX_OK)
+    {
+        /* stream goes down with its carrier */
+        ngx_rtmp_finalize_session(mux->session);
+    }
+
+    return rctx;
+}
+
+
+static ngx_rtmp_relay_ctx_t *
+ngx_rtmp_relay_create_connection(ngx_rtmp_conf_ctx_t *cctx, ngx_str_t* name,
+        ngx_rtmp_relay_target_t *target)
+{
+    ngx_rtmp_relay_app_conf_t      *racf;
+    ngx_rtmp_relay_ctx_t           *rctx;
+    ngx_uint_t                      n;
+
+    if (target->origins == NULL) {
+        return ngx_rtmp_relay_connect(cctx, name, target);
+    }
+
+    racf = ngx_rtmp_get_module_app_conf(cctx, ngx_rtmp_relay_module);
+
+    /* failed origin backs off, so the next attempt picks another one */
+
+    for (n = 0; n < target->origins->nelts; ++n) {
+        rctx = racf->pull_multiplex
+               ? ngx_rtmp_relay_mux_connect(cctx, name, target)
+               : ngx_rtmp_relay_connect(cctx, name, target);
+        if (rctx) {
+            return rctx;
+        }
+    }
+
+    return NULL;
+}
+
+
 static ngx_rtmp_relay_ctx_t *
 ngx_rtmp_relay_create_remote_ctx(ngx_rtmp_session_t *s, ngx_str_t* name,
         ngx_rtmp_relay_target_t *target)
@@ -512,6 +812,37 @@ ngx_rtmp_relay_create_remote_ctx(ngx_rtmp_session_t *s, ngx_str_t* name,
 }
 
 
+static ngx_rtmp_relay_ctx_t *
+ngx_rtmp_relay_create_push_ctx(ngx_rtmp_session_t *s, ngx_str_t* name,
+        ngx_rtmp_relay_target_t *target)
+{
+    ngx_rtmp_relay_ctx_t           *rctx;
+    ngx_rtmp_session_t             *rs;
+
+    rctx = ngx_rtmp_relay_create_remote_ctx(s, name, target);
+    if (rctx == NULL) {
+        return NULL;
+    }
+
+    /* slow target must not hold back others; bound its own queue */
+
+    rs = rctx->session;
+
+    rs->out_time = ngx_pcalloc(rs->connection->pool,
+                               sizeof(ngx_msec_t) * rs->out_queue);
+    if (rs->out_time == NULL) {
+        ngx_rtmp_finalize_session(rs);
+        return NULL;
+    }
+
+    rs->out_max_size = target->queue;
+    rs->out_max_lag = target->max_lag;
+    rs->out_policy = target->overflow;
+
+    return rctx;
+}
+
+
 static ngx_rtmp_relay_ctx_t *
 ngx_rtmp_relay_create_local_ctx(ngx_rtmp_session_t *s, ngx_str_t *name,
         ngx_rtmp_relay_target_t *target)
@@ -736,7 +1067,7 @@ ngx_rtmp_relay_push(ngx_rtmp_session_t *s, ngx_str_t *name,
 
     return ngx_rtmp_relay_create(s, name, target,
             ngx_rtmp_relay_create_local_ctx,
-            ngx_rtmp_relay_create_remote_ctx);
+            ngx_rtmp_relay_create_push_ctx);
 }
 
 
@@ -1022,9 +1353,9 @@ ngx_rtmp_relay_send_connect(ngx_rtmp_session_t *s)
 
 
 static ngx_int_t
-ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s)
+ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s, ngx_uint_t id)
 {
-    static double               trans = NGX_RTMP_RELAY_CREATE_STREAM_TRANS;
+    static double               trans;
 
     static ngx_rtmp_amf_elt_t   out_elts[] = {
 
@@ -1044,6 +1375,47 @@ ngx_rtmp_relay_send_create_stream(ngx_rtmp_session_t *s)
     ngx_rtmp_header_t           h;
 
 
+    trans = id;
+
+    ngx_memzero(&h, sizeof(h));
+    h.csid = NGX_RTMP_RELAY_CSID_AMF_INI;
+    h.type = NGX_RTMP_MSG_AMF_CMD;
+
+    return ngx_rtmp_send_amf(s, &h, out_elts,
+            sizeof(out_elts) / sizeof(out_elts[0]));
+}
+
+
+static ngx_int_t
+ngx_rtmp_relay_send_delete_stream(ngx_rtmp_session_t *s, uint32_t msid)
+{
+    static double               trans;
+    static double               stream;
+
+    static ngx_rtmp_amf_elt_t   out_elts[] = {
+
+        { NGX_RTMP_AMF_STRING,
+          ngx_null_string,
+          "deleteStream", 0 },
+
+        { NGX_RTMP_AMF_NUMBER,
+          ngx_null_string,
+          &trans, 0 },
+
+        { NGX_RTMP_AMF_NULL,
+          ngx_null_string,
+          NULL, 0 },
+
+        { NGX_RTMP_AMF_NUMBER,
+          ngx_null_string,
+          &stream, 0 }
+    };
+
+    ngx_rtmp_header_t           h;
+
+
+    stream = msid;
+
     ngx_memzero(&h, sizeof(h));
     h.csid = NGX_RTMP_RELAY_CSID_AMF_INI;
     h.type = NGX_RTMP_MSG_AMF_CMD;
@@ -1109,7 +1481,8 @@ ngx_rtmp_relay_send_publish(ngx_rtmp_session_t *s)
 
 
 static ngx_int_t
-ngx_rtmp_relay_send_play(ngx_rtmp_session_t *s)
+ngx_rtmp_relay_send_play(ngx_rtmp_session_t *s, ngx_rtmp_relay_ctx_t *ctx,
+        uint32_t msid)
 {
     static double               trans;
     static double               start, duration;
@@ -1142,12 +1515,10 @@ ngx_rtmp_relay_send_play(ngx_rtmp_session_t *s)
     };
 
     ngx_rtmp_header_t           h;
-    ngx_rtmp_relay_ctx_t       *ctx;
     ngx_rtmp_relay_app_conf_t  *racf;
 
 
     racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
     if (racf == NULL || ctx == NULL) {
         return NGX_ERROR;
     }
@@ -1170,18 +1541,113 @@ ngx_rtmp_relay_send_play(ngx_rtmp_session_t *s)
 
     ngx_memzero(&h, sizeof(h));
     h.csid = NGX_RTMP_RELAY_CSID_AMF;
-    h.msid = NGX_RTMP_RELAY_MSID;
+    h.msid = msid;
     h.type = NGX_RTMP_MSG_AMF_CMD;
 
     return ngx_rtmp_send_amf(s, &h, out_elts,
             sizeof(out_elts) / sizeof(out_elts[0])) != NGX_OK
-           || ngx_rtmp_send_set_buflen(s, NGX_RTMP_RELAY_MSID,
-                   racf->buflen) != NGX_OK
+           || ngx_rtmp_send_set_buflen(s, msid, racf->buflen) != NGX_OK
            ? NGX_ERROR
            : NGX_OK;
 }
 
 
+static ngx_rtmp_relay_ctx_t *
+ngx_rtmp_relay_mux_find(ngx_rtmp_relay_mux_t *mux, ngx_uint_t trans)
+{
+    ngx_rtmp_relay_ctx_t       *rctx;
+
+    for (rctx = mux->streams; rctx; rctx = rctx->mux_next) {
+        if (rctx->trans == trans) {
+            return rctx;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_rtmp_relay_mux_result(ngx_rtmp_session_t *s, ngx_rtmp_relay_mux_t *mux,
+        ngx_uint_t trans, uint32_t msid)
+{
+    ngx_rtmp_relay_ctx_t       *rctx;
+    ngx_rtmp_session_t        **streams;
+    ngx_uint_t                  n;
+
+    if (trans == NGX_RTMP_RELAY_CONNECT_TRANS) {
+        mux->connected = 1;
+
+        if (mux->nstreams == 0) {
+            return NGX_ERROR;
+        }
+
+        for (rctx = mux->streams; rctx; rctx = rctx->mux_next) {
+            if (ngx_rtmp_relay_send_create_stream(s, rctx->trans) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    if (trans < NGX_RTMP_RELAY_MUX_TRANS) {
+        return NGX_OK;
+    }
+
+    rctx = ngx_rtmp_relay_mux_find(mux, trans);
+    if (rctx == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "relay: mux stream msid=%uD already closed", msid);
+        return msid ? ngx_rtmp_relay_send_delete_stream(s, msid) : NGX_OK;
+    }
+
+    if (msid == 0 || msid >= NGX_RTMP_RELAY_MUX_MAX_MSID
+        || (msid < s->nmux && s->mux[msid]))
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                "relay: bad mux stream msid=%uD for '%V'",
+                msid, &rctx->name);
+        ngx_rtmp_finalize_session(rctx->session);
+        return NGX_OK;
+    }
+
+    if (msid >= s->nmux) {
+        n = ngx_max(msid + 1, s->nmux * 2);
+
+        streams = ngx_pcalloc(s->connection->pool,
+                              n * sizeof(ngx_rtmp_session_t *));
+        if (streams == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (s->nmux) {
+            ngx_memcpy(streams, s->mux,
+                       s->nmux * sizeof(ngx_rtmp_session_t *));
+        }
+
+        s->mux = streams;
+        s->nmux = n;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+            "relay: mux stream '%V' msid=%uD", &rctx->name, msid);
+
+    s->mux[msid] = rctx->session;
+    rctx->msid = msid;
+
+    if (ngx_rtmp_relay_send_play(s, rctx, msid) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_relay_publish_local(rctx->session) != NGX_OK) {
+        ngx_rtmp_finalize_session(rctx->session);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_chain_t *in)
@@ -1189,6 +1655,7 @@ ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_relay_ctx_t       *ctx;
     static struct {
         double                  trans;
+        double                  msid;
         u_char                  level[32];
         u_char                  code[128];
         u_char                  desc[1024];
@@ -1209,6 +1676,18 @@ ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
           &v.desc, sizeof(v.desc) },
     };
 
+    /* createStream result carries stream id instead of info object */
+    static ngx_rtmp_amf_elt_t   in_var[] = {
+
+        { NGX_RTMP_AMF_OBJECT,
+          ngx_null_string,
+          in_inf, sizeof(in_inf) },
+
+        { NGX_RTMP_AMF_NUMBER,
+          ngx_null_string,
+          &v.msid, 0 },
+    };
+
     static ngx_rtmp_amf_elt_t   in_elts[] = {
 
         { NGX_RTMP_AMF_NUMBER,
@@ -1219,9 +1698,9 @@ ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
           ngx_null_string,
           NULL, 0 },
 
-        { NGX_RTMP_AMF_OBJECT,
+        { NGX_RTMP_AMF_VARIANT,
           ngx_null_string,
-          in_inf, sizeof(in_inf) },
+          in_var, sizeof(in_var) },
     };
 
 
@@ -1241,9 +1720,15 @@ ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             "relay: _result: level='%s' code='%s' description='%s'",
             v.level, v.code, v.desc);
 
+    if (ctx->mux && ctx->mux->session == s) {
+        return ngx_rtmp_relay_mux_result(s, ctx->mux, (ngx_uint_t) v.trans,
+                                         (uint32_t) v.msid);
+    }
+
     switch ((ngx_int_t)v.trans) {
         case NGX_RTMP_RELAY_CONNECT_TRANS:
-            return ngx_rtmp_relay_send_create_stream(s);
+            return ngx_rtmp_relay_send_create_stream(s,
+                    NGX_RTMP_RELAY_CREATE_STREAM_TRANS);
 
         case NGX_RTMP_RELAY_CREATE_STREAM_TRANS:
             if (ctx->publish != ctx && !s->static_relay) {
@@ -1253,7 +1738,9 @@ ngx_rtmp_relay_on_result(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 return ngx_rtmp_relay_play_local(s);
 
             } else {
-                if (ngx_rtmp_relay_send_play(s) != NGX_OK) {
+                if (ngx_rtmp_relay_send_play(s, ctx, NGX_RTMP_RELAY_MSID)
+                    != NGX_OK)
+                {
                     return NGX_ERROR;
                 }
                 return ngx_rtmp_relay_publish_local(s);
@@ -1269,7 +1756,7 @@ static ngx_int_t
 ngx_rtmp_relay_on_error(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_chain_t *in)
 {
-    ngx_rtmp_relay_ctx_t       *ctx;
+    ngx_rtmp_relay_ctx_t       *ctx, *rctx;
     static struct {
         double                  trans;
         u_char                  level[32];
@@ -1324,6 +1811,16 @@ ngx_rtmp_relay_on_error(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             "relay: _error: level='%s' code='%s' description='%s'",
             v.level, v.code, v.desc);
 
+    if (ctx->mux && ctx->mux->session == s) {
+
+        /* stream refused by origin */
+
+        rctx = ngx_rtmp_relay_mux_find(ctx->mux, (ngx_uint_t) v.trans);
+        if (rctx) {
+            ngx_rtmp_finalize_session(rctx->session);
+        }
+    }
+
     return NGX_OK;
 }
 
@@ -1415,6 +1912,185 @@ ngx_rtmp_relay_handshake_done(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+static ngx_int_t
+ngx_rtmp_relay_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_chain_t *in)
+{
+    ngx_rtmp_relay_ctx_t       *ctx;
+    ngx_rtmp_relay_origin_t    *origin;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+    if (ctx == NULL || ctx->origin == NULL || !s->relay) {
+        return NGX_OK;
+    }
+
+    origin = ctx->origin;
+
+    if (ctx->last_media == 0) {
+        origin->connect_time = ngx_current_msec - ctx->connect_start;
+        origin->nerrors = 0;
+
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "relay: origin up url='%V' connect_time=%Mms",
+                &origin->url.url, origin->connect_time);
+    }
+
+    ctx->last_media = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_relay_failover(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_relay_app_conf_t          *racf;
+    ngx_rtmp_relay_ctx_t               *ctx, *nctx, *pctx, **cctx;
+    ngx_rtmp_relay_target_t            *target;
+    ngx_rtmp_conf_ctx_t                 conf_ctx;
+    ngx_uint_t                          hash;
+
+    racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+
+    if (ctx->tag != &ngx_rtmp_relay_module) {
+        return NGX_DECLINED;
+    }
+
+    target = ctx->data;
+
+    /* single origin pull just ends with the stream */
+
+    if (target->origins == NULL || target->origins->nelts < 2) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_rtmp_relay_select_origin(target, racf->pull_reconnect, 0)
+        == NULL)
+    {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                "relay: no healthy origin name='%V'", &ctx->name);
+        return NGX_DECLINED;
+    }
+
+    conf_ctx.main_conf = s->main_conf;
+    conf_ctx.srv_conf = s->srv_conf;
+    conf_ctx.app_conf = s->app_conf;
+
+    nctx = ngx_rtmp_relay_create_connection(&conf_ctx, &ctx->name, target);
+    if (nctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+            "relay: failover name='%V' from='%V' to='%V'",
+            &ctx->name, &ctx->url, &nctx->url);
+
+    s->relay_failover = 1;
+
+    if (s->static_relay) {
+        nctx->session->static_relay = 1;
+        return NGX_OK;
+    }
+
+    /* hand local subscribers over to the new origin connection;
+     * live module keeps them in the stream and resends codec headers
+     * once the new origin starts publishing */
+
+    nctx->publish = nctx;
+    nctx->play = ctx->play;
+
+    for (pctx = nctx->play; pctx; pctx = pctx->next) {
+        pctx->publish = nctx;
+    }
+
+    ctx->play = NULL;
+    ctx->publish = NULL;
+
+    hash = ngx_hash_key(ctx->name.data, ctx->name.len);
+    cctx = &racf->ctx[hash % racf->nbuckets];
+    for (; *cctx && *cctx != ctx; cctx = &(*cctx)->next);
+    if (*cctx) {
+        nctx->next = ctx->next;
+        *cctx = nctx;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_relay_mux_close(ngx_rtmp_session_t *s, ngx_rtmp_relay_ctx_t *ctx)
+{
+    ngx_rtmp_relay_app_conf_t          *racf;
+    ngx_rtmp_relay_mux_t               *mux, **pmux;
+    ngx_rtmp_relay_ctx_t               *rctx, **prctx;
+    ngx_rtmp_session_t                 *ms;
+
+    mux = ctx->mux;
+    ctx->mux = NULL;
+
+    if (mux->session == s) {
+
+        /* carrier is gone, streams follow and fail over on their own */
+
+        racf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_relay_module);
+
+        for (pmux = &racf->mux; *pmux; pmux = &(*pmux)->next) {
+            if (*pmux == mux) {
+                *pmux = mux->next;
+                break;
+            }
+        }
+
+        for (rctx = mux->streams; rctx; rctx = rctx->mux_next) {
+            rctx->mux = NULL;
+            ngx_rtmp_finalize_session(rctx->session);
+        }
+
+        mux->streams = NULL;
+        mux->nstreams = 0;
+
+        return;
+    }
+
+    for (prctx = &mux->streams; *prctx; prctx = &(*prctx)->mux_next) {
+        if (*prctx == ctx) {
+            *prctx = ctx->mux_next;
+            break;
+        }
+    }
+
+    mux->nstreams--;
+
+    ms = mux->session;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+            "relay: close mux stream '%V' msid=%uD nstreams=%ui",
+            &ctx->name, ctx->msid, mux->nstreams);
+
+    if (ctx->msid && ctx->msid < ms->nmux) {
+        ms->mux[ctx->msid] = NULL;
+    }
+
+    if (ms->connection->destroyed) {
+        return;
+    }
+
+    if (ctx->msid) {
+        if (ngx_rtmp_relay_send_delete_stream(ms, ctx->msid) != NGX_OK) {
+            ngx_rtmp_finalize_session(ms);
+            return;
+        }
+    }
+
+    if (mux->nstreams == 0) {
+        ngx_rtmp_finalize_session(ms);
+    }
+}
+
+
 static void
 ngx_rtmp_relay_close(ngx_rtmp_session_t *s)
 {
@@ -1438,6 +2114,34 @@ ngx_rtmp_relay_close(ngx_rtmp_session_t *s)
     //     ngx_add_timer(ctx->static_evt, racf->pull_reconnect);
     // }
 
+    if (ctx->stall_evt.timer_set) {
+        ngx_del_timer(&ctx->stall_evt);
+    }
+
+    if (ctx->mux) {
+        ngx_rtmp_relay_mux_close(s, ctx);
+    }
+
+    if (s->relay && ctx->origin && (s->static_relay || ctx->play)) {
+
+        /* origin went away while still needed; ending a stream which
+         * did deliver media is not held against the origin */
+
+        if (ctx->stalled || ctx->last_media == 0) {
+            ngx_rtmp_relay_origin_error(ctx);
+
+        } else {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, &ctx->log, 0,
+                    "relay: origin closed url='%V'", &ctx->origin->url.url);
+        }
+
+        ctx->origin = NULL;
+
+        if (ngx_rtmp_relay_failover(s) == NGX_OK) {
+            return;
+        }
+    }
+
     if (ctx->publish == NULL) {
         return;
     }
@@ -1541,6 +2245,7 @@ ngx_rtmp_relay_push_pull(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t                          *value, v, n;
     ngx_rtmp_relay_app_conf_t          *racf;
     ngx_rtmp_relay_target_t            *target, **t;
+    ngx_rtmp_relay_origin_t            *origin;
     ngx_url_t                          *u;
     ngx_uint_t                          i;
     ngx_event_t                       **ee, *e;
@@ -1580,6 +2285,22 @@ ngx_rtmp_relay_push_pull(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (is_pull) {
+        target->origins = ngx_array_create(cf->pool, 1,
+                                           sizeof(ngx_rtmp_relay_origin_t));
+        if (target->origins == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        origin = ngx_array_push(target->origins);
+        if (origin == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(origin, sizeof(*origin));
+        origin->url = *u;
+    }
+
     value += 2;
     for (i = 2; i < cf->args->nelts; ++i, ++value) {
         p = ngx_strlchr(value->data, value->data + value->len, '=');
@@ -1634,9 +2355,92 @@ ngx_rtmp_relay_push_pull(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (n.len == sizeof("queue") - 1 &&
+            ngx_strncasecmp(n.data, (u_char *) "queue", n.len) == 0)
+        {
+            target->queue = ngx_parse_size(&v);
+            if (target->queue == (size_t) NGX_ERROR) {
+                return "invalid queue size";
+            }
+            continue;
+        }
+
+        if (n.len == sizeof("max_lag") - 1 &&
+            ngx_strncasecmp(n.data, (u_char *) "max_lag", n.len) == 0)
+        {
+            target->max_lag = ngx_parse_time(&v, 0);
+            if (target->max_lag == (ngx_msec_t) NGX_ERROR) {
+                return "invalid max_lag";
+            }
+            continue;
+        }
+
+        if (n.len == sizeof("overflow") - 1 &&
+            ngx_strncasecmp(n.data, (u_char *) "overflow", n.len) == 0)
+        {
+            if (v.len == sizeof("drop") - 1 &&
+                ngx_strncasecmp(v.data, (u_char *) "drop", v.len) == 0)
+            {
+                target->overflow = NGX_RTMP_OUT_DROP;
+
+            } else if (v.len == sizeof("keyframe") - 1 &&
+                ngx_strncasecmp(v.data, (u_char *) "keyframe", v.len) == 0)
+            {
+                target->overflow = NGX_RTMP_OUT_KEYFRAME;
+
+            } else if (v.len == sizeof("reconnect") - 1 &&
+                ngx_strncasecmp(v.data, (u_char *) "reconnect", v.len) == 0)
+            {
+                target->overflow = NGX_RTMP_OUT_RECONNECT;
+
+            } else {
+                return "invalid overflow policy";
+            }
+            continue;
+        }
+
+        if (n.len == sizeof("backup") - 1 &&
+            ngx_strncasecmp(n.data, (u_char *) "backup", n.len) == 0)
+        {
+            if (!is_pull) {
+                return "backup is only supported for pull";
+            }
+
+            origin = ngx_array_push(target->origins);
+            if (origin == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(origin, sizeof(*origin));
+
+            u = &origin->url;
+            u->default_port = 1935;
+            u->uri_part = 1;
+            u->url = v;
+
+            if (ngx_strncasecmp(u->url.data, (u_char *) "rtmp://", 7) == 0) {
+                u->url.data += 7;
+                u->url.len  -= 7;
+            }
+
+            if (ngx_parse_url(cf->pool, u) != NGX_OK) {
+                if (u->err) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                            "%s in url \"%V\"", u->err, &u->url);
+                }
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         return "unsuppored parameter";
     }
 
+    if (is_pull && (target->queue || target->max_lag || target->overflow)) {
+        return "queue parameters are only supported for push";
+    }
+
     if (is_static) {
 
         if (!is_pull) {
@@ -1760,6 +2564,12 @@ ngx_rtmp_relay_postconfiguration(ngx_conf_t *cf)
     h = ngx_array_push(&cmcf->events[NGX_RTMP_HANDSHAKE_DONE]);
     *h = ngx_rtmp_relay_handshake_done;
 
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+    *h = ngx_rtmp_relay_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+    *h = ngx_rtmp_relay_av;
+
 
     next_publish = ngx_rtmp_publish;
     ngx_rtmp_publish = ngx_rtmp_relay_publish;
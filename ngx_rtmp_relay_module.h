@@ -13,6 +13,19 @@
 #include "ngx_rtmp.h"
 
 
+typedef struct {
+    ngx_url_t                       url;
+    ngx_uint_t                      counter; /* address round-robin */
+
+    /* health state */
+    ngx_msec_t                      connect_time;
+    ngx_msec_t                      last_error;
+    ngx_uint_t                      nerrors; /* consecutive failures */
+    ngx_uint_t                      nfailures;
+    ngx_uint_t                      nstalls;
+} ngx_rtmp_relay_origin_t;
+
+
 typedef struct {
     ngx_url_t                       url;
     ngx_str_t                       app;
@@ -29,10 +42,20 @@ typedef struct {
     void                           *tag;     /* usually module reference */
     void                           *data;    /* module-specific data */
     ngx_uint_t                      counter; /* mutable connection counter */
+
+    /* push queue bounds, see ngx_rtmp_send_message() */
+    size_t                          queue;
+    ngx_msec_t                      max_lag;
+    ngx_uint_t                      overflow;
+
+    /* pull group: origins[0] is the primary url, the rest are backups */
+    ngx_array_t                    *origins; /* ngx_rtmp_relay_origin_t */
+    ngx_uint_t                      origin;  /* last selected origin */
 } ngx_rtmp_relay_target_t;
 
 
 typedef struct ngx_rtmp_relay_ctx_s ngx_rtmp_relay_ctx_t;
+typedef struct ngx_rtmp_relay_mux_s ngx_rtmp_relay_mux_t;
 
 struct ngx_rtmp_relay_ctx_s {
     ngx_str_t                       name;
@@ -57,6 +80,31 @@ struct ngx_rtmp_relay_ctx_s {
     ngx_event_t                    *static_evt;
     void                           *tag;
     void                           *data;
+
+    ngx_rtmp_relay_origin_t        *origin;
+    ngx_msec_t                      connect_start;
+    ngx_msec_t                      last_media;
+    ngx_event_t                     stall_evt;
+    unsigned                        stalled:1;
+
+    /* multiplexed pull: stream of a shared upstream connection */
+    ngx_rtmp_relay_mux_t           *mux;
+    ngx_rtmp_relay_ctx_t           *mux_next;
+    ngx_uint_t                      trans;
+    uint32_t                        msid;
+};
+
+
+/* upstream connection carrying several pulled streams */
+struct ngx_rtmp_relay_mux_s {
+    ngx_rtmp_session_t             *session;
+    ngx_rtmp_relay_target_t        *target;
+    ngx_rtmp_relay_origin_t        *origin;
+    ngx_rtmp_relay_ctx_t           *streams;
+    ngx_rtmp_relay_mux_t           *next;
+    ngx_uint_t                      nstreams;
+    ngx_uint_t                      trans;   /* next createStream trans */
+    unsigned                        connected:1;
 };
 
 
@@ -71,6 +119,9 @@ typedef struct {
     ngx_flag_t                  session_relay;
     ngx_msec_t                  push_reconnect;
     ngx_msec_t                  pull_reconnect;
+    ngx_msec_t                  pull_stall_timeout;
+    ngx_uint_t                  pull_multiplex;
+    ngx_rtmp_relay_mux_t       *mux;
     ngx_rtmp_relay_ctx_t        **ctx;
 } ngx_rtmp_relay_app_conf_t;
 
@@ -454,9 +454,9 @@ ngx_rtmp_send_amf(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
-ngx_chain_t *
-ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code, char* level,
-                       char *desc)
+static ngx_chain_t *
+ngx_rtmp_create_status_message(ngx_rtmp_session_t *s, char *code,
+                               char* level, char *desc)
 {
     ngx_rtmp_header_t               h;
     static double                   trans;
@@ -515,6 +515,78 @@ ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code, char* level,
 }
 
 
+static char *
+ngx_rtmp_status_strdup(u_char **p, char *src)
+{
+    char  *dst;
+
+    dst = (char *) *p;
+    *p = ngx_cpymem(*p, src, ngx_strlen(src) + 1);
+
+    return dst;
+}
+
+
+/*
+ * Status messages are constant and do not depend on session; each is
+ * serialized once and then shared by reference. Descriptions come from
+ * code and configuration, so the cache is bounded.
+ */
+
+ngx_chain_t *
+ngx_rtmp_create_status(ngx_rtmp_session_t *s, char *code, char* level,
+                       char *desc)
+{
+    u_char                     *p;
+    ngx_chain_t                *out;
+    ngx_rtmp_status_msg_t      *st;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    for (st = cscf->status; st; st = st->next) {
+        if (ngx_strcmp(st->code, code) == 0
+            && ngx_strcmp(st->desc, desc) == 0
+            && ngx_strcmp(st->level, level) == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                           "create: status code='%s' prepared", code);
+
+            ngx_rtmp_acquire_shared_chain(st->out);
+            return st->out;
+        }
+    }
+
+    out = ngx_rtmp_create_status_message(s, code, level, desc);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    st = ngx_palloc(cscf->pool, sizeof(ngx_rtmp_status_msg_t)
+                                + ngx_strlen(code) + ngx_strlen(level)
+                                + ngx_strlen(desc) + 3);
+    if (st == NULL) {
+        return out;
+    }
+
+    p = (u_char *) (st + 1);
+
+    st->code = ngx_rtmp_status_strdup(&p, code);
+    st->level = ngx_rtmp_status_strdup(&p, level);
+    st->desc = ngx_rtmp_status_strdup(&p, desc);
+
+    /* cache holds its own reference */
+
+    ngx_rtmp_acquire_shared_chain(out);
+
+    st->out = out;
+    st->next = cscf->status;
+    cscf->status = st;
+
+    return out;
+}
+
+
 ngx_int_t
 ngx_rtmp_send_status(ngx_rtmp_session_t *s, char *code, char* level, char *desc)
 {
@@ -598,6 +670,7 @@ ngx_chain_t *
 ngx_rtmp_create_sample_access(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_header_t               h;
+    ngx_rtmp_core_srv_conf_t       *cscf;
 
     static int                      access = 1;
 
@@ -616,14 +689,26 @@ ngx_rtmp_create_sample_access(ngx_rtmp_session_t *s)
           &access, 0 },
     };
 
-    memset(&h, 0, sizeof(h));
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-    h.type = NGX_RTMP_MSG_AMF_META;
-    h.csid = NGX_RTMP_CSID_AMF;
-    h.msid = NGX_RTMP_MSID;
+    if (cscf->sample_access == NULL) {
+        memset(&h, 0, sizeof(h));
+
+        h.type = NGX_RTMP_MSG_AMF_META;
+        h.csid = NGX_RTMP_CSID_AMF;
+        h.msid = NGX_RTMP_MSID;
+
+        cscf->sample_access = ngx_rtmp_create_amf(s, &h, access_elts,
+                                                  sizeof(access_elts)
+                                                  / sizeof(access_elts[0]));
+        if (cscf->sample_access == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_rtmp_acquire_shared_chain(cscf->sample_access);
 
-    return ngx_rtmp_create_amf(s, &h, access_elts,
-                               sizeof(access_elts) / sizeof(access_elts[0]));
+    return cscf->sample_access;
 }
 
 
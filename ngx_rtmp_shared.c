@@ -11,19 +11,27 @@
 
 ngx_chain_t *
 ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf)
+{
+    return ngx_rtmp_alloc_class_buf(cscf, 0);
+}
+
+
+ngx_chain_t *
+ngx_rtmp_alloc_class_buf(ngx_rtmp_core_srv_conf_t *cscf, ngx_uint_t cls)
 {
     u_char                     *p;
     ngx_chain_t                *out;
     ngx_buf_t                  *b;
     size_t                      size;
 
-    if (cscf->free) {
-        out = cscf->free;
-        cscf->free = out->next;
+    if (cscf->free[cls]) {
+        out = cscf->free[cls];
+        cscf->free[cls] = out->next;
 
     } else {
 
-        size = cscf->chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+        size = ngx_rtmp_class_chunk_size(cscf, cls)
+               + NGX_RTMP_MAX_CHUNK_HEADER;
 
         p = ngx_pcalloc(cscf->pool, NGX_RTMP_REFCOUNT_BYTES
                 + sizeof(ngx_chain_t)
@@ -56,19 +64,40 @@ ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf)
 }
 
 
+ngx_uint_t
+ngx_rtmp_shared_chain_class(ngx_rtmp_core_srv_conf_t *cscf, ngx_chain_t *in)
+{
+    size_t                      size;
+    ngx_uint_t                  cls;
+
+    size = in->buf->end - in->buf->start - NGX_RTMP_MAX_CHUNK_HEADER;
+
+    for (cls = 0; cls < NGX_RTMP_CHUNK_CLASSES - 1; cls++) {
+        if (ngx_rtmp_class_chunk_size(cscf, cls) >= size) {
+            break;
+        }
+    }
+
+    return cls;
+}
+
+
 void
 ngx_rtmp_free_shared_chain(ngx_rtmp_core_srv_conf_t *cscf, ngx_chain_t *in)
 {
     ngx_chain_t        *cl;
+    ngx_uint_t          cls;
 
     if (ngx_rtmp_ref_put(in)) {
         return;
     }
 
+    cls = ngx_rtmp_shared_chain_class(cscf, in);
+
     for (cl = in; ; cl = cl->next) {
         if (cl->next == NULL) {
-            cl->next = cscf->free;
-            cscf->free = in;
+            cl->next = cscf->free[cls];
+            cscf->free[cls] = in;
             return;
         }
     }
@@ -78,6 +107,14 @@ ngx_rtmp_free_shared_chain(ngx_rtmp_core_srv_conf_t *cscf, ngx_chain_t *in)
 ngx_chain_t *
 ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
         ngx_chain_t *head, ngx_chain_t *in)
+{
+    return ngx_rtmp_append_class_bufs(cscf, 0, head, in);
+}
+
+
+ngx_chain_t *
+ngx_rtmp_append_class_bufs(ngx_rtmp_core_srv_conf_t *cscf, ngx_uint_t cls,
+        ngx_chain_t *head, ngx_chain_t *in)
 {
     ngx_chain_t                    *l, **ll;
     u_char                         *p;
@@ -95,7 +132,7 @@ ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
     for ( ;; ) {
 
         if (l == NULL || l->buf->last == l->buf->end) {
-            l = ngx_rtmp_alloc_shared_buf(cscf);
+            l = ngx_rtmp_alloc_class_buf(cscf, cls);
             if (l == NULL || l->buf == NULL) {
                 break;
             }
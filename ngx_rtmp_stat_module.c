@@ -13,6 +13,7 @@
 #include "ngx_rtmp_play_module.h"
 #include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_record_module.h"
+#include "hls/ngx_rtmp_hls_module.h"
 
 static ngx_int_t ngx_rtmp_stat_init_process(ngx_cycle_t *cycle);
 static char *ngx_rtmp_stat(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -331,6 +332,31 @@ ngx_rtmp_stat_dump_pool(ngx_http_request_t *r, ngx_chain_t ***lll,
 
 
 
+static void
+ngx_rtmp_stat_queue(ngx_http_request_t *r, ngx_chain_t ***lll,
+    ngx_rtmp_session_t *s)
+{
+    u_char      buf[NGX_INT_T_LEN];
+    ngx_msec_t  lag;
+
+    lag = (s->out_pos == s->out_last ? 0 :
+           ngx_current_msec - s->out_time[s->out_pos]);
+
+    NGX_RTMP_STAT_L("<queue><size>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uz",
+                  s->out_size) - buf);
+    NGX_RTMP_STAT_L("</size><lag>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%M", lag) - buf);
+    NGX_RTMP_STAT_L("</lag><dropped>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%ui",
+                  s->out_dropped) - buf);
+    NGX_RTMP_STAT_L("</dropped><overflows>");
+    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%ui",
+                  s->out_overflows) - buf);
+    NGX_RTMP_STAT_L("</overflows></queue>\r\n");
+}
+
+
 static void
 ngx_rtmp_stat_client(ngx_http_request_t *r, ngx_chain_t ***lll,
     ngx_rtmp_session_t *s, int secure)
@@ -384,6 +410,13 @@ ngx_rtmp_stat_client(ngx_http_request_t *r, ngx_chain_t ***lll,
     NGX_RTMP_STAT_L("<bytes_out>");
     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%ui", (ngx_uint_t) s->out_bytes) - buf);
     NGX_RTMP_STAT_L("</bytes_out>");
+
+    if (s->out_throttled) {
+        NGX_RTMP_STAT_L("<throttled>");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL",
+                      s->out_throttled) - buf);
+        NGX_RTMP_STAT_L("</throttled>");
+    }
 }
 
 
@@ -436,6 +469,8 @@ ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
     ngx_rtmp_live_ctx_t            *ctx;
     ngx_rtmp_record_ctx_t          *rctx;
     ngx_rtmp_record_rec_ctx_t      *recctx;
+    ngx_rtmp_hls_align_t           *align;
+    off_t                           written, payload;
     ngx_rtmp_session_t             *s;
     ngx_int_t                       n;
     ngx_uint_t                      nclients, total_nclients,  rn;
@@ -498,6 +533,10 @@ ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
                                   "%ui", ctx->ndropped) - buf);
                     NGX_RTMP_STAT_L("</dropped>");
 
+                    if (s->out_time) {
+                        ngx_rtmp_stat_queue(r, lll, s);
+                    }
+
                     NGX_RTMP_STAT_L("<avsync>");
                     if (!lacf->interleave) {
                         NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
@@ -518,6 +557,39 @@ ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
                     if (ctx->active) {
                         NGX_RTMP_STAT_L("<active/>");
                     }
+
+                    align = ngx_rtmp_hls_get_align(s);
+                    if (align) {
+                        NGX_RTMP_STAT_L("<hls_align><fragments>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%ui", align->fragments) - buf);
+                        NGX_RTMP_STAT_L("</fragments><missed>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%ui", align->missed) - buf);
+                        NGX_RTMP_STAT_L("</missed><drift>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%i", align->drift) - buf);
+                        NGX_RTMP_STAT_L("</drift><max_drift>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%i", align->max_drift) - buf);
+                        NGX_RTMP_STAT_L("</max_drift></hls_align>");
+                    }
+
+                    if (ngx_rtmp_hls_get_overhead(s, &written, &payload)
+                        == NGX_OK)
+                    {
+                        NGX_RTMP_STAT_L("<hls_ts><bytes>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%O", written) - buf);
+                        NGX_RTMP_STAT_L("</bytes><payload>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%O", payload) - buf);
+                        NGX_RTMP_STAT_L("</payload><overhead>");
+                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                      "%.1f", 100. * (written - payload)
+                                      / written) - buf);
+                        NGX_RTMP_STAT_L("</overhead></hls_ts>");
+                    }
                     rctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_record_module);
                     if (rctx) {
                         recctx = rctx->rec.elts;
@@ -724,12 +796,20 @@ ngx_rtmp_stat_application(ngx_http_request_t *r, ngx_chain_t ***lll,
         ngx_rtmp_core_app_conf_t *cacf)
 {
     ngx_rtmp_stat_loc_conf_t       *slcf;
+    u_char                          buf[NGX_INT64_LEN];
 
     NGX_RTMP_STAT_L("<application>\r\n");
     NGX_RTMP_STAT_L("<name>");
     NGX_RTMP_STAT_ES(&cacf->name);
     NGX_RTMP_STAT_L("</name>\r\n");
 
+    if (cacf->out_bucket) {
+        NGX_RTMP_STAT_L("<throttled>");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL",
+                      ngx_rtmp_bucket_throttled(cacf->out_bucket)) - buf);
+        NGX_RTMP_STAT_L("</throttled>\r\n");
+    }
+
     slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_stat_module);
 
     if (slcf->stat & NGX_RTMP_STAT_LIVE || slcf->stat_secure) {
@@ -834,6 +914,13 @@ ngx_rtmp_stat_handler(ngx_http_request_t *r)
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_in, "in", NGX_RTMP_STAT_BW_BYTES);
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_out, "out", NGX_RTMP_STAT_BW_BYTES);
 
+    if (cmcf->out_bucket) {
+        NGX_RTMP_STAT_L("<throttled>");
+        NGX_RTMP_STAT(nbuf, ngx_snprintf(nbuf, sizeof(nbuf), "%uL",
+                      ngx_rtmp_bucket_throttled(cmcf->out_bucket)) - nbuf);
+        NGX_RTMP_STAT_L("</throttled>\r\n");
+    }
+
     cscf = cmcf->servers.elts;
     for (n = 0; n < cmcf->servers.nelts; ++n, ++cscf) {
         ngx_rtmp_stat_server(r, lll, *cscf);
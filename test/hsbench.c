@@ -0,0 +1,224 @@
+
+/*
+ * RTMP handshake benchmark.
+ *
+ * Performs complex (digest) handshakes against the server as fast as
+ * possible and reports handshakes per second. Run nginx with
+ * worker_processes 1 to get per-core figure.
+ *
+ * cc -O2 -o hsbench hsbench.c -lcrypto
+ * ./hsbench [-h host] [-p port] [-c clients] [-t seconds] [-s scheme]
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+
+#define HS_SIZE     1536
+
+
+static unsigned char client_partial_key[] = "Genuine Adobe Flash Player 001";
+
+
+static int
+io_all(int fd, unsigned char *buf, size_t len, int wr)
+{
+    ssize_t  n;
+
+    while (len) {
+        n = wr ? write(fd, buf, len) : read(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+static int
+handshake(struct sockaddr_in *sin, int scheme)
+{
+    int             fd, one, rc;
+    size_t          base, offs, n;
+    unsigned char   c[1 + HS_SIZE], s[1 + 2 * HS_SIZE], *p, *d;
+    unsigned char   tmp[HS_SIZE], digest[SHA256_DIGEST_LENGTH];
+    unsigned int    len;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    rc = -1;
+
+    if (connect(fd, (struct sockaddr *) sin, sizeof(*sin)) == -1) {
+        goto done;
+    }
+
+    c[0] = 0x03;
+    p = c + 1;
+
+    for (n = 0; n < HS_SIZE; n++) {
+        p[n] = (unsigned char) random();
+    }
+
+    memset(p, 0, 4);
+    p[4] = 0x0C; p[5] = 0x00; p[6] = 0x0D; p[7] = 0x0E;
+
+    base = scheme ? 8 : 772;
+    offs = (p[base] + p[base + 1] + p[base + 2] + p[base + 3]) % 728
+           + base + 4;
+    d = p + offs;
+
+    /* digest is calculated over the packet without digest itself */
+
+    memcpy(tmp, p, d - p);
+    memcpy(tmp + (d - p), d + SHA256_DIGEST_LENGTH,
+           HS_SIZE - (d - p) - SHA256_DIGEST_LENGTH);
+
+    HMAC(EVP_sha256(), client_partial_key, sizeof(client_partial_key) - 1,
+         tmp, HS_SIZE - SHA256_DIGEST_LENGTH, digest, &len);
+
+    memcpy(d, digest, SHA256_DIGEST_LENGTH);
+
+    if (io_all(fd, c, sizeof(c), 1) != 0
+        || io_all(fd, s, sizeof(s), 0) != 0
+        || s[0] != 0x03)
+    {
+        goto done;
+    }
+
+    /* echo S1 as C2; server does not verify response digest */
+
+    if (io_all(fd, s + 1, HS_SIZE, 1) != 0) {
+        goto done;
+    }
+
+    rc = 0;
+
+done:
+    close(fd);
+    return rc;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int                  opt, clients, seconds, scheme, i;
+    const char          *host;
+    unsigned short       port;
+    unsigned long       *count, total, failed;
+    time_t               end;
+    struct sockaddr_in   sin;
+
+    host = "127.0.0.1";
+    port = 1935;
+    clients = 16;
+    seconds = 10;
+    scheme = 0;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:s:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = (unsigned short) atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            scheme = atoi(optarg) ? 1 : 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] "
+                    "[-t seconds] [-s 0|1]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (clients <= 0 || seconds <= 0) {
+        fprintf(stderr, "invalid clients or duration\n");
+        return 1;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+        fprintf(stderr, "invalid address \"%s\"\n", host);
+        return 1;
+    }
+
+    /* [2 * i] successful, [2 * i + 1] failed handshakes of client i */
+
+    count = mmap(NULL, sizeof(unsigned long) * 2 * clients,
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (count == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    end = time(NULL) + seconds;
+
+    for (i = 0; i < clients; i++) {
+        switch (fork()) {
+        case -1:
+            perror("fork");
+            return 1;
+
+        case 0:
+            srandom(getpid());
+            while (time(NULL) < end) {
+                count[2 * i + (handshake(&sin, scheme) == 0 ? 0 : 1)]++;
+            }
+            _exit(0);
+        }
+    }
+
+    while (wait(NULL) > 0) {
+        /* void */
+    }
+
+    total = 0;
+    failed = 0;
+
+    for (i = 0; i < clients; i++) {
+        total += count[2 * i];
+        failed += count[2 * i + 1];
+    }
+
+    printf("%lu handshakes in %d s, %lu failed, %.1f handshakes/s\n",
+           total, seconds, failed, (double) total / seconds);
+
+    return 0;
+}